@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "RuleActions.h"
+
+#define MAX_LINE_LENGTH 1024
+#define INITIAL_TABLE_SIZE 1024
+
+const char *rule_action_names[RULE_ACTIONS] = { "none", "log", "alert", "drop" };
+
+void rule_action_table_init(RuleActionTable *table) {
+	table->actions = NULL;
+	table->size = 0;
+	table->count = 0;
+}
+
+void rule_action_table_destroy(RuleActionTable *table) {
+	free(table->actions);
+	rule_action_table_init(table);
+}
+
+static int parse_action(const char *str) {
+	int i;
+
+	for (i = RULE_ACTION_LOG; i < RULE_ACTIONS; i++) {
+		if (strcmp(str, rule_action_names[i]) == 0)
+			return i;
+	}
+	return RULE_ACTION_NONE;
+}
+
+static int parse_position(const char *str, unsigned short *res) {
+	char *end;
+	long val;
+
+	val = strtol(str, &end, 10);
+	if (end == str || *end || val < 0 || val > 0xFFFF)
+		return -1;
+	*res = (unsigned short)val;
+	return 0;
+}
+
+// Makes room for rule IDs up to rid (new entries have no action)
+static void ensure_size(RuleActionTable *table, unsigned int rid) {
+	unsigned int size;
+
+	if (rid < table->size)
+		return;
+	size = (table->size) ? table->size : INITIAL_TABLE_SIZE;
+	while (size <= rid)
+		size *= 2;
+	if (size > RULE_ACTION_MAX_RID + 1)
+		size = RULE_ACTION_MAX_RID + 1;
+	table->actions = (RuleAction*)realloc(table->actions, sizeof(RuleAction) * size);
+	if (!(table->actions)) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
+	memset(&(table->actions[table->size]), 0, sizeof(RuleAction) * (size - table->size));
+	table->size = size;
+}
+
+int rule_action_table_load(RuleActionTable *table, const char *path) {
+	FILE *f;
+	char line[MAX_LINE_LENGTH];
+	char *ptr, *token, *param, *arg, *end;
+	RuleAction rule;
+	unsigned long rid;
+	int line_num, count;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "[RuleActions] ERROR: Cannot open rule actions file: %s\n", path);
+		return -1;
+	}
+
+	line_num = 0;
+	count = 0;
+	while (fgets(line, MAX_LINE_LENGTH, f)) {
+		line_num++;
+		ptr = line;
+		while (isspace((unsigned char)*ptr))
+			ptr++;
+		if (*ptr == '\0' || *ptr == '#')
+			continue;
+
+		// Rule ID
+		token = strsep(&ptr, " \t\r\n");
+		rid = strtoul(token, &end, 10);
+		if (end == token || *end || rid > RULE_ACTION_MAX_RID) {
+			fprintf(stderr, "[RuleActions] ERROR: Invalid rule ID in line %d: %s\n", line_num, token);
+			fclose(f);
+			return -1;
+		}
+
+		// Action
+		do {
+			token = strsep(&ptr, " \t\r\n");
+		} while (token && *token == '\0');
+		memset(&rule, 0, sizeof(RuleAction));
+		if (!token || (rule.action = parse_action(token)) == RULE_ACTION_NONE) {
+			fprintf(stderr, "[RuleActions] ERROR: Missing or unknown action in line %d\n", line_num);
+			fclose(f);
+			return -1;
+		}
+
+		// Position constraints
+		while ((token = strsep(&ptr, " \t\r\n"))) {
+			if (*token == '\0')
+				continue;
+			param = strsep(&token, "=");
+			arg = token;
+			if (strcmp(param, "offset") == 0 && arg && parse_position(arg, &(rule.offset)) == 0) {
+				continue;
+			} else if (strcmp(param, "depth") == 0 && arg && parse_position(arg, &(rule.depth)) == 0) {
+				continue;
+			}
+			fprintf(stderr, "[RuleActions] ERROR: Invalid parameter in line %d: %s\n", line_num, param);
+			fclose(f);
+			return -1;
+		}
+
+		ensure_size(table, (unsigned int)rid);
+		if (table->actions[rid].action == RULE_ACTION_NONE)
+			table->count++;
+		table->actions[rid] = rule;
+		count++;
+	}
+	fclose(f);
+
+	return count;
+}
@@ -0,0 +1,60 @@
+#ifndef RULEACTIONS_H_
+#define RULEACTIONS_H_
+
+/*
+ * Actions taken when the DPI service reports a rule match, loaded at startup from a text file with
+ * one rule per line:
+ *
+ *   <rid> (log|alert|drop) [offset=<#>] [depth=<#>]
+ *
+ * offset and depth constrain the position of the match start in the packet payload, as in Snort:
+ * a match counts only if it starts at offset or later and less than depth bytes after offset
+ * (depth=0 means unlimited). Empty lines and lines starting with '#' are ignored.
+ *
+ * The table is a flat array indexed by rule ID, so evaluating a report is a single lookup and
+ * needs no allocation. It is read only once loaded and shared by all workers.
+ */
+
+#define RULE_ACTION_NONE 0
+#define RULE_ACTION_LOG 1
+#define RULE_ACTION_ALERT 2
+#define RULE_ACTION_DROP 3
+#define RULE_ACTIONS 4 // Actions are ordered by severity: the verdict for a packet is the highest action it triggers
+
+#define RULE_ACTION_MAX_RID ((1 << 24) - 1)
+
+typedef struct {
+	unsigned short offset;
+	unsigned short depth;
+	unsigned char action;
+} RuleAction;
+
+typedef struct {
+	RuleAction *actions; // Indexed by rule ID
+	unsigned int size; // Largest rule ID in the table + 1
+	int count;
+} RuleActionTable;
+
+// Initializes an empty table (every rule ID maps to RULE_ACTION_NONE)
+void rule_action_table_init(RuleActionTable *table);
+
+// Loads the rules of the given file. Returns the number of rules loaded, or -1 on error.
+int rule_action_table_load(RuleActionTable *table, const char *path);
+
+void rule_action_table_destroy(RuleActionTable *table);
+
+extern const char *rule_action_names[RULE_ACTIONS];
+
+// Returns the action triggered by a match of rule rid starting at the given payload position
+static inline int rule_action_evaluate(const RuleActionTable *table, unsigned int rid, unsigned int position) {
+	const RuleAction *rule;
+
+	if (rid >= table->size)
+		return RULE_ACTION_NONE;
+	rule = &(table->actions[rid]);
+	if (position < rule->offset || (rule->depth && position - rule->offset >= rule->depth))
+		return RULE_ACTION_NONE;
+	return rule->action;
+}
+
+#endif /* RULEACTIONS_H_ */
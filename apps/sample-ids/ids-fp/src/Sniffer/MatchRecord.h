@@ -1,18 +1,18 @@
 /*
- * MatchReport.h
+ * MatchRecord.h
  *
  *  Created on: Jun 4, 2014
  *      Author: yotamhc
  */
 
-#ifndef MATCHREPORT_H_
-#define MATCHREPORT_H_
+#ifndef MATCHRECORD_H_
+#define MATCHRECORD_H_
 
 typedef struct {
 	int rid;
 	int startIdxInPacket;
 	int startIdxInFlow;
-} MatchReport;
+} MatchRecord;
 
 
-#endif /* MATCHREPORT_H_ */
+#endif /* MATCHRECORD_H_ */
@@ -1,3 +1,6 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <pcap.h>
 #include <pcap.h>
 #include <stdio.h>
@@ -6,6 +9,7 @@
 #include <unistd.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -19,19 +23,26 @@
 #include <string.h>
 #include <time.h>
 #include "Sniffer.h"
-#include "MatchReport.h"
-#include "../Common/PacketBuffer.h"
+#include "MatchRecord.h"
+#include "Packet/PacketBuffer.h"
+#include "Packet/Capture.h"
+#include "../Common/RuleActions.h"
+#include "NSH/Types.h"
+#include "NSH/Constants.h"
+#include "NSH/MatchReport.h"
 
 #define MAX_PACKET_SIZE 65535
 #define MAX_REPORTED_RULES 65535
 #define MAX_REPORTS 65535
-#define STR_ANY "any"
-#define STR_FILTER "ip"
+#define MAX_THREADS 8
 #define MAGIC_NUM 0xDEE4
-#define BUFFER_TIMEOUT 10 // seconds
-#define BUFFER_CLEANNING_INTERVAL 3 // seconds
+#define DEFAULT_BUFFER_TIMEOUT 100 // milliseconds
+#define PCAP_READ_TIMEOUT 1 // milliseconds (deliver captured packets to the workers without delay)
 #define IP_TOS_HAS_MATCHES_MASK 0xC0
 #define IP_TOS_UNSET_MATCHES_MASK 0x3F
+#define NSH_MD_TYPE_VAR_LEN 2
+#define NSH_LENGTH_MASK 0x3F // Length of the NSH header (in 4-byte words) in the base header
+#define NSH_MD_LENGTH_MASK 0x1F // Length of the variable metadata (in 4-byte words) in the TLV header
 
 #define REPORT_PACKET_OFFSET_MAGIC_NUM 0
 #define REPORT_PACKET_OFFSET_NUM_REPORTS 2
@@ -41,359 +52,505 @@
 #define REPORT_PACKET_REPORT_SIZE 4
 #define REPORT_PACKET_OFFSET_START_IDX 2
 
-#define USAGE "Usage: %s (in=<iface>|infile=<file>) (out=<iface>|outfile=<file>) [last] [batch]\n\tin=<iface>\tSet input capture interface\n\tout=<iface>\tSet output interface\n\tinfile=<file>\tSet input pcap file (cannot use with 'in')\n\toutfile=<file>\tSet output pcap file (cannot use with 'out', not implemented yet)\n\tlast\t\tThis is the last middlebox in chain, do not forward match data.\n\tbatch\t\tReport results in batch mode\n\nThis tool may require root privileges.\n"
+#define USAGE "Usage: %s (in=<iface>|infile=<file>) (out=<iface>|outfile=<file>) [workers=<#>] [actions=<file>] [timeout=<ms>] [last] [batch]\n\tin=<iface>\tSet input capture interface\n\tout=<iface>\tSet output interface\n\tinfile=<file>\tSet input pcap file (cannot use with 'in')\n\toutfile=<file>\tSet output pcap file (cannot use with 'out')\n\tworkers=<#>\tSet number of workers, packets are assigned to workers by flow (default: 1)\n\tactions=<file>\tSet rule actions file (lines of: <rid> (log|alert|drop) [offset=<#>] [depth=<#>])\n\ttimeout=<ms>\tForward (data) or drop (results) packets left unmatched for this long (default: 100)\n\tlast\t\tThis is the last middlebox in chain, do not forward match data (NSH encapsulated packets are decapsulated).\n\tbatch\t\tReport results in batch mode\n\nThis tool may require root privileges.\n"
 
 #define GET_MBPS(bytes, usecs) \
 	((bytes) * 8.0 * 1000000) / ((usecs) * 1024 * 1024)
 
+static struct timespec _100_nanos = {0, 100};
+
+struct st_processor_data;
+
+void *worker_start(void *);
+
+/*
+ * A worker handles all packets of the flows hashed to it (data packets and their results), so it
+ * owns its join buffers, timers and report accumulators and never shares them with other workers.
+ */
 typedef struct {
-	int counter;
-	int linkHdrLen;
-	int last;
-	pcap_t *pcap_in;
-	pcap_t *pcap_out;
-	struct timeval start, end, first_packet, last_packet;
+	int id;
+	struct st_processor_data *processor;
+	PacketBuffer queue; // Packets dispatched to this worker
+	PacketBuffer dataPacketQueue;
+	PacketBuffer matchPacketQueue;
+	TimerWheel bufferTimers; // Expiry of buffered packets, driven by the worker
+	struct timeval first_packet, last_packet;
 	int started; // Used to determine if a packet is the first one we see
 	long bytes;
-	MatchReport reports[MAX_REPORTED_RULES];
+	MatchRecord reports[MAX_REPORTED_RULES]; // Most recent reports (cyclic)
 	long num_reports;
-	PacketBuffer dataPacketQueue;
-	PacketBuffer matchPacketQueue;
-	pthread_t bufferWorker;
+	long actions[RULE_ACTIONS]; // Number of reports that triggered each action
+	long dropped; // Packets dropped by rule actions
+#ifdef __linux__
+	cpu_set_t cpuset;
+	pthread_attr_t attr;
+#endif
+} WorkerData;
+
+typedef struct st_processor_data {
+	int counter;
+	int linktype;
+	int last;
+	Capture *capture;
+	struct timeval start, end;
+	unsigned long buffer_timeout; // milliseconds
+	RuleActionTable ruleActions;
 	int terminated;
 	int batch_mode;
+	pthread_t workers[MAX_THREADS];
+	WorkerData *workerData;
+	int num_workers;
 } ProcessorData;
 
 static ProcessorData *_global_processor;
 
-ProcessorData *init_processor(pcap_t *pcap_in, pcap_t *pcap_out, int linkHdrLen, int last, int batch_mode) {
+static inline unsigned long get_time_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+static void data_packet_expired(PacketBuffer *q, InPacket *pkt, void *arg) {
+	WorkerData *worker = (WorkerData*)arg;
+
+	// No results arrived for this packet, forward it
+#ifdef VERBOSE
+	printf("Data packet timed out, forwarding it (seqnum=%u)\n", pkt->seqnum);
+#endif
+	capture_send(worker->processor->capture, &(pkt->pkthdr), pkt->pktdata, pkt->pkthdr.caplen);
+	free_buffered_packet(pkt);
+}
+
+static void match_packet_expired(PacketBuffer *q, InPacket *pkt, void *arg) {
+	// The data packet of these results is lost, drop them
+#ifdef VERBOSE
+	printf("Match packet timed out, dropping it (seqnum=%u)\n", pkt->seqnum);
+#endif
+	free_buffered_packet(pkt);
+}
+
+ProcessorData *init_processor(Capture *capture, int last, int batch_mode, unsigned long buffer_timeout, int num_workers, RuleActionTable *ruleActions) {
 	ProcessorData *processor;
+	WorkerData *worker;
+	int i, res;
+#ifdef __linux__
+	long num_cpus;
+
+	num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_cpus < 1)
+		num_cpus = 1;
+#endif
 
 	processor = (ProcessorData*)malloc(sizeof(ProcessorData));
 	if (!processor) {
 		fprintf(stderr, "FATAL: Out of memory\n");
 		exit(1);
 	}
+	processor->workerData = (WorkerData*)malloc(sizeof(WorkerData) * num_workers);
+	if (!(processor->workerData)) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
 
 	processor->counter = 0;
-	processor->pcap_in = pcap_in;
-	processor->pcap_out = pcap_out;
-	processor->linkHdrLen = linkHdrLen;
+	processor->capture = capture;
+	processor->linktype = capture->linktype;
 	processor->last = last;
-	processor->bytes = 0;
-	memset(processor->reports, 0, sizeof(MatchReport) * MAX_REPORTED_RULES);
-	processor->num_reports = 0;
 	processor->terminated = 0;
-	processor->started = 0;
 	processor->batch_mode = batch_mode;
-
-
-	packet_buffer_init(&(processor->dataPacketQueue));
-	packet_buffer_init(&(processor->matchPacketQueue));
+	processor->buffer_timeout = buffer_timeout;
+	processor->ruleActions = *ruleActions;
+
+	processor->num_workers = num_workers;
+	for (i = 0; i < num_workers; i++) {
+		worker = &(processor->workerData[i]);
+		worker->id = i;
+		worker->processor = processor;
+		worker->started = 0;
+		worker->bytes = 0;
+		memset(worker->reports, 0, sizeof(MatchRecord) * MAX_REPORTED_RULES);
+		worker->num_reports = 0;
+		memset(worker->actions, 0, sizeof(long) * RULE_ACTIONS);
+		worker->dropped = 0;
+
+		packet_buffer_init(&(worker->queue));
+		packet_buffer_init(&(worker->dataPacketQueue));
+		packet_buffer_init(&(worker->matchPacketQueue));
+
+		timer_wheel_init(&(worker->bufferTimers), get_time_ms());
+		packet_buffer_set_timeout(&(worker->dataPacketQueue), &(worker->bufferTimers), buffer_timeout, data_packet_expired, worker);
+		packet_buffer_set_timeout(&(worker->matchPacketQueue), &(worker->bufferTimers), buffer_timeout, match_packet_expired, worker);
+#ifdef __linux__
+		CPU_ZERO(&(worker->cpuset));
+		CPU_SET(i % num_cpus, &(worker->cpuset));
+		pthread_attr_init(&(worker->attr));
+		pthread_attr_setaffinity_np(&(worker->attr), sizeof(cpu_set_t), &(worker->cpuset));
+		pthread_attr_setscope(&(worker->attr), PTHREAD_SCOPE_SYSTEM);
+		res = pthread_create(&(processor->workers[i]), &(worker->attr), worker_start, worker);
+#else
+		res = pthread_create(&(processor->workers[i]), NULL, worker_start, worker);
+#endif
+		if (res) {
+			fprintf(stderr, "[Sniffer] ERROR: Cannot start worker %d (pthread_create error: %d)\n", i, res);
+			exit(1);
+		}
+	}
 
 	return processor;
 }
 
 void destroy_processor(ProcessorData *processor) {
-	packet_buffer_destroy(&(processor->dataPacketQueue), 1);
-	packet_buffer_destroy(&(processor->matchPacketQueue), 1);
-	free(processor);
-}
-
-static inline InPacket *buffer_packet(Packet *packet, const struct pcap_pkthdr *pkthdr, const unsigned char *pktptr, unsigned int seqnum_key) {
-	InPacket *res;
+	WorkerData *worker;
+	InPacket *pkt;
+	int i;
 
-	res = (InPacket*)malloc(sizeof(InPacket));
-	if (!res) {
-		fprintf(stderr, "FATAL: Out of memory\n");
-		exit(1);
-	}
-	res->pkthdr = *pkthdr;
-	res->pktdata = (unsigned char*)malloc(sizeof(unsigned char) * pkthdr->len);
-	if (!(res->pktdata)) {
-		fprintf(stderr, "FATAL: Out of memory\n");
-		exit(1);
+	// Clear buffers
+	for (i = 0; i < processor->num_workers; i++) {
+		worker = &(processor->workerData[i]);
+		while ((pkt = packet_buffer_dequeue(&(worker->queue)))) {
+			free_buffered_packet(pkt);
+		}
+		while ((pkt = packet_buffer_dequeue(&(worker->dataPacketQueue)))) {
+			free_buffered_packet(pkt);
+		}
+		while ((pkt = packet_buffer_dequeue(&(worker->matchPacketQueue)))) {
+			free_buffered_packet(pkt);
+		}
+		packet_buffer_destroy(&(worker->queue), 1);
+		packet_buffer_destroy(&(worker->dataPacketQueue), 1);
+		packet_buffer_destroy(&(worker->matchPacketQueue), 1);
 	}
-	memcpy(res->pktdata, pktptr, sizeof(unsigned char) * pkthdr->len);
-	res->seqnum = seqnum_key;
-	res->timestamp = time(0);
-	res->packet = *packet;
-	return res;
+	free(processor->workerData);
+	rule_action_table_destroy(&(processor->ruleActions));
+	free(processor);
 }
 
-static inline void free_buffered_packet(InPacket *pkt) {
-	free(pkt->pktdata);
-	free(pkt);
-}
+// Result packets of the DPI service carry the addresses and ports of their data packet,
+// so both are handled by the same worker
+static inline int flow_worker(ProcessorData *processor, Packet *packet) {
+	unsigned int h;
 
-void *process_buffer_timeout(void *param) {
-	InPacket *pkt;
-	ProcessorData *processor;
+	h = packet->ip_src ^ packet->ip_dst ^ (((unsigned int)packet->transport.tp_src << 16) | packet->transport.tp_dst);
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	return h % processor->num_workers;
+}
 
-	processor = (ProcessorData*)param;
+// Records a match report and returns the action it triggers
+static inline int add_report(WorkerData *worker, int rid, int position) {
+	MatchRecord *report;
+	int action;
 
-	while (!processor->terminated) {
-		// Wait
-		sleep(BUFFER_CLEANNING_INTERVAL);
+	report = &(worker->reports[worker->num_reports % MAX_REPORTED_RULES]);
+	report->rid = rid;
+	report->startIdxInPacket = position;
+	worker->num_reports++;
 
-		if (processor->terminated)
-			break;
+	action = rule_action_evaluate(&(worker->processor->ruleActions), (unsigned int)rid, (unsigned int)position);
+	worker->actions[action]++;
+#ifdef VERBOSE
+	if (action != RULE_ACTION_NONE) {
+		printf("Rule %d matched at position %d: %s\n", rid, position, rule_action_names[action]);
+	}
+#endif
+	return action;
+}
 
-		// Clean buffers
-		pkt = packet_buffer_peek(&(processor->dataPacketQueue));
+// Reads the DPI service match reports of a VXLAN-GPE/NSH encapsulated packet and forwards it.
+// The reports travel with the inspected packet, so nothing is buffered. The last middlebox in chain
+// strips the encapsulation in place and forwards the inner packet.
+// Returns FALSE if the packet does not carry DPI match reports (it is then handled as a regular packet).
+static inline int handle_nsh_packet(WorkerData *worker, Packet *packet, const struct pcap_pkthdr *pkthdr, const unsigned char *packetptr) {
+	const unsigned char *end, *report, *inner;
+	VxLANHdr *vxlanHdr;
+	NSHBaseHdr *baseHdr;
+	NSHVarLenMDHdr *varLenMd;
+	Packet innerPacket;
+	unsigned int avail, nsh_len, md_len, report_size, length, i;
+	unsigned char *outptr;
+	int rid32, rid, position, is_range, action, verdict;
+	ProcessorData *processor = worker->processor;
+
+	if (!packet->payload)
+		return 0;
+	end = packetptr + pkthdr->caplen;
+	if (packet->payload > end)
+		return 0;
+	avail = end - packet->payload;
+	if (packet->payload_len < avail)
+		avail = packet->payload_len;
+	if (avail < sizeof(VxLANHdr) + sizeof(NSHBaseHdr) + sizeof(NSHVarLenMDHdr))
+		return 0;
+
+	vxlanHdr = (VxLANHdr*)(packet->payload);
+	if (vxlanHdr->np != VXLAN_NEXT_PROTOCOL_NSH)
+		return 0;
+
+	// NSH headers are written by the DPI service in host order (see the DPI service Sniffer)
+	baseHdr = (NSHBaseHdr*)(packet->payload + sizeof(VxLANHdr));
+	nsh_len = (baseHdr->ver_flag_length & NSH_LENGTH_MASK) * 4;
+	if (baseHdr->mtype != NSH_MD_TYPE_VAR_LEN || nsh_len < sizeof(NSHBaseHdr) + sizeof(NSHVarLenMDHdr) || sizeof(VxLANHdr) + nsh_len > avail)
+		return 0;
+
+	varLenMd = (NSHVarLenMDHdr*)(packet->payload + sizeof(VxLANHdr) + sizeof(NSHBaseHdr));
+	md_len = (varLenMd->rrr_len & NSH_MD_LENGTH_MASK) * 4;
+	if (varLenMd->tlv_class != NSH_MD_CLASS_DPI || sizeof(NSHBaseHdr) + sizeof(NSHVarLenMDHdr) + md_len > nsh_len)
+		return 0;
 
-		while (pkt && pkt->timestamp + BUFFER_TIMEOUT < time(0)) {
-			pkt = packet_buffer_dequeue(&(processor->dataPacketQueue));
-			// Forward data packet
-			pcap_sendpacket(processor->pcap_out, pkt->pktdata, pkt->pkthdr.len);
-			free_buffered_packet(pkt);
+#ifdef VERBOSE
+	printf("Received NSH packet with match reports (metadata length: %u)\n", md_len);
+#endif
 
-			pkt = packet_buffer_peek(&(processor->dataPacketQueue));
+	// Read the reports (the metadata is zero padded to 4-byte words)
+	verdict = RULE_ACTION_NONE;
+	rid32 = (varLenMd->type == NSH_MD_TYPE_MATCH_REPORTS_RID32);
+	report = (const unsigned char*)varLenMd + sizeof(NSHVarLenMDHdr);
+	end = report + md_len;
+	while (report + (rid32 ? sizeof(MatchReport32) : sizeof(MatchReport)) <= end) {
+		if (rid32) {
+			rid = (int)ntohl(((MatchReport32*)report)->rid);
+			is_range = ((MatchReport32*)report)->is_range;
+			position = ntohs(((MatchReport32*)report)->position);
+			report_size = is_range ? sizeof(MatchReportRange32) : sizeof(MatchReport32);
+		} else {
+			rid = ntohs(((MatchReport*)report)->rid);
+			is_range = ((MatchReport*)report)->is_range;
+			position = ntohs(((MatchReport*)report)->position);
+			report_size = is_range ? sizeof(MatchReportRange) : sizeof(MatchReport);
 		}
-
-		pkt = packet_buffer_peek(&(processor->matchPacketQueue));
-
-		while (pkt && pkt->timestamp + BUFFER_TIMEOUT < time(0)) {
-			pkt = packet_buffer_dequeue(&(processor->matchPacketQueue));
-			// Drop match packet
-			free_buffered_packet(pkt);
-
-			pkt = packet_buffer_peek(&(processor->matchPacketQueue));
+		if (report + report_size > end) {
+			// Truncated range report
+			break;
 		}
+		if (is_range) {
+			// A range stands for matches of the same rule at consecutive positions
+			length = rid32 ? ntohs(((MatchReportRange32*)report)->length) : ntohs(((MatchReportRange*)report)->length);
+			for (i = 0; i < length; i++) {
+				action = add_report(worker, rid, position + i);
+				if (action > verdict)
+					verdict = action;
+			}
+		} else {
+			action = add_report(worker, rid, position);
+			if (action > verdict)
+				verdict = action;
+		}
+		report += report_size;
 	}
 
-	// Clear buffers
-	pkt = packet_buffer_dequeue(&(processor->dataPacketQueue));
-
-	while (pkt) {
-		free_buffered_packet(pkt);
-		pkt = packet_buffer_dequeue(&(processor->dataPacketQueue));
-	}
-
-	pkt = packet_buffer_dequeue(&(processor->matchPacketQueue));
+	// Inner (inspected) packet
+	inner = packet->payload + sizeof(VxLANHdr) + nsh_len;
+	packet_parse_ip(inner, packet->payload + avail - inner, &innerPacket);
+	worker->bytes += innerPacket.payload_len;
 
-	while (pkt) {
-		free_buffered_packet(pkt);
-		pkt = packet_buffer_dequeue(&(processor->matchPacketQueue));
-	}
-	return NULL;
-}
-
-static inline void parse_packet(ProcessorData *processor, const unsigned char *packetptr, Packet *packet) {
-    struct ip* iphdr;
-    struct icmp* icmphdr;
-    struct tcphdr* tcphdr;
-    struct udphdr* udphdr;
-    //char iphdrInfo[256], srcip[256], dstip[256];
-    //unsigned short id, seq;
-    unsigned int transport_len;
-
-    // Skip the datalink layer header and get the IP header fields.
-    packetptr += processor->linkHdrLen;
-    iphdr = (struct ip*)packetptr;
-    packet->ip_src = iphdr->ip_src.s_addr;
-    packet->ip_dst = iphdr->ip_dst.s_addr;
-    packet->ip_id = ntohs(iphdr->ip_id);
-    packet->ip_tos = iphdr->ip_tos;
-    packet->ip_ttl = iphdr->ip_ttl;
-    packet->ip_proto = iphdr->ip_p;
-    packet->ip_len = ntohs(iphdr->ip_len);
-
-    packet->payload = NULL;
-    packet->payload_len = 0;
-
-    /*
-    strcpy(srcip, inet_ntoa(iphdr->ip_src));
-    strcpy(dstip, inet_ntoa(iphdr->ip_dst));
-    sprintf(iphdrInfo, "ID:%d TOS:0x%x, TTL:%d IpLen:%d DgLen:%d",
-            ntohs(iphdr->ip_id), iphdr->ip_tos, iphdr->ip_ttl,
-            4*iphdr->ip_hl, ntohs(iphdr->ip_len));
-    */
-
-    // Advance to the transport layer header then parse and display
-    // the fields based on the type of header: tcp, udp or icmp.
-    packet->seqnum = 0;
-    packet->transport.tp_src = 0;
-    packet->transport.tp_dst = 0;
-    packetptr += 4*iphdr->ip_hl;
-    switch (iphdr->ip_p)
-    {
-    case IPPROTO_TCP:
-        tcphdr = (struct tcphdr*)packetptr;
-#ifdef __APPLE__
-        transport_len = 4 * tcphdr->th_off;
-        packet->transport.tp_src = tcphdr->th_sport;
-        packet->transport.tp_dst = tcphdr->th_dport;
-        packet->seqnum = tcphdr->th_seq;
-#elif __linux__
-        transport_len = 4 * tcphdr->doff;
-        packet->transport.tp_src = tcphdr->source;
-        packet->transport.tp_dst = tcphdr->dest;
-        packet->seqnum = tcphdr->seq;
+	if (verdict == RULE_ACTION_DROP) {
+#ifdef VERBOSE
+		printf("Dropping NSH packet\n");
 #endif
-        packet->payload_len = ntohs(iphdr->ip_len) - (4*iphdr->ip_hl) - transport_len;
-        packetptr += transport_len;
-        packet->payload = (unsigned char *)packetptr;
-        break;
-
-    case IPPROTO_UDP:
-        udphdr = (struct udphdr*)packetptr;
-        transport_len = 8;
-#ifdef __APPLE__
-        packet->transport.tp_src = udphdr->uh_sport;
-        packet->transport.tp_dst = udphdr->uh_dport;
-        packet->seqnum = udphdr->uh_sum;
-#elif __linux__
-        packet->transport.tp_src = udphdr->source;
-        packet->transport.tp_dst = udphdr->dest;
-        packet->seqnum = udphdr->check;
+		worker->dropped++;
+	} else if (processor->last && baseHdr->np == NSH_NEXT_PROTOCOL_IPv4 && innerPacket.ip_version == PACKET_IPV4) {
+		// Set ECN bits to 0
+		packet_set_tos((unsigned char *)inner, &innerPacket, innerPacket.ip_tos & IP_TOS_UNSET_MATCHES_MASK);
+		// Decapsulate in place: move the datalink header (and VLAN tags) next to the inner IP header (it keeps the IPv4 link type)
+		outptr = (unsigned char *)inner - packet->l3_offset;
+		memmove(outptr, packetptr, packet->l3_offset);
+#ifdef VERBOSE
+		printf("Forwarding decapsulated packet... (length: %u)\n", (unsigned int)(pkthdr->caplen - (outptr - packetptr)));
 #endif
-        /*
-        printf("UDP  %s:%d -> %s:%d\n", srcip, ntohs(udphdr->uh_sport),
-               dstip, ntohs(udphdr->uh_dport));
-        printf("%s\n", iphdrInfo);
-        */
-        packet->payload_len = ntohs(iphdr->ip_len) - (4*iphdr->ip_hl) - transport_len;
-        packetptr += transport_len;
-        packet->payload = (unsigned char *)packetptr;
-        break;
-
-    case IPPROTO_ICMP:
-        icmphdr = (struct icmp*)packetptr;
-        packet->icmp.icmp_type = icmphdr->icmp_type;
-        packet->icmp.icmp_code = icmphdr->icmp_code;
-        packet->seqnum = 0;
-        /*
-        printf("ICMP %s -> %s\n", srcip, dstip);
-        printf("%s\n", iphdrInfo);
-        memcpy(&id, (u_char*)icmphdr+4, 2);
-        memcpy(&seq, (u_char*)icmphdr+6, 2);
-        printf("Type:%d Code:%d ID:%d Seq:%d\n", icmphdr->type, icmphdr->code,
-               ntohs(id), ntohs(seq));
-        */
-        packet->payload_len = 0;
-        packet->payload = NULL;
-        break;
-    }
+		capture_send(processor->capture, pkthdr, outptr, pkthdr->caplen - (outptr - packetptr));
+	} else {
+#ifdef VERBOSE
+		printf("Forwarding NSH packet..\n");
+#endif
+		capture_send(processor->capture, pkthdr, packetptr, pkthdr->caplen);
+	}
+	return 1;
 }
 
-static inline void handle_matches(ProcessorData *processor, Packet *dataPkt, const struct pcap_pkthdr *dataPkthdr, const unsigned char *dataPacketPtr,
-		Packet *matchPkt, const struct pcap_pkthdr *matchPkthdr, const unsigned char *matchPacketPtr) {
-	long num_reports, total_reports;
-	int i;
+static inline void handle_matches(WorkerData *worker, InPacket *dataPkt, InPacket *matchPkt) {
+	ProcessorData *processor = worker->processor;
+	const unsigned char *reports;
+	long num_reports;
+	int i, action, verdict;
 	//unsigned int flow_offset;
 	unsigned char *ptr;
 
-	num_reports = ((0x0FFFF) & (ntohs(*(unsigned short*)(&(matchPkt->payload[REPORT_PACKET_OFFSET_NUM_REPORTS])))));
-	total_reports = num_reports + processor->num_reports;
+	num_reports = ((0x0FFFF) & (ntohs(*(unsigned short*)(&(matchPkt->packet.payload[REPORT_PACKET_OFFSET_NUM_REPORTS])))));
 	//flow_offset = ((0x0FFFFFFFF) & (ntohl(*(unsigned int*)(&(packet.payload[REPORT_PACKET_OFFSET_FLOW_OFF])))));
-	if (num_reports > 0 && total_reports < MAX_REPORTED_RULES) {
-		for (i = processor->num_reports; i < total_reports; i++) {
-			processor->reports[i].rid = ntohs(*(unsigned short*)(&(matchPkt->payload[REPORT_PACKET_OFFSET_REPORTS_START + (i * REPORT_PACKET_REPORT_SIZE)])));
-			processor->reports[i].startIdxInPacket = (int)ntohs(*(short*)(&(matchPkt->payload[REPORT_PACKET_OFFSET_REPORTS_START + REPORT_PACKET_OFFSET_START_IDX + (i * REPORT_PACKET_REPORT_SIZE)])));
-		}
+	if (num_reports > (matchPkt->packet.payload_len - REPORT_PACKET_OFFSET_REPORTS_START) / REPORT_PACKET_REPORT_SIZE) {
+		// Truncated result packet
+		num_reports = (matchPkt->packet.payload_len - REPORT_PACKET_OFFSET_REPORTS_START) / REPORT_PACKET_REPORT_SIZE;
+	}
+	reports = &(matchPkt->packet.payload[REPORT_PACKET_OFFSET_REPORTS_START]);
+	verdict = RULE_ACTION_NONE;
+	for (i = 0; i < num_reports; i++) {
+		action = add_report(worker, ntohs(*(unsigned short*)(&(reports[i * REPORT_PACKET_REPORT_SIZE]))),
+				(int)ntohs(*(short*)(&(reports[REPORT_PACKET_OFFSET_START_IDX + (i * REPORT_PACKET_REPORT_SIZE)]))));
+		if (action > verdict)
+			verdict = action;
+	}
+	worker->bytes += dataPkt->packet.payload_len;
+
+	if (verdict == RULE_ACTION_DROP) {
+		// Drop both packets
+#ifdef VERBOSE
+		printf("Dropping data packet\n");
+#endif
+		worker->dropped++;
+		return;
 	}
-	processor->num_reports = total_reports;
-	processor->bytes += dataPkt->payload_len;
 
 	// Forward both packets
-	ptr = (unsigned char *)dataPacketPtr;
+	ptr = dataPkt->pktdata;
 	if (processor->last) {
 		// Set ECN bits to 0
-		ptr[processor->linkHdrLen + 1] = dataPacketPtr[processor->linkHdrLen + 1] & IP_TOS_UNSET_MATCHES_MASK;
+		packet_set_tos(ptr, &(dataPkt->packet), dataPkt->packet.ip_tos & IP_TOS_UNSET_MATCHES_MASK);
 	}
 #ifdef VERBOSE
-	printf("Forwarding data packet... (length: %d, content: %s)\n", dataPkthdr->len, dataPacketPtr);
+	printf("Forwarding data packet... (length: %d, content: %s)\n", dataPkt->pkthdr.caplen, dataPkt->pktdata);
 #endif
-	pcap_sendpacket(processor->pcap_out, ptr, dataPkthdr->len);
+	capture_send(processor->capture, &(dataPkt->pkthdr), ptr, dataPkt->pkthdr.caplen);
 	if (!processor->last) {
 #ifdef VERBOSE
 		printf("Forwarding match packet..\n");
 #endif
-		pcap_sendpacket(processor->pcap_out, matchPacketPtr, matchPkthdr->len);
+		capture_send(processor->capture, &(matchPkt->pkthdr), matchPkt->pktdata, matchPkt->pkthdr.caplen);
 	}
 }
 
-void process_packet(unsigned char *arg, const struct pcap_pkthdr *pkthdr, const unsigned char *packetptr) {
-	ProcessorData *processor;
-	Packet packet;
+// Handles a packet on its worker. The worker owns pkt: it is either buffered until its pair arrives or freed.
+static inline void handle_packet(WorkerData *worker, InPacket *pkt) {
+	ProcessorData *processor = worker->processor;
+	Packet *packet;
 	unsigned int seqnum_id;
 	InPacket *bpkt;
 
-	processor = (ProcessorData*)arg;
-
-	if (!processor->started) {
-		processor->started = 1;
-		gettimeofday(&(processor->first_packet), NULL);
-	}
+	packet = &(pkt->packet);
 
-	parse_packet(processor, packetptr, &packet);
-
-	if (packet.ip_proto == IPPROTO_UDP && ntohs(*(unsigned short*)(packet.payload)) == MAGIC_NUM) {
+	if (packet->ip_proto == IPPROTO_UDP && ntohs(packet->transport.tp_dst) == VXLAN_GPE_UDP_PORT &&
+			handle_nsh_packet(worker, packet, &(pkt->pkthdr), pkt->pktdata)) {
+		// Packet is encapsulated with its matching results (NSH), already handled
+		free_buffered_packet(pkt);
+	} else if (packet->ip_proto == IPPROTO_UDP && packet->payload_len >= REPORT_PACKET_OFFSET_REPORTS_START &&
+			ntohs(*(unsigned short*)(packet->payload)) == MAGIC_NUM) {
 		// Packet contains matching results
-		seqnum_id = ((0x0FFFFFFFF) & (ntohl(*(unsigned int*)(&(packet.payload[REPORT_PACKET_OFFSET_SEQNUM])))));
+		seqnum_id = ((0x0FFFFFFFF) & (ntohl(*(unsigned int*)(&(packet->payload[REPORT_PACKET_OFFSET_SEQNUM])))));
 #ifdef VERBOSE
         printf("Received matching results packet (seqnum=%u)\n", seqnum_id);
 #endif
         // Find corresponding data packet
-		bpkt = packet_buffer_pop(&(processor->dataPacketQueue), packet.ip_src, packet.ip_dst, packet.transport.tp_src, packet.transport.tp_dst, seqnum_id);
+		bpkt = packet_buffer_pop(&(worker->dataPacketQueue), packet->ip_src, packet->ip_dst, packet->transport.tp_src, packet->transport.tp_dst, seqnum_id);
 		// Handle matches
 		if (bpkt) {
 			// Found corresponding data packet
 #ifdef VERBOSE
 		    printf("Found corresponding data packet\n");
 #endif
-		    handle_matches(processor, &(bpkt->packet), &(bpkt->pkthdr), bpkt->pktdata, &packet, pkthdr, packetptr);
+		    handle_matches(worker, bpkt, pkt);
 			free_buffered_packet(bpkt);
+			free_buffered_packet(pkt);
 		} else {
 			// Buffer match packet
 #ifdef VERBOSE
             printf("Corresponding packet was not found, buffering match packet\n");
 #endif
-            bpkt = buffer_packet(&packet, pkthdr, packetptr, seqnum_id);
-            packet_buffer_enqueue(&(processor->matchPacketQueue), bpkt);
+            pkt->seqnum = seqnum_id;
+            packet_buffer_enqueue(&(worker->matchPacketQueue), pkt);
 		}
-	} else if ((packet.ip_tos & IP_TOS_HAS_MATCHES_MASK) == IP_TOS_HAS_MATCHES_MASK) {
+	} else if ((packet->ip_tos & IP_TOS_HAS_MATCHES_MASK) == IP_TOS_HAS_MATCHES_MASK) {
 		// Packet has matches
 #ifdef VERBOSE
-        printf("Received a data packet that has matches (seqnum=%u)\n", packet.seqnum);
+        printf("Received a data packet that has matches (seqnum=%u)\n", packet->seqnum);
 #endif
         // Find corresponding match packet
-		bpkt = packet_buffer_pop(&(processor->matchPacketQueue), packet.ip_src, packet.ip_dst, packet.transport.tp_src, packet.transport.tp_dst, packet.seqnum);
+		bpkt = packet_buffer_pop(&(worker->matchPacketQueue), packet->ip_src, packet->ip_dst, packet->transport.tp_src, packet->transport.tp_dst, packet->seqnum);
 		// Handle matches
 		if (bpkt) {
 #ifdef VERBOSE
 		    printf("Found corresponding match packet\n");
 #endif
-		    handle_matches(processor, &packet, pkthdr, packetptr, &(bpkt->packet), &(bpkt->pkthdr), bpkt->pktdata);
+		    handle_matches(worker, pkt, bpkt);
 			free_buffered_packet(bpkt);
+			free_buffered_packet(pkt);
 		} else {
 #ifdef VERBOSE
 		    printf("No corresponding match packet, buffering data packet\n");
 #endif
-		    bpkt = buffer_packet(&packet, pkthdr, packetptr, packet.seqnum);
-			packet_buffer_enqueue(&(processor->dataPacketQueue), bpkt);
+		    pkt->seqnum = packet->seqnum;
+			packet_buffer_enqueue(&(worker->dataPacketQueue), pkt);
 		}
 	} else {
 		// Regular packet with no matches, forward it
 #ifdef VERBOSE
         printf("Received a data packet with no matches, forwarding it\n");
 #endif
-    	processor->bytes += packet.payload_len;
-        pcap_sendpacket(processor->pcap_out, packetptr, pkthdr->len);
+    	worker->bytes += packet->payload_len;
+        capture_send(processor->capture, &(pkt->pkthdr), pkt->pktdata, pkt->pkthdr.caplen);
+        free_buffered_packet(pkt);
+	}
+}
+
+void *worker_start(void *param) {
+	WorkerData *worker;
+	ProcessorData *processor;
+	InPacket *pkt;
+
+	worker = (WorkerData*)param;
+	processor = worker->processor;
+
+	while ((pkt = packet_buffer_dequeue(&(worker->queue))) || !processor->terminated) {
+		// Handle timed out packets (also when there is no traffic)
+		timer_wheel_advance(&(worker->bufferTimers), get_time_ms());
+
+		if (!pkt) {
+			nanosleep(&_100_nanos, NULL);
+			continue;
+		}
+
+		if (!worker->started) {
+			worker->started = 1;
+			gettimeofday(&(worker->first_packet), NULL);
+		}
+
+		handle_packet(worker, pkt);
+
+		gettimeofday(&(worker->last_packet), NULL);
+	}
+
+	return NULL;
+}
+
+void process_packets(InPacket **packets, int count, void *arg) {
+	ProcessorData *processor;
+	unsigned long now;
+	int i;
+
+	processor = (ProcessorData*)arg;
+	now = get_time_ms();
+
+	// Pass each packet to the worker of its flow
+	for (i = 0; i < count; i++) {
+		packets[i]->timestamp = now;
+		packet_buffer_enqueue(&(processor->workerData[flow_worker(processor, &(packets[i]->packet))].queue), packets[i]);
 	}
-	gettimeofday(&(processor->last_packet), NULL);
 }
 
 void stop(int res) {
 	// Finish
-	long usecs_total, usecs_packets;
-
-	gettimeofday(&(_global_processor->end), NULL);
+	long usecs_total, usecs_packets, usecs_worker[MAX_THREADS];
+	long total_bytes, total_reports, total_dropped, total_actions[RULE_ACTIONS];
+	struct timeval first_packet, last_packet;
+	WorkerData *worker;
+	int i, j, started;
 
 	_global_processor->terminated = 1;
 
-	pthread_join(_global_processor->bufferWorker, NULL);
+	for (i = 0; i < _global_processor->num_workers; i++) {
+		pthread_join(_global_processor->workers[i], NULL);
+	}
+
+	gettimeofday(&(_global_processor->end), NULL);
 
 	switch (res) {
 	case 0:
@@ -417,217 +574,90 @@ void stop(int res) {
 		break;
 	}
 
+	// Merge worker statistics
+	total_bytes = 0;
+	total_reports = 0;
+	total_dropped = 0;
+	memset(total_actions, 0, sizeof(long) * RULE_ACTIONS);
+	started = 0;
+	timerclear(&first_packet);
+	timerclear(&last_packet);
+	for (i = 0; i < _global_processor->num_workers; i++) {
+		worker = &(_global_processor->workerData[i]);
+		if (!worker->started) {
+			usecs_worker[i] = 0;
+			continue;
+		}
+		usecs_worker[i] = (worker->last_packet.tv_sec * 1000000 + worker->last_packet.tv_usec) - (worker->first_packet.tv_sec * 1000000 + worker->first_packet.tv_usec);
+		total_bytes += worker->bytes;
+		total_reports += worker->num_reports;
+		total_dropped += worker->dropped;
+		for (j = 0; j < RULE_ACTIONS; j++) {
+			total_actions[j] += worker->actions[j];
+		}
+		if (!started || timercmp(&(worker->first_packet), &first_packet, <))
+			first_packet = worker->first_packet;
+		if (!started || timercmp(&(worker->last_packet), &last_packet, >))
+			last_packet = worker->last_packet;
+		started = 1;
+	}
+
 	usecs_total = (_global_processor->end.tv_sec * 1000000 + _global_processor->end.tv_usec) - (_global_processor->start.tv_sec * 1000000 + _global_processor->start.tv_usec);
-	if (_global_processor->started)
-		usecs_packets = (_global_processor->last_packet.tv_sec * 1000000 + _global_processor->last_packet.tv_usec) - (_global_processor->first_packet.tv_sec * 1000000 + _global_processor->first_packet.tv_usec);
+	if (started)
+		usecs_packets = (last_packet.tv_sec * 1000000 + last_packet.tv_usec) - (first_packet.tv_sec * 1000000 + first_packet.tv_usec);
 	else
 		usecs_packets = 0;
 	if (!(_global_processor->batch_mode)) {
-		printf("Total bytes: %ld\n", _global_processor->bytes);
+		printf("Total bytes: %ld\n", total_bytes);
 		printf("+---------------- Timing Results ---------------+\n");
 		printf("| Cat.  | Total Time (usec) | Throughput (Mbps) |\n");
 		printf("+-------+-------------------+-------------------+\n");
-		printf("| Gross | %17ld | %17.3f |\n", usecs_total, GET_MBPS(_global_processor->bytes, usecs_total));
+		printf("| Gross | %17ld | %17.3f |\n", usecs_total, GET_MBPS(total_bytes, usecs_total));
 		printf("+-------+-------------------+-------------------+\n");
-		printf("| Neto  | %17ld | %17.3f |\n", usecs_packets, GET_MBPS(_global_processor->bytes, usecs_packets));
+		printf("| Neto  | %17ld | %17.3f |\n", usecs_packets, GET_MBPS(total_bytes, usecs_packets));
 		printf("+-------+-------------------+-------------------+\n");
 		printf("\n");
-		printf("Total reported matches: %ld\n", _global_processor->num_reports);
+		printf("+------------------------ Worker Results -------------------------+\n");
+		printf("| Wrkr. | Total Time (usec) | Total Bytes (bytes) |     Reports     |\n");
+		printf("+-------+-------------------+---------------------+-----------------+\n");
+		for (i = 0; i < _global_processor->num_workers; i++) {
+			worker = &(_global_processor->workerData[i]);
+			printf("| %5d | %17ld | %19ld | %15ld |\n", i, usecs_worker[i], worker->bytes, worker->num_reports);
+		}
+		printf("+-------+-------------------+---------------------+-----------------+\n");
+		printf("\n");
+		printf("Total reported matches: %ld\n", total_reports);
+		if (_global_processor->ruleActions.count) {
+			printf("Rule actions: %ld log, %ld alert, %ld drop (%ld packets dropped)\n", total_actions[RULE_ACTION_LOG],
+					total_actions[RULE_ACTION_ALERT], total_actions[RULE_ACTION_DROP], total_dropped);
+		}
 	} else {
 		printf("Batch Mode Results Report\n");
 		printf("=========================\n");
 		printf("(use with grep)\n\n");
 		printf("   \tusecs\tTotalBytes\tThpt(Mbps)\tReports\n");
-		printf("RES\t%ld\t%ld\t%f\t%ld\n", usecs_packets, _global_processor->bytes, GET_MBPS(_global_processor->bytes, usecs_packets), _global_processor->num_reports);
+		printf("RES\t%ld\t%ld\t%f\t%ld\n", usecs_packets, total_bytes, GET_MBPS(total_bytes, usecs_packets), total_reports);
+		printf("ACT\t%ld\t%ld\t%ld\t%ld\n", total_actions[RULE_ACTION_LOG], total_actions[RULE_ACTION_ALERT], total_actions[RULE_ACTION_DROP], total_dropped);
+		for (i = 0; i < _global_processor->num_workers; i++) {
+			worker = &(_global_processor->workerData[i]);
+			printf("WRK\tW%d\t%ld\t%ld\t%f\t%ld\n", i, usecs_worker[i], worker->bytes, GET_MBPS(worker->bytes, usecs_worker[i]), worker->num_reports);
+		}
 	}
+	capture_close(_global_processor->capture);
 	destroy_processor(_global_processor);
 
 	exit(0);
 }
 
-void sniff(char *in_if, char *out_if, char *in_file, char *out_file, int last, int batch_mode) {
-	pcap_t *hpcap[2];
-	char errbuf[PCAP_ERRBUF_SIZE];
-	char *device_in = NULL, *device_out = NULL;
-	pcap_if_t *devices, *next_device;
-	int res;
-	struct bpf_program bpf;
+void sniff(char *in_if, char *out_if, char *in_file, char *out_file, int last, int batch_mode, unsigned long buffer_timeout, int num_workers, RuleActionTable *ruleActions) {
+	Capture capture;
 	ProcessorData *processor;
-    int linktype[2], linkHdrLen, i;
-    char *mode;
-
-	memset(errbuf, 0, PCAP_ERRBUF_SIZE);
-
-	if (in_if || out_if) {
-		// Find available interfaces
-		if (pcap_findalldevs(&devices, errbuf)) {
-			fprintf(stderr, "[Sniffer] ERROR: Cannot find network interface (pcap_findalldevs error: %s)\n", errbuf);
-			exit(1);
-		}
-
-		// Find requested interface
-		next_device = devices;
-		while (next_device) {
-			printf("[Sniffer] Found network interface: %s\n", next_device->name);
-			if (in_if && (strcmp(in_if, next_device->name) == 0)) {
-				device_in = in_if;
-			}
-			if (out_if && (strcmp(out_if, next_device->name) == 0)) {
-				device_out = out_if;
-			}
-			next_device = next_device->next;
-		}
-		pcap_freealldevs(devices);
-		if (in_if && (strcmp(in_if, STR_ANY) == 0)) {
-			device_in = STR_ANY;
-		}
-
-		if (in_if && !device_in) {
-			fprintf(stderr, "[Sniffer] ERROR: Cannot find input network interface\n");
-			exit(1);
-		}
-		if (out_if && !device_out) {
-			fprintf(stderr, "[Sniffer] ERROR: Cannot find output network interface\n");
-			exit(1);
-		}
-	}
-
-	if (in_if) {
-		printf("[Sniffer] Sniffer is capturing from device: %s\n", device_in);
-	} else {
-		printf("[Sniffer] Sniffer is reading packets from file: %s\n", in_file);
-	}
-	if (out_if) {
-		printf("[Sniffer] Packets are sent on device: %s\n", device_out);
-	} else {
-		printf("[Sniffer] Packets written to file: %s\n", out_file);
-	}
-
-	if (in_if) {
-		hpcap[0] = pcap_create(device_in, errbuf);
-	} else {
-		hpcap[0] = pcap_open_offline(in_file, errbuf);
-	}
-	if (out_if) {
-		hpcap[1] = pcap_create(device_out, errbuf);
-	} else {
-		//hpcap[1] = pcap_dump_fopen(out_file, errbuf);
-	}
-
-	for (i = 0; i < 2; i++) {
-		mode = (i == 0) ? "input" : "output";
-		// Check pcap handle
-		if (!hpcap[i]) {
-			fprintf(stderr, "[Sniffer] ERROR: Cannot create %s pcap handle (pcap_create/pcap_open_offline error: %s)\n", mode ,errbuf);
-			exit(1);
-		}
-
-		if (in_if && i == 0) {
-			// Set promiscuous mode
-			pcap_set_promisc(hpcap[0], 1);
-		}
-
-		// Activate PCAP
-		if ((in_if && i == 0) || (out_if && i == 1)) {
-			res = pcap_activate(hpcap[i]);
-			switch (res) {
-			case 0:
-				// Success
-				break;
-			case PCAP_WARNING_PROMISC_NOTSUP:
-				fprintf(stderr, "[Sniffer] WARNING: Promiscuous mode is not supported\n");
-				exit(1);
-				break;
-			case PCAP_WARNING:
-				fprintf(stderr, "[Sniffer] WARNING: Unknown (%s)\n", pcap_geterr(hpcap[i]));
-				exit(1);
-				break;
-			case PCAP_ERROR_NO_SUCH_DEVICE:
-				fprintf(stderr, "[Sniffer] ERROR: Device not found\n");
-				exit(1);
-				break;
-			case PCAP_ERROR_PERM_DENIED:
-				fprintf(stderr, "[Sniffer] ERROR: Permission denied\n");
-				exit(1);
-				break;
-			case PCAP_ERROR_PROMISC_PERM_DENIED:
-				fprintf(stderr, "[Sniffer] ERROR: Permission denied for promiscuous mode\n");
-				exit(1);
-				break;
-			case PCAP_ERROR_RFMON_NOTSUP:
-				fprintf(stderr, "[Sniffer] ERROR: Monitor mode is not supported\n");
-				exit(1);
-				break;
-			case PCAP_ERROR_IFACE_NOT_UP:
-				fprintf(stderr, "[Sniffer] ERROR: Interface %s is not available\n", (i == 0) ? device_in : device_out);
-				exit(1);
-				break;
-			default:
-				fprintf(stderr, "[Sniffer] ERROR: Unknown (%s)\n", pcap_geterr(hpcap[i]));
-				exit(1);
-				break;
-			}
-		}
-
-		if (i == 0) {
-			if (in_if) {
-				// Set capture direction (ingress only)
-				res = pcap_setdirection(hpcap[0], PCAP_D_IN);
-				if (res) {
-					fprintf(stderr, "[Sniffer] ERROR: Cannot set capture direction (pcap_setdirection error: %s, return value: %d)\n", pcap_geterr(hpcap[0]), res);
-					exit(1);
-				}
-			}
-			// Compile PCAP filter (IP packets)
-			res = pcap_compile(hpcap[0], &bpf, STR_FILTER, 0, PCAP_NETMASK_UNKNOWN);
-			if (res) {
-				fprintf(stderr, "[Sniffer] ERROR: Cannot compile packet filter (pcap_compile error: %s)\n", pcap_geterr(hpcap[0]));
-				exit(1);
-			}
-
-			res = pcap_setfilter(hpcap[0], &bpf);
-			if (res) {
-				fprintf(stderr, "[Sniffer] ERROR: Cannot set packet filter (pcap_setfilter error: %s, return value: %d)\n", pcap_geterr(hpcap[0]), res);
-				exit(1);
-			}
-			pcap_freecode(&bpf);
-		}
-
-		// Find data link type
-		if ((linktype[i] = pcap_datalink(hpcap[i])) < 0)
-		{
-			fprintf(stderr, "[Sniffer] Cannot determine data link type (pcap_datalink error: %s)\n", pcap_geterr(hpcap[i]));
-			exit(1);
-		}
-		if (i == 1 && linktype[0] != linktype[1]) {
-			fprintf(stderr, "[Sniffer] Incompatible link types (input=%d, output=%d)\n", linktype[0], linktype[1]);
-			exit(1);
-		}
-	}
-
-	linkHdrLen = 0;
-	switch (linktype[0])
-	{
-	case DLT_NULL:
-		linkHdrLen = 4;
-		break;
+	int res;
 
-	case DLT_EN10MB:
-		linkHdrLen = 14;
-		break;
-
-	case DLT_SLIP:
-	case DLT_PPP:
-		linkHdrLen = 24;
-		break;
-
-	default:
-		fprintf(stderr, "[Sniffer] Unsupported data link type: %d\n", linktype[0]);
-		exit(1);
-	}
+	capture_open(&capture, in_if, out_if, in_file, out_file, PCAP_READ_TIMEOUT);
 
 	// Prepare processor
-	processor = init_processor(hpcap[0], hpcap[1], linkHdrLen, last, batch_mode);
+	processor = init_processor(&capture, last, batch_mode, buffer_timeout, num_workers, ruleActions);
 	_global_processor = processor;
 
 	// Set signal handler
@@ -635,13 +665,10 @@ void sniff(char *in_if, char *out_if, char *in_file, char *out_file, int last, i
 	signal(SIGTERM, stop);
 	signal(SIGQUIT, stop);
 
-	// Run buffer cleaning worker
-	pthread_create(&(processor->bufferWorker), NULL, process_buffer_timeout, (void*)processor);
-
 	// Run sniffer
 	gettimeofday(&(processor->start), NULL);
 	printf("[Sniffer] Sniffer is running (input: %s, outout: %s)...\n", in_if, out_if);
-	res = pcap_loop(hpcap[0], -1, process_packet, (unsigned char *)(processor));
+	res = capture_loop(&capture, CAPTURE_BATCH_SIZE, process_packets, processor);
 
 	stop(res);
 }
@@ -651,13 +678,18 @@ int main(int argc, char *argv[]) {
 	char *out_if = NULL;
 	char *in_file = NULL;
 	char *out_file = NULL;
-	int i;
+	char *actions_file = NULL;
+	int i, res;
+	RuleActionTable ruleActions;
 	char *param, *arg;
-	int auto_mode, last, batch;
+	int auto_mode, last, batch, num_workers;
+	long buffer_timeout;
 
 	auto_mode = 0;
 	batch = 0;
 	last = 0;
+	buffer_timeout = DEFAULT_BUFFER_TIMEOUT;
+	num_workers = 1;
 
 	if (argc > 1) {
 		for (i = 1; i < argc; i++) {
@@ -671,6 +703,12 @@ int main(int argc, char *argv[]) {
 				in_file = arg;
 			} else if (strcmp(param, "outfile") == 0) {
 				out_file = arg;
+			} else if (strcmp(param, "workers") == 0) {
+				num_workers = atoi(arg);
+			} else if (strcmp(param, "actions") == 0) {
+				actions_file = arg;
+			} else if (strcmp(param, "timeout") == 0) {
+				buffer_timeout = atol(arg);
 			} else if (strcmp(param, "last") == 0) {
 				last = 1;
 			} else if (strcmp(param, "batch") == 0) {
@@ -681,7 +719,7 @@ int main(int argc, char *argv[]) {
 			}
 		}
 	}
-	if (auto_mode == 0 && ((in_if == NULL && in_file == NULL) || (out_if == NULL && out_file == NULL))) {
+	if (auto_mode == 0 && ((in_if == NULL && in_file == NULL) || (out_if == NULL && out_file == NULL) || buffer_timeout < 0 || num_workers < 1 || num_workers > MAX_THREADS)) {
 		// Show usage
 		fprintf(stderr, USAGE, argv[0]);
 		exit(1);
@@ -692,8 +730,16 @@ int main(int argc, char *argv[]) {
 		last = 1;
 	}
 
+	rule_action_table_init(&ruleActions);
+	if (actions_file) {
+		res = rule_action_table_load(&ruleActions, actions_file);
+		if (res < 0) {
+			exit(1);
+		}
+		printf("[Sniffer] Loaded %d rule actions from file: %s\n", res, actions_file);
+	}
 
-	sniff(in_if, out_if, in_file, out_file, last, batch);
+	sniff(in_if, out_if, in_file, out_file, last, batch, (unsigned long)buffer_timeout, num_workers, &ruleActions);
 
 	return 0;
 }
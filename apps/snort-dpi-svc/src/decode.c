@@ -2476,6 +2476,50 @@ static inline void DecodeIPv4Proto(const uint8_t proto,
     }
 }
 
+/* Function: DecodeNSHFastPath(uint8_t *, uint32_t, Packet *)
+ *
+ * The DPI Service returns the packets it scanned in one fixed encapsulation: an IPv4 header without
+ * options, UDP (without a checksum) to VXLAN_GPE_UDP_PORT, VXLAN-gpe and NSH. Such a packet is
+ * recognized at fixed offsets from its outer IP header and decoded from its NSH header on, instead of
+ * going through the generic IP, UDP and VXLAN decoders first: the outer headers only carry the packet
+ * back from the DPI Service, so they are not pushed as layers and the inner packet is not an
+ * encapsulated one.
+ * Returns: 1 if the packet was decoded; 0 if it is not in this encapsulation (decode it as usual).
+ */
+static inline int DecodeNSHFastPath(const uint8_t *pkt, const uint32_t len, Packet *p)
+{
+    const IPHdr *iph = (const IPHdr *)pkt;
+    const UDPHdr *udph = (const UDPHdr *)(pkt + IP_HEADER_LEN);
+    const VxLANHdr *vxlanHdr = (const VxLANHdr *)(pkt + IP_HEADER_LEN + UDP_HEADER_LEN);
+    const uint32_t hdrs_len = IP_HEADER_LEN + UDP_HEADER_LEN + sizeof(VxLANHdr);
+    uint32_t ip_len;
+
+    if (len < hdrs_len + sizeof(NSHBaseHdr))
+        return 0;
+
+    if ((iph->ip_verhl != 0x45) || (iph->ip_proto != IPPROTO_UDP) ||
+        (ntohs(iph->ip_off) & 0x3FFF) ||
+        (udph->uh_dport != htons(VXLAN_GPE_UDP_PORT)) || udph->uh_chk ||
+        (vxlanHdr->np != VXLAN_NEXT_PROTOCOL_NSH) ||
+        (((const NSHBaseHdr *)(pkt + hdrs_len))->mtype != 2))
+        return 0;
+
+    ip_len = ntohs(iph->ip_len);
+    if ((ip_len < hdrs_len + sizeof(NSHBaseHdr)) || (ip_len > len) ||
+        (ntohs(udph->uh_len) != ip_len - IP_HEADER_LEN))
+        return 0;
+
+    /* a bad checksum is left to the generic decoder to report */
+    if (ScIpChecksums() && in_chksum_ip((const unsigned short *)iph, IP_HEADER_LEN))
+        return 0;
+
+    DEBUG_WRAP(DebugMessage(DEBUG_DECODE, "NSH from the DPI Service: fast path.\n"););
+    pc.dpi_nsh_fast_path++;
+
+    DecodeNSH(pkt + hdrs_len, ip_len - hdrs_len, p);
+    return 1;
+}
+
 /*
  * Function: DecodeIP(uint8_t *, const uint32_t, Packet *)
  *
@@ -2501,6 +2545,11 @@ void DecodeIP(const uint8_t * pkt, const uint32_t len, Packet * p)
 
     DEBUG_WRAP(DebugMessage(DEBUG_DECODE, "Packet!\n"););
 
+    /* the DPI Service's packets are the bulk of the traffic: skip the outer headers */
+    if (snort_conf->dpi_service_active && (p->family == NO_IP) && !p->dpi_service_scanned &&
+        DecodeNSHFastPath(pkt, len, p))
+        return;
+
     /* do a little validation */
     if(len < IP_HEADER_LEN)
     {
@@ -5146,7 +5195,7 @@ inline void DecodeVxLAN(const uint8_t *pkt, uint32_t len, Packet *p) {
  *
  */
 inline void DecodeNSH(const uint8_t *pkt, uint32_t len, Packet *p) {
-	SF_LIST *dpi_service_match_reports;
+	uint16_t num_reports;
 	uint8_t version;
 	uint8_t flags;
 	uint16_t length; //  total length, in 4-byte words, of the NSH header, including optional variable TLVs.
@@ -5185,7 +5234,8 @@ inline void DecodeNSH(const uint8_t *pkt, uint32_t len, Packet *p) {
     	 * Variable Length. When the base header specifies MD Type 2, NSH defines variable length
     	   only context headers. There may be zero or more of these headers as per the length field (for new we will be supporting one).
     	 */
-    	dpi_service_match_reports = sflist_new();
+    	num_reports = 0;
+    	p->dpi_service_scanned = 1;
     	int varLenCtx = (length * 4) - nsh_len; // converting the length to bytes.
     	if (varLenCtx > 0) {
     		// We have an Optional Variable Length Context Headers to parse.
@@ -5203,60 +5253,56 @@ inline void DecodeNSH(const uint8_t *pkt, uint32_t len, Packet *p) {
     		 * In our implementation we assume that all NSH Variable Length Context Headers are
     		 * of the form of the DPI service MatchReport/MatchReportRange structures.
     		 * Other context header formats are not supported.
+    		 * The reports are not copied: the packet gets a view of them (the first and their count),
+    		 * which stays valid as long as the packet data does.
     		 */
     		int mdLenBytes = mdLen * 4; // converting the metadata length to number of bytes.
     		const uint8_t *var_md = pkt + nsh_len;
 
-    		MatchReport *report;
-    		MatchReportRange *rangeReport;
-    		report = (MatchReport *) var_md;
+    		// The metadata type tells the rule ID width of the match reports.
+    		uint8_t rid_size = (type == NSH_MD_TYPE_MATCH_REPORTS_RID32) ? RULE_ID_SIZE_32 : RULE_ID_SIZE_16;
+    		const uint8_t *report = var_md;
     		int bytesRead = 0;
     		int bytesLeft = mdLenBytes;
-    		while (bytesLeft >= sizeof(MatchReport)) {
+    		if (nsh_len + mdLenBytes > len) {
+    			// Truncated metadata: the view must not reach past the captured bytes
+    			bytesLeft = (nsh_len < len) ? (int)(len - nsh_len) : 0;
+    		}
+    		while (bytesLeft >= (int)MATCH_REPORT_SIZE(0, rid_size)) {
     			/**
     			 * We have bytes to read and there are enough bytes for a match report
     			 * (this may not be the case not due to zero padding).
     			 */
-#if RULE_ID_SIZE == 16
-    			rule_id_t rid = ntohs(report->rid);
-#else
-    			rule_id_t rid = ntohl(report->rid);
-#endif
-    			uint8_t is_range = report->is_range;
-    			uint16_t pos = ntohs(report->position);
-
-    			if (is_range) {
-    				rangeReport = (MatchReportRange *)report;
-    				uint16_t length = ntohs(rangeReport->length);
-
-    				bytesRead += sizeof(MatchReportRange);
-    				bytesLeft -= sizeof(MatchReportRange);
-    			} else {
-    				bytesRead += sizeof(MatchReport);
-    				bytesLeft -= sizeof(MatchReport);
-    			}
+    			uint8_t is_range = MATCH_REPORT_IS_RANGE(report, rid_size);
+    			int reportSize = MATCH_REPORT_SIZE(is_range, rid_size);
 
-    			if (sflist_add_tail(dpi_service_match_reports, report)) {
-    				 FatalError("Could not add Match report object to list: rid = %hu\n", rid);
+    			if (bytesLeft < reportSize) {
+    				// Truncated range report
+    				break;
     			}
+    			bytesRead += reportSize;
+    			bytesLeft -= reportSize;
+
+    			num_reports++;
 
-    			report = (MatchReport *)(pkt + nsh_len + bytesRead);
+    			report = var_md + bytesRead;
+    		}
+    		if (num_reports > 0) {
+    			// DPI match reports where found. Set them on the packet for usage in the content rule match phase.
+    			p->dpi_service_match_reports = var_md;
+    			p->dpi_service_num_reports = num_reports;
+    			p->dpi_service_rid_size = rid_size;
     		}
 
     		nsh_len += mdLenBytes;
     		varLenCtx -= mdLenBytes;
     	}
-
-    	if (sflist_count(dpi_service_match_reports) > 0) {
-    		// DPI match reports where found. Set them on the packet for usage in the content rule match phase.
-    		p->dpi_service_match_reports = dpi_service_match_reports;
-    	}
     }
 
     PushLayer(PROTO_NSH, p, pkt, nsh_len);
 
-    len -= nsh_len;
-    if (len > 0) {
+    if (len > nsh_len) {
+		len -= nsh_len;
 		switch (next_protocol) {
 			case NSH_NEXT_PROTOCOL_IPv4:
 				DecodeIP(pkt + nsh_len, len, p);
@@ -203,6 +203,9 @@ struct _SnortConfig;
 #define NSH_NEXT_PROTOCOL_IPv4 1
 #define NSH_NEXT_PROTOCOL_IPv6 2
 #define NSH_NEXT_PROTOCOL_ETHERNET 3
+#define NSH_MD_CLASS_DPI 3
+#define NSH_MD_TYPE_MATCH_REPORTS 1 /* Match reports with uint16 rule IDs */
+#define NSH_MD_TYPE_MATCH_REPORTS_RID32 2 /* Match reports with uint32 rule IDs */
 
 /* ESP constants */
 #define ESP_HEADER_LEN 8
@@ -1881,6 +1884,13 @@ typedef struct _Packet
     EapolKey *eapolk;
 #endif
 
+    /* DPI Service Results: a view of the match reports in the packet's own NSH metadata (not copied) */
+    const uint8_t *dpi_service_match_reports;
+    uint16_t dpi_service_num_reports;
+    uint8_t dpi_service_rid_size; /* Rule ID width of the match reports (RULE_ID_SIZE_16/RULE_ID_SIZE_32) */
+    uint8_t dpi_service_scanned;  /* Came from the DPI Service in NSH, with or without match reports */
+    uint8_t dpi_service_local;    /* Not scanned by the DPI Service: its content is searched locally */
+
     // nothing after this point is zeroed ...
     Options ip_options[IP_OPTMAX];         /* ip options decode structure */
     Options tcp_options[TCP_OPTLENMAX];    /* tcp options decode struct */
@@ -1922,8 +1932,6 @@ typedef struct _Packet
     // Expected session created due to this packet.
     struct _ExpectNode* expectedSession;
 
-    /* DPI Service Results */
-    SF_LIST *dpi_service_match_reports;
 } Packet;
 
 #define PKT_ZERO_LEN offsetof(Packet, ip_options)
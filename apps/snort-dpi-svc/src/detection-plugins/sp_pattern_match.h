@@ -108,30 +108,57 @@ typedef struct _PatternMatchData
 
 /* DPI Service */
 
-/* The rule ID size can be of two sizes: uint16, uint32.
- * Out of the box the size is uint16, in order to save space. */
-#define RULE_ID_SIZE 16
-
-#if RULE_ID_SIZE == 16
-	typedef uint16_t rule_id_t;
-#else
-	typedef uint32_t rule_id_t;
-#endif
+/* Rule IDs are 32 bits wide internally. On the wire, the match reports carry either uint16 rule IDs
+ * (out of the box, in order to save space) or uint32 rule IDs when the rule set needs them.
+ * The width in use is announced by the NSH variable metadata type (see decode.h). */
+#define RULE_ID_SIZE_16 16
+#define RULE_ID_SIZE_32 32
 
+typedef uint32_t rule_id_t;
 
 typedef struct {
-	rule_id_t rid;
+	uint16_t rid;
 	uint8_t is_range;
 	uint16_t position : 15;
 } MatchReport;
 
 typedef struct {
-	rule_id_t rid;
+	uint16_t rid;
 	uint8_t  is_range;
 	uint16_t position : 15;
 	uint16_t length;
 } MatchReportRange;
 
+typedef struct {
+	uint32_t rid;
+	uint8_t is_range;
+	uint16_t position : 15;
+} MatchReport32;
+
+typedef struct {
+	uint32_t rid;
+	uint8_t  is_range;
+	uint16_t position : 15;
+	uint16_t length;
+} MatchReportRange32;
+
+/* Accessors for a match report of the given rule ID width (values are in host order) */
+#define MATCH_REPORT_RID(r, rid_size) \
+	(((rid_size) == RULE_ID_SIZE_32) ? (rule_id_t)ntohl(((MatchReport32 *)(r))->rid) : (rule_id_t)ntohs(((MatchReport *)(r))->rid))
+#define MATCH_REPORT_IS_RANGE(r, rid_size) \
+	(((rid_size) == RULE_ID_SIZE_32) ? ((MatchReport32 *)(r))->is_range : ((MatchReport *)(r))->is_range)
+#define MATCH_REPORT_POSITION(r, rid_size) \
+	(((rid_size) == RULE_ID_SIZE_32) ? ntohs(((MatchReport32 *)(r))->position) : ntohs(((MatchReport *)(r))->position))
+#define MATCH_REPORT_LENGTH(r, rid_size) \
+	(((rid_size) == RULE_ID_SIZE_32) ? ntohs(((MatchReportRange32 *)(r))->length) : ntohs(((MatchReportRange *)(r))->length))
+#define MATCH_REPORT_SIZE(is_range, rid_size) \
+	(((rid_size) == RULE_ID_SIZE_32) ? \
+		((is_range) ? sizeof(MatchReportRange32) : sizeof(MatchReport32)) : \
+		((is_range) ? sizeof(MatchReportRange) : sizeof(MatchReport)))
+/* The match report that follows r (reports are packed back to back, each of its own size) */
+#define MATCH_REPORT_NEXT(r, rid_size) \
+	((const uint8_t *)(r) + MATCH_REPORT_SIZE(MATCH_REPORT_IS_RANGE(r, rid_size), rid_size))
+
 /********************************************************************
  * Public function prototypes
  ********************************************************************/
@@ -1564,8 +1564,18 @@ static int fpFinishPortGroup(SnortConfig *sc, PORT_GROUP *pg, FastPatternConfig
         {
             if (mpseGetPatternCount(pg->pgPms[i]) != 0)
             {
-                if (mpsePrepPatternsWithSnortConf(sc, pg->pgPms[i], pmx_create_tree,
-                            add_patrn_to_neg_list) != 0)
+                int retv;
+
+                /* The content of packets is searched by the DPI service: no local automaton
+                 * is needed unless it falls back to a local search */
+                if (sc->dpi_service_active && !sc->dpi_local_automata_eager && (i == PM_TYPE__CONTENT))
+                    retv = mpsePrepPatternsDpiOffload(sc, pg->pgPms[i], pmx_create_tree,
+                            add_patrn_to_neg_list);
+                else
+                    retv = mpsePrepPatternsWithSnortConf(sc, pg->pgPms[i], pmx_create_tree,
+                            add_patrn_to_neg_list);
+
+                if (retv != 0)
                 {
                     FatalError("%s(%d) Failed to compile port group "
                             "patterns.\n", __FILE__, __LINE__);
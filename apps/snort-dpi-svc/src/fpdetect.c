@@ -1064,6 +1064,60 @@ void printRuleFmt1( SnortConfig *sc, OptTreeNode * otn )
 }
 #endif
 
+/*
+**  DPI Service local search fallback: packets with content that the DPI
+**  Service did not scan (it was bypassed, or did not keep up) are searched
+**  locally, up to snort_conf->dpi_local_fallback packets per second, so
+**  detection degrades gracefully instead of silently inspecting nothing.
+**  The DPI Service marks the packets it scanned (in NSH) only if it runs
+**  with 'markclean', so the fallback is off unless it is configured.
+**  Rebuilt packets are not searched: the packets they were built from were.
+*/
+static time_t dpi_fallback_second;
+static int dpi_fallback_count;
+
+static inline void fpDpiServiceCoverage(Packet *p)
+{
+    if (!p->data || !p->dsize || PacketIsRebuilt(p))
+        return;
+
+    if (p->dpi_service_num_reports)
+    {
+        pc.dpi_reports++;
+        return;
+    }
+
+    if (p->dpi_service_scanned)
+    {
+        pc.dpi_clean++;
+        return;
+    }
+
+    if (snort_conf->dpi_local_fallback > 0)
+    {
+        if (p->pkth->ts.tv_sec != dpi_fallback_second)
+        {
+            dpi_fallback_second = p->pkth->ts.tv_sec;
+            dpi_fallback_count = 0;
+        }
+
+        if (dpi_fallback_count >= snort_conf->dpi_local_fallback)
+        {
+            pc.dpi_fallback_limited++;
+            return;
+        }
+        dpi_fallback_count++;
+    }
+    else if (snort_conf->dpi_local_fallback == 0)
+    {
+        pc.dpi_fallback_limited++;
+        return;
+    }
+
+    p->dpi_service_local = 1;
+    pc.dpi_fallback++;
+}
+
 /*
 **
 **  NAME
@@ -1293,7 +1347,7 @@ static inline int fpEvalHeaderSW(PORT_GROUP *port_group, Packet *p,
                         pattern_match_size = p->alt_dsize;
 
                     start_state = 0;
-                    if (snort_conf->dpi_service_active) {
+                    if (snort_conf->dpi_service_active && !p->dpi_service_local) {
 						mpseSearchDpiSrv(p , so, p->data, pattern_match_size,
 								rule_tree_match, omd, &start_state);
                     } else {
@@ -1628,6 +1682,9 @@ int fpEvalPacket(Packet *p)
     int ip_proto = GET_IPH_PROTO(p);
     OTNX_MATCH_DATA *omd = snort_conf->omd;
 
+    if (snort_conf->dpi_service_active)
+        fpDpiServiceCoverage(p);
+
     /* Run UDP rules against the UDP header of Teredo packets */
     if ( p->udph && (p->proto_bits & (PROTO_BIT__TEREDO | PROTO_BIT__GTP)) )
     {
@@ -9319,6 +9319,8 @@ void ConfigDPIaaService(SnortConfig *sc, char *args) {
 				sc->dpi_export_mode = REST_CALL;
 			} else if (strcasecmp(mode, CONFIG_OPT__DPI_EXPORT_MODE_CONSOLE) == 0) {
 				sc->dpi_export_mode = CONSOLE;
+			} else if (strcasecmp(mode, CONFIG_OPT__DPI_EXPORT_MODE_SOCKET) == 0) {
+				sc->dpi_export_mode = SOCKET;
 			}
 		}
 
@@ -9350,6 +9352,33 @@ void ConfigDPIaaService(SnortConfig *sc, char *args) {
 			sc->dpi_rule_export_dir = exportDir;
 		}
 
+		if (strcasecmp(opts[0], CONFIG_OPT__DPI_RULE_EXPORT_SOCKET) == 0) {
+			sc->dpi_rule_export_socket = SnortStrdup(opts[1]);
+		}
+
+		if (strcasecmp(opts[0], CONFIG_OPT__DPI_LOCAL_AUTOMATA) == 0) {
+			if (strcasecmp(opts[1], CONFIG_OPT__DPI_LOCAL_AUTOMATA_LAZY) == 0) {
+				sc->dpi_local_automata_eager = false;
+			} else if (strcasecmp(opts[1], CONFIG_OPT__DPI_LOCAL_AUTOMATA_EAGER) == 0) {
+				sc->dpi_local_automata_eager = true;
+			} else {
+				ParseError("Invalid argument to '%s'.", CONFIG_OPT__DPI_LOCAL_AUTOMATA);
+			}
+		}
+
+		if (strcasecmp(opts[0], CONFIG_OPT__DPI_LOCAL_FALLBACK) == 0) {
+			if (strcasecmp(opts[1], CONFIG_OPT__DPI_LOCAL_FALLBACK_UNLIMITED) == 0) {
+				sc->dpi_local_fallback = -1;
+			} else {
+				char *end;
+				long rate = strtol(opts[1], &end, 10);
+				if ((*end != '\0') || (rate < 0) || (rate > INT32_MAX)) {
+					ParseError("Invalid argument to '%s'.", CONFIG_OPT__DPI_LOCAL_FALLBACK);
+				}
+				sc->dpi_local_fallback = (int)rate;
+			}
+		}
+
 		mSplitFree(&opts, num_opts);
 	}
 
@@ -9372,6 +9401,12 @@ void ConfigDPIaaService(SnortConfig *sc, char *args) {
 		case CONSOLE:
 			// No need for additional parameters.
 			break;
+		case SOCKET:
+			if ((sc->dpi_rule_export_socket == NULL) &&
+					((sc->dpi_controller_ip == NULL) || (sc->dpi_controller_port == 0))) {
+				ParseError("Invalid argument to '%s'.", CONFIG_OPT__DPI_RULE_EXPORT_SOCKET);
+			}
+			break;
 		case UNKNOWN:
 			ParseError("Invalid arguments to '%s'.", CONFIG_OPT__DPI_SERVICE_RULE_EXPORT_MODE);
 			break;
@@ -226,9 +226,16 @@
 # define CONFIG_OPT__DPI_EXPORT_MODE_FILE			"file"
 # define CONFIG_OPT__DPI_EXPORT_MODE_CONTROLLER		"controller"
 # define CONFIG_OPT__DPI_EXPORT_MODE_CONSOLE		"console"
+# define CONFIG_OPT__DPI_EXPORT_MODE_SOCKET		"socket"
 # define CONFIG_OPT__DPI_CONTROLLER_IP              "dpi_controller_ip"
 # define CONFIG_OPT__DPI_CONTROLLER_PORT            "dpi_controller_port"
 # define CONFIG_OPT__DPI_RULE_EXPORT_DIR			"dpi_rule_export_dir"
+# define CONFIG_OPT__DPI_RULE_EXPORT_SOCKET		"dpi_rule_export_socket"
+# define CONFIG_OPT__DPI_LOCAL_AUTOMATA			"dpi_local_automata"
+# define CONFIG_OPT__DPI_LOCAL_AUTOMATA_LAZY		"lazy"
+# define CONFIG_OPT__DPI_LOCAL_AUTOMATA_EAGER		"eager"
+# define CONFIG_OPT__DPI_LOCAL_FALLBACK			"dpi_local_fallback"
+# define CONFIG_OPT__DPI_LOCAL_FALLBACK_UNLIMITED	"unlimited"
 
 /* exported values */
 extern char *file_name;
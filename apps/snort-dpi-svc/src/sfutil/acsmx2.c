@@ -1877,10 +1877,10 @@ void acsmCompressStates(
 }
 
 /*
-*   Compile State Machine - NFA or DFA and Full or Banded or Sparse or SparseBands
+*   Build the keyword trie (as transition lists) and the MatchList of its states
 */
-static inline int
-_acsmCompile2(
+static inline void
+_acsmBuildTrie2(
         ACSM_STRUCT2* acsm
         )
 {
@@ -1933,6 +1933,17 @@ _acsmCompile2(
 
     /* Add the 0'th state */
     acsm->acsmNumStates++;
+}
+
+/*
+*   Compile State Machine - NFA or DFA and Full or Banded or Sparse or SparseBands
+*/
+static inline int
+_acsmCompile2(
+        ACSM_STRUCT2* acsm
+        )
+{
+    _acsmBuildTrie2(acsm);
 
     if (acsm->compress_states)
     {
@@ -2128,6 +2139,64 @@ acsmCompile2(
     return 0;
 }
 
+/*
+*   Build only the MatchList of each pattern's final trie state, with its rule option tree, but no
+*   automaton: for patterns that are searched elsewhere (by the DPI service), and only need to be
+*   mapped to their rules. acsmSearch2 cannot be used on the result (see acsmCopyPatterns2).
+*/
+int
+acsmCompileMatchLists2WithSnortConf(
+        struct _SnortConfig *sc,
+        ACSM_STRUCT2* acsm,
+        int (*build_tree)(struct _SnortConfig *, void* id, void** existing_tree),
+        int (*neg_list_func)(void* id, void** list)
+        )
+{
+    _acsmBuildTrie2(acsm);
+
+    /* The trie itself is not needed */
+    List_FreeTransTable(acsm);
+
+    if (build_tree && neg_list_func)
+    {
+        acsmBuildMatchStateTrees2WithSnortConf(sc, acsm, build_tree, neg_list_func);
+    }
+
+    return 0;
+}
+
+/*
+*   A new (uncompiled) state machine with the patterns and settings of acsm. The pattern
+*   user data stays owned by acsm.
+*/
+ACSM_STRUCT2 *
+acsmCopyPatterns2(
+        ACSM_STRUCT2* acsm
+        )
+{
+    ACSM_STRUCT2 *copy;
+    ACSM_PATTERN2 *plist;
+
+    copy = acsmNew2(NULL, acsm->optiontreefree, acsm->neg_list_free);
+    if (copy == NULL)
+        return NULL;
+
+    copy->acsmFSA               = acsm->acsmFSA;
+    copy->acsmFormat            = acsm->acsmFormat;
+    copy->acsmAlphabetSize      = acsm->acsmAlphabetSize;
+    copy->acsmSparseMaxRowNodes = acsm->acsmSparseMaxRowNodes;
+    copy->acsmSparseMaxZcnt     = acsm->acsmSparseMaxZcnt;
+    copy->compress_states       = acsm->compress_states;
+
+    for (plist = acsm->acsmPatterns; plist != NULL; plist = plist->next)
+    {
+        acsmAddPattern2(copy, plist->casepatrn, plist->n, plist->nocase, plist->offset,
+                plist->depth, plist->negative, plist->udata, plist->iid);
+    }
+
+    return copy;
+}
+
 int
 acsmCompile2WithSnortConf(
         struct _SnortConfig *sc,
@@ -3195,7 +3264,8 @@ acsmFree2(
             AC_FREE(ilist, 0, ACSM2_MEMORY_TYPE__NONE);
         }
 
-        AC_FREE_DFA(acsm->acsmNextState[i], 0, 0);
+        if (acsm->acsmNextState)
+            AC_FREE_DFA(acsm->acsmNextState[i], 0, 0);
     }
 
     for (plist = acsm->acsmPatterns; plist; )
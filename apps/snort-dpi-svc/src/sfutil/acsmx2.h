@@ -180,6 +180,10 @@ struct _SnortConfig;
 int acsmCompile2WithSnortConf ( struct _SnortConfig *, ACSM_STRUCT2 * acsm,
                                 int (*build_tree)(struct _SnortConfig *, void * id, void **existing_tree),
                                 int (*neg_list_func)(void *id, void **list));
+int acsmCompileMatchLists2WithSnortConf ( struct _SnortConfig *, ACSM_STRUCT2 * acsm,
+                                int (*build_tree)(struct _SnortConfig *, void * id, void **existing_tree),
+                                int (*neg_list_func)(void *id, void **list));
+ACSM_STRUCT2 * acsmCopyPatterns2 ( ACSM_STRUCT2 * acsm );
 int acsmSearch2 ( ACSM_STRUCT2 * acsm,unsigned char * T, int n,
                   int (*Match)(void * id, void *tree, int index, void *data, void *neg_list),
                   void * data, int* current_state );
@@ -55,7 +55,6 @@
 
 #include "profiler.h"
 #include "snort.h"
-#include "HashMap.h"
 #ifdef PERF_PROFILING
 PreprocStats mpsePerfStats;
 #endif
@@ -248,6 +247,14 @@ void   mpseFree( void * pvoid )
     if (p == NULL)
         return;
 
+    if (p->dpi_rids)
+        free(p->dpi_rids);
+    if (p->dpi_reported)
+        free(p->dpi_reported);
+
+    if (p->dpi_local_obj)
+        acsmFree2((ACSM_STRUCT2 *)p->dpi_local_obj);
+
     switch( p->method )
     {
         case MPSE_AC_BNFA:
@@ -591,72 +598,239 @@ void mpseInitSummary(void)
     KTrieInitMemUsed();
 }
 
+#ifndef DYNAMIC_PREPROC_CONTEXT
+/**
+ * The function prepares the patterns of an MPSE whose content is searched by the DPI Service:
+ * it only builds the mapping from each pattern to its rules (used to export the rules and to
+ * evaluate the match reports), not the automaton. The automaton is built the first time the MPSE
+ * is searched locally. Methods other than the ACSM2 ones are prepared as usual.
+ */
+int mpsePrepPatternsDpiOffload(struct _SnortConfig *sc, void *pvoid,
+        int (*build_tree)(struct _SnortConfig *, void *id, void **existing_tree),
+        int (*neg_list_func)(void *id, void **list))
+{
+    MPSE *p = (MPSE*)pvoid;
+
+    switch (p->method)
+    {
+        case MPSE_ACF:
+        case MPSE_ACF_Q:
+        case MPSE_ACS:
+        case MPSE_ACB:
+        case MPSE_ACSB:
+            p->dpi_offload = 1;
+            p->build_tree = build_tree;
+            p->neg_list_func = neg_list_func;
+            return acsmCompileMatchLists2WithSnortConf(sc, (ACSM_STRUCT2*)p->obj, build_tree, neg_list_func);
+
+        default:
+            return mpsePrepPatternsWithSnortConf(sc, pvoid, build_tree, neg_list_func);
+    }
+}
+
+/* The automaton of a DPI offloaded MPSE, built on first use */
+static ACSM_STRUCT2 *mpseDpiLocalObj(MPSE *p)
+{
+    ACSM_STRUCT2 *acsm;
+
+    if (p->dpi_local_obj == NULL)
+    {
+        acsm = acsmCopyPatterns2((ACSM_STRUCT2*)p->obj);
+        if ((acsm == NULL) || acsmCompile2WithSnortConf(snort_conf, acsm, p->build_tree, p->neg_list_func))
+        {
+            FatalError("%s(%d) Failed to compile port group patterns for local search.\n",
+                    __FILE__, __LINE__);
+        }
+        p->dpi_local_obj = acsm;
+    }
+
+    return (ACSM_STRUCT2*)p->dpi_local_obj;
+}
+#endif //DYNAMIC_PREPROC_CONTEXT
+
+/* The ACSM2 automaton to search with */
+static inline ACSM_STRUCT2 *mpseAcsm2(MPSE *p)
+{
+#ifndef DYNAMIC_PREPROC_CONTEXT
+    if (p->dpi_offload)
+        return mpseDpiLocalObj(p);
+#endif
+    return (ACSM_STRUCT2*)p->obj;
+}
+
+#define MPSE_DPI_RIDS_INIT_SIZE 16
+
+static inline uint32_t mpseDpiRidHash(rule_id_t rid)
+{
+    rid ^= rid >> 16;
+    rid *= 0x45d9f3b;
+    rid ^= rid >> 16;
+    return rid;
+}
+
+/* The slot of rid in the dispatch table: its entry, or the empty slot it would go to */
+static inline MPSE_DPI_RID_ENTRY *mpseDpiRidSlot(MPSE_DPI_RID_ENTRY *table, uint32_t mask, rule_id_t rid)
+{
+    uint32_t i = mpseDpiRidHash(rid) & mask;
+
+    while (table[i].mlist && table[i].rid != rid)
+        i = (i + 1) & mask;
+    return &table[i];
+}
+
+/**
+ * The function creates the (empty) DPI Service dispatch table of the MPSE. An MPSE with a table
+ * is one whose content rules were registered to the DPI Service.
+ */
+void mpseDpiRidsInit(void *pvoid)
+{
+    MPSE *p = (MPSE*)pvoid;
+
+    p->dpi_rids = (MPSE_DPI_RID_ENTRY *)SnortAlloc(MPSE_DPI_RIDS_INIT_SIZE * sizeof(MPSE_DPI_RID_ENTRY));
+    p->dpi_rids_mask = MPSE_DPI_RIDS_INIT_SIZE - 1;
+    p->dpi_reported = (MPSE_DPI_RID_ENTRY **)SnortAlloc(MPSE_DPI_RIDS_INIT_SIZE * sizeof(MPSE_DPI_RID_ENTRY *));
+    p->dpi_num_rids = 0;
+}
+
+/**
+ * The function adds a rule to the DPI Service dispatch table of the MPSE (rule ID => mlist).
+ * The table is kept at most half full, so a lookup usually takes a single probe.
+ * returns: 1 if the rule was added to the table; 0 if it is already there.
+ */
+int mpseDpiRidAdd(void *pvoid, rule_id_t rid, int priority, void *mlist)
+{
+    MPSE *p = (MPSE*)pvoid;
+    MPSE_DPI_RID_ENTRY *slot, *table;
+    uint32_t i, size;
+
+    slot = mpseDpiRidSlot(p->dpi_rids, p->dpi_rids_mask, rid);
+    if (slot->mlist)
+        return 0;
+
+    if (2 * (p->dpi_num_rids + 1) > p->dpi_rids_mask + 1)
+    {
+        /* Grow the table (this only happens while the rules are registered) */
+        size = 2 * (p->dpi_rids_mask + 1);
+        table = (MPSE_DPI_RID_ENTRY *)SnortAlloc(size * sizeof(MPSE_DPI_RID_ENTRY));
+        for (i = 0; i <= p->dpi_rids_mask; i++)
+        {
+            if (p->dpi_rids[i].mlist)
+                *mpseDpiRidSlot(table, size - 1, p->dpi_rids[i].rid) = p->dpi_rids[i];
+        }
+        free(p->dpi_rids);
+        p->dpi_rids = table;
+        p->dpi_rids_mask = size - 1;
+        free(p->dpi_reported);
+        p->dpi_reported = (MPSE_DPI_RID_ENTRY **)SnortAlloc(size * sizeof(MPSE_DPI_RID_ENTRY *));
+        slot = mpseDpiRidSlot(p->dpi_rids, p->dpi_rids_mask, rid);
+    }
+
+    slot->rid = rid;
+    slot->mlist = mlist;
+    slot->priority = priority;
+    p->dpi_num_rids++;
+
+    return 1;
+}
+
+/* Rule evaluation order: by priority (a lower value first), then by rule ID */
+static int mpseDpiRidCompare(const void *pa, const void *pb)
+{
+    const MPSE_DPI_RID_ENTRY *a = *(const MPSE_DPI_RID_ENTRY * const *)pa;
+    const MPSE_DPI_RID_ENTRY *b = *(const MPSE_DPI_RID_ENTRY * const *)pb;
+
+    if (a->priority != b->priority)
+        return (a->priority < b->priority) ? -1 : 1;
+    if (a->rid != b->rid)
+        return (a->rid < b->rid) ? -1 : 1;
+    return 0;
+}
+
 /**
  * The function performs efficient DPI on the packet's content by leveraging information (match reports) from the DPI Service.
+ * The reported rules are evaluated once each, however many times (and at whichever positions) they
+ * were reported: a rule option tree searches the packet's content itself, so a report only tells
+ * which trees are worth evaluating. All the rules reported with the packet are sorted together and
+ * evaluated by priority, so the outcome does not depend on the order of the reports.
  */
-int mpseSearchDpiSrv(Packet *p, void *pvoid, const unsigned char * T, int n,
+static int mpseDpiSrvMatch(Packet *p, MPSE *mpse,
 		int (*Match)(void * id, void *tree, int index, void *data, void *neg_list),
-		void * data, int* current_state )
+		void * data)
 {
-	if (!p->dpi_service_match_reports) {
+	if (!p->dpi_service_num_reports) {
 		// No match reports where sent with the packet.
 		return 0;
 	}
 
-	MPSE *mpse = (MPSE*)pvoid;
-	ACSM_STRUCT2 * acsm = (ACSM_STRUCT2*) mpse->obj;
-	HashMap *ruleMlistMap = (HashMap *)sfghash_find(snort_conf->dpi_acsm_map, acsm);
-	ACSM_PATTERN2 *mlist;
+	if (!mpse->dpi_rids) {
+		// The port group has no content rules registered to the DPI service.
+		return 0;
+	}
 
-	rule_id_t rid;
-	uint16_t position, length, pos;
-	MatchReport *report;
-	MatchReportRange *rangeReport;
-	int j, count;
+	MPSE_DPI_RID_ENTRY *entry;
+	ACSM_PATTERN2 *mlist;
+	uint8_t rid_size = p->dpi_service_rid_size;
+	const uint8_t *report;
+	uint32_t mark, k, num;
+	int i;
+
+	// A new mark for this search (the entries marked with it were already reported)
+	mark = ++mpse->dpi_mark;
+	if (mark == 0) {
+		for (k = 0; k <= mpse->dpi_rids_mask; k++) {
+			mpse->dpi_rids[k].mark = 0;
+		}
+		mark = mpse->dpi_mark = 1;
+	}
 
-	/* Go over the DPI service content match results and check if they match existing content rules.
-	 * Matching rules are send for advanced evaluation via the Match function.
+	/* Go over the DPI service content match results and collect the content rules they refer to,
+	 * each once (a range report is a single one), so there are at most dpi_num_rids of them.
+	 * The reports are read in place, from the packet's NSH metadata.
 	 * */
-	for (report = (MatchReport *)sflist_first(p->dpi_service_match_reports);
-		 report;
-		 report = (MatchReport *)sflist_next(p->dpi_service_match_reports))
+	num = 0;
+	for (i = 0, report = p->dpi_service_match_reports;
+		 i < p->dpi_service_num_reports;
+		 i++, report = MATCH_REPORT_NEXT(report, rid_size))
 	{
-#if RULE_ID_SIZE == 16
-		rid = ntohs(report->rid);
-#else
-		rid = ntohl(report->rid);
-#endif
-		position = ntohs(report->position);
-		mlist = (ACSM_PATTERN2 *)hashmap_get(ruleMlistMap, rid);
-		if (mlist != NULL) {
-			// The report/pattern has a matching content rule.
-			if (report->is_range) {
-				// The repost is of type range. Hence, we need to check for all the occurrences of the match.
-				rangeReport = (MatchReportRange*)report;
-				length = ntohs(rangeReport->length);
-				for (j = 0; j < length; j++) {
-					pos = position + j;
-					count++;
-					if (Match (mlist->udata, mlist->rule_option_tree, pos, data, mlist->neg_list) > 0) {
-						return count;
-					}
-				}
-			} else {
-				// The repost is for a single occurrence. Check for a match.
-				count++;
-				if (Match (mlist->udata, mlist->rule_option_tree, position, data, mlist->neg_list) > 0) {
-					return count;
-				}
-			}
+		entry = mpseDpiRidSlot(mpse->dpi_rids, mpse->dpi_rids_mask, MATCH_REPORT_RID(report, rid_size));
+		if (entry->mlist == NULL || entry->mark == mark) {
+			// Not a content rule of this port group, or already collected.
+			continue;
 		}
+		entry->mark = mark;
+		entry->position = MATCH_REPORT_POSITION(report, rid_size);
+		mpse->dpi_reported[num++] = entry;
 	}
 
-	sflist_free(p->dpi_service_match_reports);
-	p->dpi_service_match_reports = NULL;
+	// Then evaluate all of them in order
+	if (num > 1) {
+		qsort(mpse->dpi_reported, num, sizeof(MPSE_DPI_RID_ENTRY *), mpseDpiRidCompare);
+	}
+	for (k = 0; k < num; k++) {
+		mlist = (ACSM_PATTERN2 *)mpse->dpi_reported[k]->mlist;
+		if (Match(mlist->udata, mlist->rule_option_tree, mpse->dpi_reported[k]->position, data, mlist->neg_list) > 0) {
+			return k + 1;
+		}
+	}
 
 	return 0;
 }
 
+int mpseSearchDpiSrv(Packet *p, void *pvoid, const unsigned char * T, int n,
+		int (*Match)(void * id, void *tree, int index, void *data, void *neg_list),
+		void * data, int* current_state )
+{
+    int ret;
+    PROFILE_VARS;
+
+    /* Profiled as a local search is (less the rule evaluation), so the two can be compared */
+    PREPROC_PROFILE_START(mpsePerfStats);
+    ret = mpseDpiSrvMatch(p, (MPSE*)pvoid, Match, data);
+    PREPROC_PROFILE_END(mpsePerfStats);
+
+    return ret;
+}
+
 int mpseSearch( void *pvoid, const unsigned char * T, int n,
                 int ( *action )(void* id, void * tree, int index, void *data, void *neg_list),
                 void * data, int* current_state )
@@ -692,7 +866,7 @@ int mpseSearch( void *pvoid, const unsigned char * T, int n,
      case MPSE_ACS:
      case MPSE_ACB:
      case MPSE_ACSB:
-      ret = acsmSearch2( (ACSM_STRUCT2*) p->obj, (unsigned char *)T, n, action, data, current_state );
+      ret = acsmSearch2( mpseAcsm2(p), (unsigned char *)T, n, action, data, current_state );
       PREPROC_PROFILE_END(mpsePerfStats);
       return ret;
 
@@ -741,7 +915,7 @@ int mpseSearchAll( void *pvoid, const unsigned char * T, int n,
      case MPSE_ACS:
      case MPSE_ACB:
      case MPSE_ACSB:
-      ret = acsmSearchAll2( (ACSM_STRUCT2*) p->obj, (unsigned char *)T, n, action, data, current_state );
+      ret = acsmSearchAll2( mpseAcsm2(p), (unsigned char *)T, n, action, data, current_state );
       PREPROC_PROFILE_END(mpsePerfStats);
       return ret;
 
@@ -57,6 +57,19 @@
 #define MPSE_INCREMENT_GLOBAL_CNT 1
 #define MPSE_DONT_INCREMENT_GLOBAL_COUNT 0
 
+struct _SnortConfig;
+
+/* An entry of the DPI Service dispatch table: the match list of the rule that a match report refers to */
+typedef struct _mpse_dpi_rid_entry {
+
+    rule_id_t rid;
+    void * mlist; /* NULL for an empty slot */
+    int priority; /* Of the rule: the rules of a packet are evaluated by priority */
+    uint32_t mark; /* The last search that reported the rule (see mpseSearchDpiSrv) */
+    uint16_t position; /* Of the first report in that search */
+
+} MPSE_DPI_RID_ENTRY;
+
 typedef struct _mpse_struct {
 
     int    method;
@@ -65,6 +78,20 @@ typedef struct _mpse_struct {
     uint64_t bcnt;
     char   inc_global_counter;
 
+    /* DPI Service dispatch table (rule ID => match list), open addressing, at most half full */
+    MPSE_DPI_RID_ENTRY * dpi_rids;
+    uint32_t dpi_rids_mask;
+    uint32_t dpi_num_rids;
+    uint32_t dpi_mark; /* The current search */
+    MPSE_DPI_RID_ENTRY ** dpi_reported; /* The rules reported to the current search (room for all of them) */
+
+    /* DPI Service offload: obj only maps the patterns to their rules, the automaton for local
+       searches is built on first use (see mpsePrepPatternsDpiOffload) */
+    char   dpi_offload;
+    void * dpi_local_obj;
+    int  (*build_tree)(struct _SnortConfig *, void *id, void **existing_tree);
+    int  (*neg_list_func)(void *id, void **list);
+
 } MPSE;
 
 /*
@@ -102,6 +129,11 @@ int  mpsePrepPatternsWithSnortConf  ( struct _SnortConfig *, void * pvoid,
 void mpseSetRuleMask   ( void *pv, BITOP * rm );
 
 /* DPI Service functions **********************************************************************/
+int  mpsePrepPatternsDpiOffload ( struct _SnortConfig *, void * pvoid,
+                                  int ( *build_tree )(struct _SnortConfig *, void *id, void **existing_tree),
+                                  int ( *neg_list_func )(void *id, void **list) );
+void mpseDpiRidsInit(void *pvoid);
+int  mpseDpiRidAdd(void *pvoid, rule_id_t rid, int priority, void *mlist);
 int mpseSearchDpiSrv(Packet *p, void *pvoid, const unsigned char * T, int n,
                 int ( *action )(void* id, void * tree, int index, void *data, void *neg_list),
                 void * data, int* current_state );
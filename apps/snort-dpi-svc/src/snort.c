@@ -61,6 +61,10 @@
 
 #ifndef WIN32
 #include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #else
 #include <Iphlpapi.h>
 #endif
@@ -559,18 +563,16 @@ const char * CLASS_NAME_VALUE = "MatchRule";
 const char * PATTERN = "pattern";
 const char * IS_REGEX = "is_regex";
 const char * RULE_ID = "rid";
+const char * OFFSET = "offset";
+const char * DEPTH = "depth";
 
 /* DPI Service functions*******************************************************/
-static inline void RegisterContentRulesToDPIController(SnortConfig *sc);
-static inline SFGHASH * CreateAcsmListMap(void);
-static inline void AcsmListMapFree(HashMap *ruleToMlist);
-static inline HashMap * CreateRuleToMlistMap(void);
-static inline bool RuleAdd(HashMap *ruleMlistMap, rule_id_t rid, ACSM_PATTERN2 *mlist);
-static inline void AcsmAdd(SFGHASH *matchListMap, ACSM_STRUCT2 *acsm, HashMap *ruleMlistMap);
+static void RegisterContentRulesToDPIController(SnortConfig *sc);
 static inline void DPIServiceFree(SnortConfig *sc);
-static inline void ProcessPortRuleMap(PORT_RULE_MAP *portRuleMap, SFGHASH *acsmMap, cJSON *ruleList, SnortConfig *sc);
-static inline void ProcessPortGroup(PORT_GROUP *portGroup, SFGHASH *acsmMap, cJSON *ruleList, SnortConfig *sc);
-static inline void ProcessPortGroups(PORT_GROUP **portGroups, SFGHASH *acsmMap, cJSON *ruleList, SnortConfig *sc);
+static inline void ProcessPortRuleMap(PORT_RULE_MAP *portRuleMap, HashMap *rules, SnortConfig *sc);
+static inline void ProcessPortGroup(PORT_GROUP *portGroup, HashMap *rules, SnortConfig *sc);
+static inline void ProcessPortGroups(PORT_GROUP **portGroups, HashMap *rules, SnortConfig *sc);
+static int ExportSnortRulesToSocket(SnortConfig *sc, HashMap *rules);
 
 /* Signal handler declarations ************************************************/
 static void SigDumpStatsHandler(int);
@@ -5326,6 +5328,89 @@ void SnortInit(int argc, char **argv)
     ScRestoreInternalLogLevel();
 }
 
+/* A content rule registered to the DPI Service */
+typedef struct _DPIExportedRule {
+	char *pattern;
+	int is_regex;
+	int offset; // Where Snort looks for the pattern (see DPIRulePosition); both 0 if anywhere
+	int depth;
+	int changed; // Not registered (with this pattern and position) by the previous config
+} DPIExportedRule;
+
+/*
+ * The rules registered by the previous config, by rule ID. They outlive it (the patterns are
+ * copied), so a reload only exports the rules it changed.
+ */
+static HashMap *dpi_registered_rules = NULL;
+static int dpi_export_pending = 0; // The previous export failed: export again even if nothing changed
+static int dpi_export_sock = -1;
+static uint32_t dpi_export_generation = 0;
+
+#define DPI_EXPORT_BUF_SIZE 65536
+
+typedef struct _DPIExportBuf {
+	uint8_t data[DPI_EXPORT_BUF_SIZE];
+	size_t len;
+	int failed;
+} DPIExportBuf;
+
+static void DPIExportedRulesFree(HashMap *rules) {
+	HashObject *entry;
+	DPIExportedRule *rule;
+
+	if (rules == NULL)
+		return;
+
+	hashmap_iterator_reset(rules);
+	while ((entry = hashmap_iterator_next_entry(rules)) != NULL) {
+		rule = (DPIExportedRule *)entry->data;
+		free(rule->pattern);
+		free(rule);
+	}
+	hashmap_destroy(rules);
+}
+
+/*
+ * The function compares the rules of a new config (whose patterns still belong to it) to the
+ * previously registered ones: it marks the changed rules, and takes over the patterns of the
+ * unchanged ones from the previous set, so only the changed ones are copied.
+ * returns: the number of added (or changed) rules; removed is set to the number of removed ones.
+ */
+static int DPIExportedRulesDiff(HashMap *rules, HashMap *previous, int *removed) {
+	HashObject *entry;
+	DPIExportedRule *rule, *old;
+	int added = 0;
+
+	*removed = 0;
+	hashmap_iterator_reset(rules);
+	while ((entry = hashmap_iterator_next_entry(rules)) != NULL) {
+		rule = (DPIExportedRule *)entry->data;
+		old = (previous != NULL) ? (DPIExportedRule *)hashmap_get(previous, entry->key) : NULL;
+		if ((old != NULL) && (old->pattern != NULL) && (old->is_regex == rule->is_regex) &&
+				(old->offset == rule->offset) && (old->depth == rule->depth) &&
+				(strcmp(old->pattern, rule->pattern) == 0)) {
+			rule->pattern = old->pattern;
+			old->pattern = NULL;
+			rule->changed = 0;
+		} else {
+			rule->pattern = SnortStrdup(rule->pattern);
+			rule->changed = 1;
+			added++;
+		}
+	}
+
+	if (previous != NULL) {
+		hashmap_iterator_reset(previous);
+		while ((entry = hashmap_iterator_next_entry(previous)) != NULL) {
+			// (a changed rule is counted as added only)
+			if (hashmap_get(rules, entry->key) == NULL)
+				(*removed)++;
+		}
+	}
+
+	return added;
+}
+
 /**
  * The function write the date to the given file path.
  * It checks for various error conditions such as file I/O problems and returns 1 (true) if okay, 0 (false) otherwise.
@@ -5345,11 +5430,50 @@ static inline int WriteToFile(char *filepath, char *data, char *mode) {
 	return rc;
 }
 
-static inline void ExportSnortRules(SnortConfig *sc, cJSON *root) {
-	if (!sc->dpi_service_active)
-		return;
+/* The function creates the JSON message of the rules to the DPI Controller. */
+static cJSON *DPIRulesToJSON(HashMap *rules) {
+	cJSON *root, *ruleList, *matchRule;
+	HashObject *entry;
+	DPIExportedRule *rule;
+
+	root=cJSON_CreateObject();
+	cJSON_AddStringToObject(root, SNORT_ID, "master_snort");
+	ruleList=cJSON_CreateArray();
+	cJSON_AddItemToObject(root, RULE_LIST, ruleList);
 
+	/*
+	 *  The Rule Pattern Match JSON structure for DPI Service - DPI Controller interface.
+	 *	{
+	 *		className: 'MatchRule',
+	 *		pattern: some exact-string or regular-expression string,
+	 *		is_regex: true if pattern is a regular-expression or false otherwise,
+	 *		rid: rule identification number,
+	 *		offset, depth: where the pattern may be in the packet data (only if Snort limits it)
+	 *	}
+	 */
+	hashmap_iterator_reset(rules);
+	while ((entry = hashmap_iterator_next_entry(rules)) != NULL) {
+		rule = (DPIExportedRule *)entry->data;
+		matchRule=cJSON_CreateObject();
+		cJSON_AddStringToObject(matchRule, CLASS_NAME, CLASS_NAME_VALUE);
+		cJSON_AddItemToObject(matchRule, PATTERN, cJSON_CreateString(rule->pattern));
+		cJSON_AddBoolToObject(matchRule, IS_REGEX, rule->is_regex);
+		cJSON_AddNumberToObject(matchRule, RULE_ID, entry->key);
+		if (rule->offset || rule->depth) {
+			cJSON_AddNumberToObject(matchRule, OFFSET, rule->offset);
+			cJSON_AddNumberToObject(matchRule, DEPTH, rule->depth);
+		}
+		cJSON_AddItemToArray(ruleList, matchRule);
+	}
+
+	return root;
+}
+
+/* returns: 1 if the rules were exported (or there is nothing to export them to); 0 otherwise. */
+static inline int ExportSnortRules(SnortConfig *sc, HashMap *rules) {
 	char *out;
+	cJSON *root;
+	int rc = 1;
 
 	switch (sc->dpi_export_mode) {
 			case FILE_WRITE:
@@ -5376,11 +5500,14 @@ static inline void ExportSnortRules(SnortConfig *sc, cJSON *root) {
 				strcat(filepath, sc->dpi_rule_export_dir);
 				strcat(filepath, filename);
 
+				root=DPIRulesToJSON(rules);
 				out=cJSON_Print(root);
 				cJSON_Delete(root);
 				cJSON_Minify(out);
-				WriteToFile(filepath, out, "w");
+				rc = WriteToFile(filepath, out, "w");
 				free(out);
+				if (!rc)
+					ErrorMessage("DPI Service: could not write the rules to %s.\n", filepath);
 				break;
 			case REST_CALL:
 				// Currently not supported.
@@ -5389,38 +5516,296 @@ static inline void ExportSnortRules(SnortConfig *sc, cJSON *root) {
 				// Do not export at all.
 				break;
 			case CONSOLE:
+				root=DPIRulesToJSON(rules);
 				out=cJSON_Print(root);	cJSON_Delete(root);
 				printf("%s\n",out); cJSON_Minify(out); printf("%s\n",out);  free(out);
 				break;
+			case SOCKET:
+				rc = ExportSnortRulesToSocket(sc, rules);
+				break;
 		}
+
+	return rc;
 }
 
-static inline void ProcessPortRuleMap(PORT_RULE_MAP *portRuleMap, SFGHASH *acsmMap, cJSON *ruleList, SnortConfig *sc) {
-	ProcessPortGroups(portRuleMap->prmSrcPort, acsmMap, ruleList, sc);
-	ProcessPortGroups(portRuleMap->prmDstPort, acsmMap, ruleList, sc);
+/* Connects to the DPI Service: to the configured Unix socket, or to the controller over TCP. */
+static int DPIExportConnect(SnortConfig *sc) {
+	int sock;
+
+	if (sc->dpi_rule_export_socket != NULL) {
+		struct sockaddr_un addr;
+
+		if (strlen(sc->dpi_rule_export_socket) >= sizeof(addr.sun_path)) {
+			ErrorMessage("DPI Service: rule export socket path is too long: %s\n", sc->dpi_rule_export_socket);
+			return -1;
+		}
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, sc->dpi_rule_export_socket);
+
+		if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			return -1;
+		if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			close(sock);
+			return -1;
+		}
+	} else {
+		struct sockaddr_in addr;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons((uint16_t)sc->dpi_controller_port);
+		if (inet_pton(AF_INET, sc->dpi_controller_ip, &addr.sin_addr) != 1) {
+			ErrorMessage("DPI Service: invalid controller IP: %s\n", sc->dpi_controller_ip);
+			return -1;
+		}
+
+		if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+			return -1;
+		if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			close(sock);
+			return -1;
+		}
+	}
+
+	return sock;
+}
+
+static void DPIExportFlush(DPIExportBuf *buf) {
+	size_t sent = 0;
+	ssize_t n;
+
+	while (!buf->failed && sent < buf->len) {
+		n = send(dpi_export_sock, buf->data + sent, buf->len - sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			buf->failed = 1;
+		} else {
+			sent += n;
+		}
+	}
+	buf->len = 0;
+}
+
+static void DPIExportRecord(DPIExportBuf *buf, uint8_t type, uint8_t flags, uint32_t rid, const void *payload, uint16_t len) {
+	DPIRuleRecordHdr hdr;
+
+	if (buf->len + sizeof(hdr) + len > DPI_EXPORT_BUF_SIZE)
+		DPIExportFlush(buf);
+
+	hdr.type = type;
+	hdr.flags = flags;
+	hdr.len = htons(len);
+	hdr.rid = htonl(rid);
+	memcpy(buf->data + buf->len, &hdr, sizeof(hdr));
+	if (len > 0)
+		memcpy(buf->data + buf->len + sizeof(hdr), payload, len);
+	buf->len += sizeof(hdr) + len;
+}
+
+/*
+ * The function sends the DPI Service the changes to the content rules since the previous export
+ * (all of them on a new connection), so a reload does not push the whole rule set again.
+ * If the DPI Service cannot be reached, the rules are sent in full on the next export.
+ * returns: 1 if the rules were sent; 0 otherwise.
+ */
+static int ExportSnortRulesToSocket(SnortConfig *sc, HashMap *rules) {
+	static DPIExportBuf buf;
+	static uint8_t payload[DPI_EXPORT_BUF_SIZE];
+	DPIExportedRule *rule;
+	HashObject *entry;
+	HashMap *previous;
+	DPIRulePosition position;
+	uint8_t begin[4];
+	uint8_t flags;
+	size_t len, pos_len;
+
+	previous = dpi_registered_rules;
+	flags = 0;
+	if (dpi_export_sock < 0) {
+		if ((dpi_export_sock = DPIExportConnect(sc)) < 0) {
+			ErrorMessage("DPI Service: could not connect to export the rules (%s).\n", strerror(errno));
+			return 0;
+		}
+		// A new connection: the DPI Service starts from an empty rule set
+		previous = NULL;
+		flags = DPI_RULE_FLAG_RESET;
+	}
+
+	dpi_export_generation++;
+	buf.len = 0;
+	buf.failed = 0;
+	memcpy(begin, DPI_RULE_EXPORT_MAGIC, 3);
+	begin[3] = DPI_RULE_EXPORT_VERSION;
+	DPIExportRecord(&buf, DPI_RULE_RECORD_BEGIN, flags, dpi_export_generation, begin, sizeof(begin));
+
+	// Removed (or changed) rules
+	if (previous != NULL) {
+		hashmap_iterator_reset(previous);
+		while ((entry = hashmap_iterator_next_entry(previous)) != NULL) {
+			rule = (DPIExportedRule *)hashmap_get(rules, entry->key);
+			if ((rule == NULL) || rule->changed)
+				DPIExportRecord(&buf, DPI_RULE_RECORD_REMOVE, 0, (uint32_t)entry->key, NULL, 0);
+		}
+	}
+
+	// Added (or changed) rules
+	hashmap_iterator_reset(rules);
+	while ((entry = hashmap_iterator_next_entry(rules)) != NULL) {
+		rule = (DPIExportedRule *)entry->data;
+		if ((previous == NULL) || rule->changed) {
+			flags = rule->is_regex ? DPI_RULE_FLAG_REGEX : 0;
+			pos_len = 0;
+			if (rule->offset || rule->depth) {
+				flags |= DPI_RULE_FLAG_POSITION;
+				pos_len = sizeof(DPIRulePosition);
+			}
+			len = strlen(rule->pattern);
+			if (pos_len + len > DPI_EXPORT_BUF_SIZE - sizeof(DPIRuleRecordHdr)) {
+				ErrorMessage("DPI Service: pattern of rule %d is too long to export.\n", entry->key);
+				continue;
+			}
+			position.offset = htons((uint16_t)rule->offset);
+			position.depth = htons((uint16_t)rule->depth);
+			memcpy(payload, &position, pos_len);
+			memcpy(payload + pos_len, rule->pattern, len);
+			DPIExportRecord(&buf, DPI_RULE_RECORD_ADD, flags, (uint32_t)entry->key, payload, (uint16_t)(pos_len + len));
+		}
+	}
+
+	DPIExportRecord(&buf, DPI_RULE_RECORD_COMMIT, 0, dpi_export_generation, NULL, 0);
+	DPIExportFlush(&buf);
+
+	if (buf.failed) {
+		// The DPI Service state is unknown: reconnect and send all the rules next time
+		ErrorMessage("DPI Service: rule export failed (%s).\n", strerror(errno));
+		close(dpi_export_sock);
+		dpi_export_sock = -1;
+		return 0;
+	}
+
+	return 1;
+}
+
+static inline void ProcessPortRuleMap(PORT_RULE_MAP *portRuleMap, HashMap *rules, SnortConfig *sc) {
+	ProcessPortGroups(portRuleMap->prmSrcPort, rules, sc);
+	ProcessPortGroups(portRuleMap->prmDstPort, rules, sc);
 #ifdef TARGET_BASED
-	ProcessPortGroups(portRuleMap->prmNoServiceSrcPort, acsmMap, ruleList, sc);
-	ProcessPortGroups(portRuleMap->prmNoServiceDstPort, acsmMap, ruleList, sc);
+	ProcessPortGroups(portRuleMap->prmNoServiceSrcPort, rules, sc);
+	ProcessPortGroups(portRuleMap->prmNoServiceDstPort, rules, sc);
 #endif
-	ProcessPortGroup(portRuleMap->prmGeneric, acsmMap, ruleList, sc);
+	ProcessPortGroup(portRuleMap->prmGeneric, rules, sc);
 }
 
-static inline void ProcessPortGroups(PORT_GROUP **portGroups, SFGHASH *acsmMap, cJSON *ruleList, SnortConfig *sc) {
+static inline void ProcessPortGroups(PORT_GROUP **portGroups, HashMap *rules, SnortConfig *sc) {
 	int i;
 	for(i=0;i<MAX_PORTS;i++) {
-		ProcessPortGroup(portGroups[i], acsmMap, ruleList, sc);
+		ProcessPortGroup(portGroups[i], rules, sc);
 	}
 }
 
-static void ProcessPortGroup(PORT_GROUP *portGroup, SFGHASH *acsmMap, cJSON *ruleList, SnortConfig *sc) {
+/* returns: 1 if the rule searches for the content in the packet data (rather than in a buffer set by an earlier option); 0 otherwise. */
+static int DPIContentInPacketData(OptTreeNode *otn, PatternMatchData *pmd) {
+	OptFpList *fpl;
+	int in_data = 1;
+
+	for (fpl = otn->opt_func; fpl != NULL; fpl = fpl->next) {
+		switch (fpl->type) {
+			case RULE_OPTION_TYPE_CONTENT:
+				if (fpl->context == pmd)
+					return in_data;
+				break;
+			case RULE_OPTION_TYPE_FILE_DATA:
+			case RULE_OPTION_TYPE_BASE64_DATA:
+			case RULE_OPTION_TYPE_PREPROCESSOR:
+				in_data = 0;
+				break;
+			case RULE_OPTION_TYPE_PKT_DATA:
+				in_data = 1;
+				break;
+			default:
+				break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The function finds where the rules of an AC state look for the exported pattern (a report of the
+ * state's rule ID makes Snort evaluate all of them), so the DPI Service can drop the reports none
+ * of them would accept: the pattern starts at offset or later, and ends within depth bytes of it.
+ * Both are left 0 (anywhere) if one of the rules has a relative or variable fast pattern, a
+ * negated one, one in another buffer, or another pattern (e.g. a shorter one ending in the state).
+ */
+static void DPIPatternPosition(ACSM_PATTERN2 *mlist, int *offset, int *depth) {
+	PatternMatchData *first, *pmd;
+	OptTreeNode *otn;
+	int start, end;
+
+	*offset = 0;
+	*depth = 0;
+	first = (PatternMatchData *)((PMX *)mlist->udata)->PatternMatchData;
+	start = INT_MAX;
+	end = 0;
+
+	for (; mlist != NULL; mlist = mlist->next) {
+		pmd = (PatternMatchData *)((PMX *)mlist->udata)->PatternMatchData;
+		otn = (OptTreeNode *)((RULE_NODE *)((PMX *)mlist->udata)->RuleNode)->rnRuleData;
+
+		if (mlist->negative || pmd->exception_flag || pmd->use_doe ||
+				(pmd->distance != 0) || (pmd->within != PMD_WITHIN_UNDEFINED) ||
+				(pmd->offset_var >= 0) || (pmd->depth_var >= 0) ||
+				(pmd->offset < 0) || (pmd->depth < 0) || (pmd->offset + pmd->depth > UINT16_MAX) ||
+				(pmd->pattern_size != first->pattern_size) ||
+				(memcmp(pmd->pattern_buf, first->pattern_buf, pmd->pattern_size) != 0) ||
+				!DPIContentInPacketData(otn, pmd))
+			return;
+
+		if (pmd->offset < start)
+			start = pmd->offset;
+		if (pmd->depth == 0)
+			end = -1;
+		else if ((end >= 0) && (pmd->offset + pmd->depth > end))
+			end = pmd->offset + pmd->depth;
+	}
+
+	*offset = start;
+	*depth = (end < 0) ? 0 : end - start;
+}
+
+/* The function widens the position of a rule to cover another one (anywhere if either is anywhere). */
+static void DPIPatternPositionMerge(DPIExportedRule *rule, int offset, int depth) {
+	int start, end;
+
+	if ((rule->offset == 0 && rule->depth == 0) || (offset == 0 && depth == 0)) {
+		rule->offset = 0;
+		rule->depth = 0;
+		return;
+	}
+
+	start = (offset < rule->offset) ? offset : rule->offset;
+	if (rule->depth == 0 || depth == 0) {
+		end = -1;
+	} else {
+		end = rule->offset + rule->depth;
+		if (offset + depth > end)
+			end = offset + depth;
+	}
+
+	rule->offset = start;
+	rule->depth = (end < 0) ? 0 : end - start;
+}
+
+static void ProcessPortGroup(PORT_GROUP *portGroup, HashMap *rules, SnortConfig *sc) {
 	if (portGroup == NULL || portGroup->pgPms == NULL || portGroup->pgPms[PM_TYPE__CONTENT] == NULL)
 		return;
 
 	MPSE *mpse = (MPSE*)portGroup->pgPms[PM_TYPE__CONTENT];
 	ACSM_STRUCT2 * acsm = (ACSM_STRUCT2*) mpse->obj;
 	ACSM_PATTERN2 **MatchList = acsm->acsmMatchList;
-	SFGHASH *acsmExist = (SFGHASH *)sfghash_find(snort_conf->dpi_acsm_map, acsm);
-	if (acsmExist) {
+	if (mpse->dpi_rids) {
 		// Multiple ports can use the same PORT_GROUP. We need to process each PORT_GROUP once.
 		return;
 	}
@@ -5429,21 +5814,12 @@ static void ProcessPortGroup(PORT_GROUP *portGroup, SFGHASH *acsmMap, cJSON *rul
 	ACSM_PATTERN2 *mlist;
     RULE_NODE *rnNode = NULL;
     OptTreeNode *otn = NULL;
-	cJSON *matchRule;
-
-	HashMap *ruleMlistMap = CreateRuleToMlistMap();
-
-	// Create JSON initialize.
+	DPIExportedRule *rule;
+	char *pattern;
+	int offset, depth;
 
-	/*
-	 *  The Rule Pattern Match JSON structure for DPI Service - DPI Controller interface.
-	 *	{
-	 *		className: 'MatchRule',
-	 *		pattern: some exact-string or regular-expression string,
-	 *		is_regex: true if pattern is a regular-expression or false otherwise,
-	 *		rid: rule identification number
-	 *	}
-	 */
+	// The dispatch table of the match reports (Rule ID => mlist), used when processing packet content match.
+	mpseDpiRidsInit(mpse);
 
 	/* Go over the AC states and collect all the information from the accepting states. */
 	for (state = 0; state < (acstate_t)acsm->acsmNumStates; state++) {
@@ -5463,102 +5839,62 @@ static void ProcessPortGroup(PORT_GROUP *portGroup, SFGHASH *acsmMap, cJSON *rul
 		     */
 
 			// Add Rule ID => mlist map to be used when processing packet content match.
-			bool added = RuleAdd(ruleMlistMap, otn->sigInfo.id, mlist);
-			if (added) {
-				matchRule=cJSON_CreateObject();
-				cJSON_AddStringToObject(matchRule, CLASS_NAME, CLASS_NAME_VALUE);
-
-				char *pattern = (char *)hashmapptr_get(sc->dpi_pmd_pattern_map, &pmd);
-				cJSON_AddItemToObject(matchRule, PATTERN, cJSON_CreateString(pattern));
-				cJSON_AddBoolToObject(matchRule, IS_REGEX, false);
-				cJSON_AddNumberToObject(matchRule, RULE_ID, otn->sigInfo.id);
-				cJSON_AddItemToArray(ruleList, matchRule);
+			mpseDpiRidAdd(mpse, otn->sigInfo.id, otn->sigInfo.priority, mlist);
+
+			// A rule may be in several port groups, but it is registered to the DPI Service once, with
+			// a position that covers the rules of its state in all of them.
+			DPIPatternPosition(mlist, &offset, &depth);
+			rule = (DPIExportedRule *)hashmap_get(rules, otn->sigInfo.id);
+			if (rule != NULL) {
+				DPIPatternPositionMerge(rule, offset, depth);
+				continue;
 			}
+
+			pattern = (char *)hashmapptr_get(sc->dpi_pmd_pattern_map, &pmd);
+			if (pattern == NULL)
+				continue;
+
+			// The pattern still belongs to the config (see DPIExportedRulesDiff)
+			rule = (DPIExportedRule *)SnortAlloc(sizeof(DPIExportedRule));
+			rule->pattern = pattern;
+			rule->is_regex = 0;
+			rule->offset = offset;
+			rule->depth = depth;
+			hashmap_put(rules, otn->sigInfo.id, rule);
 		}
 	}
-
-	AcsmAdd(acsmMap, acsm, ruleMlistMap);
-}
-
-static inline void RegisterContentRulesToDPIController(SnortConfig *sc) {
-	if (!sc->dpi_service_active)
-		return;
-
-	sc->dpi_acsm_map = CreateAcsmListMap();
-
-	cJSON *root, *ruleList;
-
-	/* Initialize JSON message to controller objects. */
-	root=cJSON_CreateObject();
-	cJSON_AddStringToObject(root, SNORT_ID, "master_snort");
-	ruleList=cJSON_CreateArray();
-	cJSON_AddItemToObject(root, RULE_LIST, ruleList);
-
-	ProcessPortRuleMap(sc->prmIpRTNX, sc->dpi_acsm_map, ruleList, sc);
-	ProcessPortRuleMap(sc->prmTcpRTNX, sc->dpi_acsm_map, ruleList, sc);
-	ProcessPortRuleMap(sc->prmUdpRTNX, sc->dpi_acsm_map, ruleList, sc);
-	ProcessPortRuleMap(sc->prmIcmpRTNX, sc->dpi_acsm_map, ruleList, sc);
-
-	ExportSnortRules(sc, root);
 }
 
-static inline SFGHASH * CreateAcsmListMap(void) {
-    return sfghash_new(20, sizeof(ACSM_STRUCT2 *), 1, AcsmListMapFree);
-}
-
-/**
- * The function frees the user data (the data of each entry is the RuleToMlistMap)
- * of the AcsmListMap which is also a hashmap of type SFGHASH *.
- */
-static inline void AcsmListMapFree(HashMap *ruleToMlist) {
-	hashmap_destroy(ruleToMlist);
-}
-
-static inline HashMap * CreateRuleToMlistMap(void) {
-    return hashmap_create();
-}
-
-/**
- * The function adds a rule to the DPI Rule to mlist Map (entry Key: Rule ID => Value: mlist).
- * returns: true if the rule was added to the map; otherwise false.
+/*
+ * The function builds the DPI Service dispatch tables of the config and registers its content
+ * rules to the DPI Controller. The dispatch tables point into the config's automata, so they are
+ * built for every config; the rules are compared to those of the previous config, and exported only
+ * if they changed (a socket export sends just the changes).
  */
-static inline bool RuleAdd(HashMap *ruleMlistMap, rule_id_t rid, ACSM_PATTERN2 *mlist) {
-	if (ruleMlistMap == NULL)
-		return false;
-
-	ACSM_PATTERN2 *ruleExist = (ACSM_PATTERN2 *)hashmap_get(ruleMlistMap, rid);
-	if (ruleExist) {
-		return false;
-	}
+static void RegisterContentRulesToDPIController(SnortConfig *sc) {
+	HashMap *rules;
+	int added, removed;
 
-	hashmap_put(ruleMlistMap, rid, mlist);
-
-	return true;
-}
-
-static inline void AcsmAdd(SFGHASH *matchListMap, ACSM_STRUCT2 *acsm, HashMap *ruleMlistMap) {
-	if (matchListMap == NULL)
+	if (!sc->dpi_service_active)
 		return;
 
-	int status;
-
-	status = sfghash_add(matchListMap, acsm, ruleMlistMap);
-	switch (status)
-	{
-	case SFGHASH_OK:
-		/* entry was inserted successfully */
-		break;
-	case SFGHASH_INTABLE:
-		ParseError("Duplicate ACSM with same key.\n");
-		break;
-	case SFGHASH_NOMEM:
-		FatalError("Failed to allocate memory for the ACSM.\n");
-		break;
-	default:
-		FatalError("%s(%d): AcsmAdd() - unexpected return value "
-				"from sfghash_add().\n", __FILE__, __LINE__);
-		break;
+	rules = hashmap_create();
+	ProcessPortRuleMap(sc->prmIpRTNX, rules, sc);
+	ProcessPortRuleMap(sc->prmTcpRTNX, rules, sc);
+	ProcessPortRuleMap(sc->prmUdpRTNX, rules, sc);
+	ProcessPortRuleMap(sc->prmIcmpRTNX, rules, sc);
+
+	added = DPIExportedRulesDiff(rules, dpi_registered_rules, &removed);
+	if ((dpi_registered_rules != NULL) && (added == 0) && (removed == 0) && !dpi_export_pending) {
+		LogMessage("DPI Service: content rules unchanged (%d rules), not exported.\n", hashmap_size(rules));
+	} else {
+		dpi_export_pending = !ExportSnortRules(sc, rules);
+		LogMessage("DPI Service: registered %d content rules (%d added, %d removed)%s.\n",
+				hashmap_size(rules), added, removed, dpi_export_pending ? ", export failed" : "");
 	}
+
+	DPIExportedRulesFree(dpi_registered_rules);
+	dpi_registered_rules = rules;
 }
 
 /* The function free memory allocated for the DPI Service processing. */
@@ -5572,8 +5908,8 @@ static void DPIServiceFree(SnortConfig *sc) {
 	if (sc->dpi_rule_export_dir != NULL)
 		free(sc->dpi_rule_export_dir);
 
-	if (sc->dpi_acsm_map != NULL)
-		sfghash_delete(sc->dpi_acsm_map);
+	if (sc->dpi_rule_export_socket != NULL)
+		free(sc->dpi_rule_export_socket);
 
 	if (sc->dpi_pmd_pattern_map != NULL)
 		hashmapptr_destroy(sc->dpi_pmd_pattern_map);
@@ -6171,6 +6507,8 @@ static SnortConfig * ReloadConfig(void)
 
     fpCreateFastPacketDetection(sc);
 
+    RegisterContentRulesToDPIController(sc);
+
 #ifdef PPM_MGR
     PPM_PRINT_CFG(&sc->ppm_cfg);
 #endif
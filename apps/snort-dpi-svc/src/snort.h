@@ -675,9 +675,43 @@ typedef enum {
 	UNKNOWN,	// Not defined.
     FILE_WRITE, // Write the Snort DPI JSON rules to a file.
 	REST_CALL,  // Send the Snort DPI JSON rules to the controller.
-	CONSOLE		// Print the Snort DPI JSON to the console.
+	CONSOLE,	// Print the Snort DPI JSON to the console.
+	SOCKET		// Stream the changes to the rules to the DPI Service over a socket, in binary records.
 } DPI_EXPORT_MODE;
 
+/* DPI Service binary rule export (SOCKET mode).
+ * A stream of records: a header followed by len bytes, all integers in network order.
+ * Every export is a transaction: BEGIN, then the REMOVE/ADD records of the rules that changed since
+ * the previous one, then COMMIT. A BEGIN with DPI_RULE_FLAG_RESET (the first export on a connection)
+ * starts from an empty rule set. */
+#define DPI_RULE_RECORD_BEGIN   1 /* rid: generation. Payload: DPI_RULE_EXPORT_MAGIC, DPI_RULE_EXPORT_VERSION */
+#define DPI_RULE_RECORD_ADD     2 /* rid: rule ID. Payload: [DPIRulePosition,] the pattern */
+#define DPI_RULE_RECORD_REMOVE  3 /* rid: rule ID */
+#define DPI_RULE_RECORD_COMMIT  4 /* rid: generation */
+
+#define DPI_RULE_FLAG_RESET     0x01 /* BEGIN */
+#define DPI_RULE_FLAG_REGEX     0x02 /* ADD */
+#define DPI_RULE_FLAG_POSITION  0x04 /* ADD: the payload starts with a DPIRulePosition */
+
+#define DPI_RULE_EXPORT_MAGIC   "MRX"
+#define DPI_RULE_EXPORT_VERSION 2
+
+typedef struct _DPIRuleRecordHdr
+{
+    uint8_t type;
+    uint8_t flags;
+    uint16_t len;
+    uint32_t rid;
+} DPIRuleRecordHdr;
+
+/* Where Snort looks for the pattern of a rule in the packet data: it starts at offset or later and
+ * ends within depth bytes of offset (depth 0: anywhere after offset). */
+typedef struct _DPIRulePosition
+{
+    uint16_t offset;
+    uint16_t depth;
+} DPIRulePosition;
+
 typedef struct _SnortConfig
 {
     RunMode run_mode;
@@ -986,7 +1020,9 @@ typedef struct _SnortConfig
     char *dpi_controller_ip;
     int dpi_controller_port;
     char *dpi_rule_export_dir;
-    SFGHASH *dpi_acsm_map; // Map from ACSM to a map of rule ID => mlist (MatchList => Map (Rule ID => mlist)).
+    char *dpi_rule_export_socket; // Unix socket path (SOCKET mode; the controller IP and port are used if not set)
+    bool dpi_local_automata_eager; // Build the local content automata at startup, not on first use
+    int dpi_local_fallback; // Packets per second searched locally when the DPI Service did not scan them (-1: no limit)
     HashMapPtr *dpi_pmd_pattern_map; // Map from PatternMatchData to a pattern evaluated by the key (PatternMatchData => pattern).
 
 } SnortConfig;
@@ -1079,6 +1115,12 @@ typedef struct _PacketCount
     uint64_t queued_segs;     /* number of tcp segments stored for rebuilt pkts */
     uint64_t str_mem_faults;  /* number of times the stream memory cap was hit */
 
+    uint64_t dpi_reports;         /* packets with DPI Service match reports */
+    uint64_t dpi_clean;           /* packets scanned by the DPI Service, without matches */
+    uint64_t dpi_fallback;        /* packets not scanned by the DPI Service, searched locally */
+    uint64_t dpi_fallback_limited; /* packets not scanned by the DPI Service, over the local search rate */
+    uint64_t dpi_nsh_fast_path;   /* DPI Service packets decoded from their NSH header on */
+
 #ifdef TARGET_BASED
     uint64_t attribute_table_reloads; /* number of times attribute table was reloaded. */
 #endif
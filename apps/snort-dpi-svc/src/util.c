@@ -1273,6 +1273,20 @@ void DropStats(int exiting)
         if ( pc.internal_whitelist > 0 )
             LogStat("Int Whtlst", pc.internal_whitelist, pkts_recv);
     }
+    if (snort_conf->dpi_service_active)
+    {
+        uint64_t dpi_total = pc.dpi_reports + pc.dpi_clean
+                           + pc.dpi_fallback + pc.dpi_fallback_limited;
+
+        LogMessage("%s\n", STATS_SEPARATOR);
+        LogMessage("DPI Service (packets with content):\n");
+
+        LogStat("Reports", pc.dpi_reports, dpi_total);
+        LogStat("Clean", pc.dpi_clean, dpi_total);
+        LogStat("Fallback", pc.dpi_fallback, dpi_total);
+        LogStat("Skipped", pc.dpi_fallback_limited, dpi_total);
+        LogCount("Fast Path", pc.dpi_nsh_fast_path);
+    }
 #ifdef TARGET_BASED
     if (ScIdsMode() && IsAdaptiveConfigured())
     {
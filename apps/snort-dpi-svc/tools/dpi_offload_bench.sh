@@ -0,0 +1,134 @@
+#!/bin/bash
+##
+## DPI Service offload benchmark.
+##
+## Runs Snort twice over the same traffic: once searching the packet contents itself, and once
+## with the match reports of the DPI Service (the traffic the DPI Service sends to Snort is made
+## offline, with its 'outfile' parameter). Then compares the content search time of the two runs
+## (the "mpse" row of the preprocessor profile, which does not include rule evaluation in either
+## mode) and their alerts.
+##
+## Snort must be built with --enable-perfprofiling. The rules file is the DPI Service rules file
+## exported by (and converted from) the same Snort configuration, so the rule IDs match.
+##
+## Usage: dpi_offload_bench.sh -p <pcap> -r <rules> -c <snort.conf> [options]
+##   -p <pcap>       Traffic to replay
+##   -r <rules>      DPI Service rules file
+##   -c <conf>       Snort configuration (any 'config dpi_service' in it is replaced)
+##   -s <snort>      Snort binary (default: snort)
+##   -d <service>    DPI Service binary (default: services/dpi/dpi-fp/src/build/main in this tree)
+##   -o <dir>        Output directory (default: ./dpi_offload_bench)
+##   -f <pps>        dpi_local_fallback of the DPI run (default: unlimited)
+##
+
+usage()
+{
+    sed -n 's/^## \{0,1\}//p' "$0" | sed -n '/^Usage:/,$p'
+    exit 1
+}
+
+fail()
+{
+    echo "ERROR: $*" >&2
+    exit 1
+}
+
+script_dir=$(cd "$(dirname "$0")" && pwd)
+snort=snort
+service="$script_dir/../../../services/dpi/dpi-fp/src/build/main"
+out=./dpi_offload_bench
+fallback=unlimited
+
+while getopts "p:r:c:s:d:o:f:h" opt; do
+    case $opt in
+        p) pcap=$OPTARG ;;
+        r) rules=$OPTARG ;;
+        c) conf=$OPTARG ;;
+        s) snort=$OPTARG ;;
+        d) service=$OPTARG ;;
+        o) out=$OPTARG ;;
+        f) fallback=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+[[ -n "$pcap" && -n "$rules" && -n "$conf" ]] || usage
+[[ -r "$pcap" ]] || fail "Cannot read $pcap"
+[[ -r "$rules" ]] || fail "Cannot read $rules"
+[[ -r "$conf" ]] || fail "Cannot read $conf"
+[[ -x "$service" ]] || fail "DPI Service binary not found: $service (use -d)"
+
+mkdir -p "$out/local" "$out/dpi/rules" || fail "Cannot create $out"
+out=$(cd "$out" && pwd)
+pcap=$(cd "$(dirname "$pcap")" && pwd)/$(basename "$pcap")
+rules=$(cd "$(dirname "$rules")" && pwd)/$(basename "$rules")
+
+# The variants go next to the configuration, so its relative includes still work
+conf_dir=$(dirname "$conf")
+local_conf=$(mktemp "$conf_dir/.dpi_bench_local.XXXXXX") || fail "Cannot write to $conf_dir"
+dpi_conf=$(mktemp "$conf_dir/.dpi_bench_dpi.XXXXXX") || fail "Cannot write to $conf_dir"
+trap 'rm -f "$local_conf" "$dpi_conf"' EXIT
+
+# Prints the configuration without its dpi_service and profile_preprocs statements (and their
+# continuation lines), then the profiling and alert output of a run
+make_conf()
+{
+    local dir=$1
+
+    awk '
+        skip { skip = /\\[[:space:]]*$/; next }
+        /^[[:space:]]*config[[:space:]]+(dpi_service|profile_preprocs)[[:space:]]*:/ { skip = /\\[[:space:]]*$/; next }
+        { print }' "$conf"
+    echo
+    echo "config profile_preprocs: print all, sort total_ticks, filename $dir/preprocs.txt append"
+    echo "output alert_csv: $dir/alerts.csv timestamp,sig_generator,sig_id"
+}
+
+make_conf "$out/local" > "$local_conf"
+make_conf "$out/dpi" > "$dpi_conf"
+echo "config dpi_service: dpi_rule_export_mode file, dpi_rule_export_dir $out/dpi/rules/, dpi_local_fallback $fallback" >> "$dpi_conf"
+rm -f "$out"/local/{preprocs.txt,alerts.csv} "$out"/dpi/{preprocs.txt,alerts.csv}
+
+echo "Making the DPI Service traffic..."
+"$service" infile="$pcap" outfile="$out/nsh.pcap" rules="$rules" markclean > "$out/dpi-service.log" 2>&1 ||
+    fail "DPI Service failed, see $out/dpi-service.log"
+
+echo "Running Snort (local search)..."
+"$snort" -k none -c "$local_conf" -r "$pcap" -l "$out/local" > "$out/local/snort.log" 2>&1 ||
+    fail "Snort failed, see $out/local/snort.log"
+
+echo "Running Snort (DPI Service)..."
+"$snort" -k none -c "$dpi_conf" -r "$out/nsh.pcap" -l "$out/dpi" > "$out/dpi/snort.log" 2>&1 ||
+    fail "Snort failed, see $out/dpi/snort.log"
+
+# checks, microseconds and average microseconds per check of the content search
+mpse_stats()
+{
+    awk '$2 == "mpse" { print $4, $6, $7; exit }' "$1/preprocs.txt" 2>/dev/null
+}
+
+alerts()
+{
+    sort -u "$1/alerts.csv" 2>/dev/null
+}
+
+read local_checks local_usecs local_avg <<< "$(mpse_stats "$out/local")"
+read dpi_checks dpi_usecs dpi_avg <<< "$(mpse_stats "$out/dpi")"
+[[ -n "$local_checks" && -n "$dpi_checks" ]] ||
+    fail "No mpse profile in $out/*/preprocs.txt (is Snort built with --enable-perfprofiling?)"
+
+alerts "$out/local" > "$out/local/alerts.sorted"
+alerts "$out/dpi" > "$out/dpi/alerts.sorted"
+comm -23 "$out/local/alerts.sorted" "$out/dpi/alerts.sorted" > "$out/alerts_local_only.csv"
+comm -13 "$out/local/alerts.sorted" "$out/dpi/alerts.sorted" > "$out/alerts_dpi_only.csv"
+
+echo
+printf "%-16s %12s %14s %12s %10s\n" "" "Searches" "Microsecs" "Avg/Search" "Alerts"
+printf "%-16s %12s %14s %12s %10s\n" "Local search" "$local_checks" "$local_usecs" "$local_avg" \
+    "$(wc -l < "$out/local/alerts.sorted")"
+printf "%-16s %12s %14s %12s %10s\n" "DPI Service" "$dpi_checks" "$dpi_usecs" "$dpi_avg" \
+    "$(wc -l < "$out/dpi/alerts.sorted")"
+echo
+echo "Alerts only in the local run: $(wc -l < "$out/alerts_local_only.csv") ($out/alerts_local_only.csv)"
+echo "Alerts only in the DPI run:   $(wc -l < "$out/alerts_dpi_only.csv") ($out/alerts_dpi_only.csv)"
+echo "Full statistics: $out/local/snort.log, $out/dpi/snort.log"
@@ -7,6 +7,11 @@
 #define NSH_NEXT_PROTOCOL_IPv6 2
 #define NSH_NEXT_PROTOCOL_ETHERNET 3
 
+// Variable length metadata TLV carrying DPI match reports. The type selects the rule ID width.
+#define NSH_MD_CLASS_DPI 3
+#define NSH_MD_TYPE_MATCH_REPORTS 1 // MatchReport/MatchReportRange (uint16 rule IDs)
+#define NSH_MD_TYPE_MATCH_REPORTS_RID32 2 // MatchReport32/MatchReportRange32 (uint32 rule IDs)
+
 #define IP_HEADER_SIZE 20
 #define UDP_HEADER_SIZE 8
 
@@ -0,0 +1,35 @@
+#ifndef COMMON_NSH_MATCHREPORT_H_
+#define COMMON_NSH_MATCHREPORT_H_
+
+#include <stdint.h>
+
+/* DPI service match reports, as carried in the NSH variable length metadata. Values are in network order.
+ * The metadata type tells the rule ID width (NSH_MD_TYPE_MATCH_REPORTS/NSH_MD_TYPE_MATCH_REPORTS_RID32). */
+
+typedef struct {
+	uint16_t rid;
+	uint8_t is_range;
+	uint16_t position : 15;
+} MatchReport;
+
+typedef struct {
+	uint32_t rid;
+	uint8_t is_range;
+	uint16_t position : 15;
+} MatchReport32;
+
+typedef struct {
+	uint16_t rid;
+	uint8_t  is_range;
+	uint16_t position : 15;
+	uint16_t length;
+} MatchReportRange;
+
+typedef struct {
+	uint32_t rid;
+	uint8_t  is_range;
+	uint16_t position : 15;
+	uint16_t length;
+} MatchReportRange32;
+
+#endif /* COMMON_NSH_MATCHREPORT_H_ */
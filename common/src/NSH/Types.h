@@ -1,6 +1,8 @@
 #ifndef COMMON_NSH_TYPES_H_
 #define COMMON_NSH_TYPES_H_
 
+#include <stdint.h>
+
 #pragma pack(push)  /* push current alignment to stack */
 #pragma pack(1)     /* set alignment to 1 byte boundary */
 
@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Capture.h"
+
+void capture_open(Capture *capture, char *in_if, char *out_if, char *in_file, char *out_file, int read_timeout) {
+	pcap_t *hpcap[2];
+	char errbuf[PCAP_ERRBUF_SIZE];
+	char *device_in = NULL, *device_out = NULL;
+	pcap_if_t *devices, *next_device;
+	int res;
+	struct bpf_program bpf;
+	int linktype[2], i;
+	char *mode;
+
+	hpcap[1] = NULL;
+	memset(errbuf, 0, PCAP_ERRBUF_SIZE);
+
+	if (in_if || out_if) {
+		// Find available interfaces
+		if (pcap_findalldevs(&devices, errbuf)) {
+			fprintf(stderr, "[Sniffer] ERROR: Cannot find network interface (pcap_findalldevs error: %s)\n", errbuf);
+			exit(1);
+		}
+
+		// Find requested interface
+		next_device = devices;
+		while (next_device) {
+			printf("[Sniffer] Found network interface: %s\n", next_device->name);
+			if (in_if && (strcmp(in_if, next_device->name) == 0)) {
+				device_in = in_if;
+			}
+			if (out_if && (strcmp(out_if, next_device->name) == 0)) {
+				device_out = out_if;
+			}
+			next_device = next_device->next;
+		}
+		pcap_freealldevs(devices);
+		if (in_if && (strcmp(in_if, CAPTURE_ANY) == 0)) {
+			device_in = CAPTURE_ANY;
+		}
+
+		if (in_if && !device_in) {
+			fprintf(stderr, "[Sniffer] ERROR: Cannot find input network interface\n");
+			exit(1);
+		}
+		if (out_if && !device_out) {
+			fprintf(stderr, "[Sniffer] ERROR: Cannot find output network interface\n");
+			exit(1);
+		}
+	}
+
+	if (in_if) {
+		printf("[Sniffer] Sniffer is capturing from device: %s\n", device_in);
+	} else {
+		printf("[Sniffer] Sniffer is reading packets from file: %s\n", in_file);
+	}
+	if (out_if) {
+		printf("[Sniffer] Packets are sent on device: %s\n", device_out);
+	} else {
+		printf("[Sniffer] Packets written to file: %s\n", out_file);
+	}
+
+	if (in_if) {
+		hpcap[0] = pcap_create(device_in, errbuf);
+	} else {
+		hpcap[0] = pcap_open_offline(in_file, errbuf);
+	}
+	if (out_if) {
+		hpcap[1] = pcap_create(device_out, errbuf);
+	}
+
+	// (an output file is opened after the loop, once the input link type is known)
+	for (i = 0; i < (out_if ? 2 : 1); i++) {
+		mode = (i == 0) ? "input" : "output";
+		// Check pcap handle
+		if (!hpcap[i]) {
+			fprintf(stderr, "[Sniffer] ERROR: Cannot create %s pcap handle (pcap_create/pcap_open_offline error: %s)\n", mode ,errbuf);
+			exit(1);
+		}
+
+		if (in_if && i == 0) {
+			// Set promiscuous mode
+			pcap_set_promisc(hpcap[0], 1);
+			if (read_timeout > 0) {
+				pcap_set_timeout(hpcap[0], read_timeout);
+			}
+		}
+
+		// Activate PCAP
+		if ((in_if && i == 0) || (out_if && i == 1)) {
+			res = pcap_activate(hpcap[i]);
+			switch (res) {
+			case 0:
+				// Success
+				break;
+			case PCAP_WARNING_PROMISC_NOTSUP:
+				fprintf(stderr, "[Sniffer] WARNING: Promiscuous mode is not supported\n");
+				exit(1);
+				break;
+			case PCAP_WARNING:
+				fprintf(stderr, "[Sniffer] WARNING: Unknown (%s)\n", pcap_geterr(hpcap[i]));
+				exit(1);
+				break;
+			case PCAP_ERROR_NO_SUCH_DEVICE:
+				fprintf(stderr, "[Sniffer] ERROR: Device not found\n");
+				exit(1);
+				break;
+			case PCAP_ERROR_PERM_DENIED:
+				fprintf(stderr, "[Sniffer] ERROR: Permission denied\n");
+				exit(1);
+				break;
+			case PCAP_ERROR_PROMISC_PERM_DENIED:
+				fprintf(stderr, "[Sniffer] ERROR: Permission denied for promiscuous mode\n");
+				exit(1);
+				break;
+			case PCAP_ERROR_RFMON_NOTSUP:
+				fprintf(stderr, "[Sniffer] ERROR: Monitor mode is not supported\n");
+				exit(1);
+				break;
+			case PCAP_ERROR_IFACE_NOT_UP:
+				fprintf(stderr, "[Sniffer] ERROR: Interface %s is not available\n", (i == 0) ? device_in : device_out);
+				exit(1);
+				break;
+			default:
+				fprintf(stderr, "[Sniffer] ERROR: Unknown (%s)\n", pcap_geterr(hpcap[i]));
+				exit(1);
+				break;
+			}
+		}
+
+		if (i == 0) {
+			if (in_if) {
+				// Set capture direction (ingress only)
+				res = pcap_setdirection(hpcap[0], PCAP_D_IN);
+				if (res) {
+					fprintf(stderr, "[Sniffer] ERROR: Cannot set capture direction (pcap_setdirection error: %s, return value: %d)\n", pcap_geterr(hpcap[0]), res);
+					exit(1);
+				}
+			}
+			// Compile PCAP filter (IP packets)
+			res = pcap_compile(hpcap[0], &bpf, CAPTURE_FILTER, 0, PCAP_NETMASK_UNKNOWN);
+			if (res) {
+				fprintf(stderr, "[Sniffer] ERROR: Cannot compile packet filter (pcap_compile error: %s)\n", pcap_geterr(hpcap[0]));
+				exit(1);
+			}
+
+			res = pcap_setfilter(hpcap[0], &bpf);
+			if (res) {
+				fprintf(stderr, "[Sniffer] ERROR: Cannot set packet filter (pcap_setfilter error: %s, return value: %d)\n", pcap_geterr(hpcap[0]), res);
+				exit(1);
+			}
+			pcap_freecode(&bpf);
+		}
+
+		// Find data link type
+		if ((linktype[i] = pcap_datalink(hpcap[i])) < 0)
+		{
+			fprintf(stderr, "[Sniffer] Cannot determine data link type (pcap_datalink error: %s)\n", pcap_geterr(hpcap[i]));
+			exit(1);
+		}
+		if (i == 1 && linktype[0] != linktype[1]) {
+			fprintf(stderr, "[Sniffer] Incompatible link types (input=%d, output=%d)\n", linktype[0], linktype[1]);
+			exit(1);
+		}
+	}
+
+	if (packet_link_header_length(linktype[0]) < 0) {
+		fprintf(stderr, "[Sniffer] Unsupported data link type: %d\n", linktype[0]);
+		exit(1);
+	}
+
+	capture->dump = NULL;
+	if (!out_if) {
+		// Packets are written with the link type of the input
+		hpcap[1] = pcap_open_dead(linktype[0], CAPTURE_DUMP_SNAPLEN);
+		if (!hpcap[1]) {
+			fprintf(stderr, "[Sniffer] ERROR: Cannot create output pcap handle (pcap_open_dead failed)\n");
+			exit(1);
+		}
+		capture->dump = pcap_dump_open(hpcap[1], out_file);
+		if (!capture->dump) {
+			fprintf(stderr, "[Sniffer] ERROR: Cannot open output file (pcap_dump_open error: %s)\n", pcap_geterr(hpcap[1]));
+			exit(1);
+		}
+	}
+
+	capture->in = hpcap[0];
+	capture->out = hpcap[1];
+	capture->linktype = linktype[0];
+	capture->offline = (in_if == NULL);
+}
+
+typedef struct {
+	InPacket **packets;
+	int count;
+} CaptureBatch;
+
+static void collect_packet(unsigned char *arg, const struct pcap_pkthdr *pkthdr, const unsigned char *packetptr) {
+	CaptureBatch *batch = (CaptureBatch*)arg;
+
+	batch->packets[batch->count++] = copy_captured_packet(pkthdr, packetptr);
+}
+
+int capture_loop(Capture *capture, int batch_size, CaptureHandler handler, void *arg) {
+	CaptureBatch batch;
+	int res;
+
+	batch.packets = (InPacket**)malloc(sizeof(InPacket*) * batch_size);
+	if (!batch.packets) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
+
+	do {
+		batch.count = 0;
+		res = pcap_dispatch(capture->in, batch_size, collect_packet, (unsigned char *)&batch);
+		if (batch.count > 0) {
+			// Parse the whole batch before the handler hands it to the scanning threads
+			packet_parse_batch(batch.packets, batch.count, capture->linktype);
+			handler(batch.packets, batch.count, arg);
+		}
+	} while (res > 0 || (res == 0 && !capture->offline));
+
+	free(batch.packets);
+	return res;
+}
+
+int capture_send(Capture *capture, const struct pcap_pkthdr *pkthdr, const unsigned char *data, int len) {
+	struct pcap_pkthdr hdr;
+	FILE *f;
+
+	if (!capture->dump) {
+		return pcap_sendpacket(capture->out, data, len);
+	}
+
+	hdr.ts = pkthdr->ts;
+	hdr.caplen = len;
+	// (a packet forwarded as is keeps its original length)
+	hdr.len = (len == (int)pkthdr->caplen) ? pkthdr->len : (unsigned int)len;
+
+	// The header and the data are written separately: keep the packets of concurrent callers apart
+	f = pcap_dump_file(capture->dump);
+	flockfile(f);
+	pcap_dump((unsigned char *)capture->dump, &hdr, data);
+	funlockfile(f);
+	return 0;
+}
+
+void capture_close(Capture *capture) {
+	if (capture->dump) {
+		pcap_dump_close(capture->dump);
+		capture->dump = NULL;
+	}
+	if (capture->in) {
+		pcap_close(capture->in);
+	}
+	if (capture->out) {
+		pcap_close(capture->out);
+	}
+	capture->in = NULL;
+	capture->out = NULL;
+}
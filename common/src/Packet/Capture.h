@@ -0,0 +1,46 @@
+#ifndef PACKET_CAPTURE_H_
+#define PACKET_CAPTURE_H_
+
+#include <pcap.h>
+#include "PacketBuffer.h"
+
+#define CAPTURE_ANY "any"
+#define CAPTURE_FILTER "ip or ip6 or vlan" // Tagged frames are checked by the parser
+#define CAPTURE_BATCH_SIZE 64 // Maximal number of packets read and parsed together
+#define CAPTURE_DUMP_SNAPLEN 65535 // Of an output file
+
+typedef struct {
+	pcap_t *in;
+	pcap_t *out;
+	pcap_dumper_t *dump; // Output file (out is then a dead handle)
+	int linktype; // pcap link type (DLT_*) of both handles
+	int offline; // Reading from a file
+} Capture;
+
+// Receives a batch of parsed packets (which it then owns)
+typedef void (*CaptureHandler)(InPacket **packets, int count, void *arg);
+
+/*
+ * Opens the input (an interface, or a pcap file) and the output (an interface, or a pcap file with
+ * the link type of the input) of a middlebox, and installs the IP capture filter on the input.
+ * read_timeout (milliseconds) is set on live captures if positive. Prints the error and exits on failure.
+ */
+void capture_open(Capture *capture, char *in_if, char *out_if, char *in_file, char *out_file, int read_timeout);
+
+/*
+ * Reads packets until the input ends or fails (or pcap_breakloop is called), and passes them to
+ * handler in batches of up to batch_size. A batch is whatever one read of the capture buffer
+ * returns, so batching adds no latency. Returns the last pcap_dispatch result (as pcap_loop does).
+ */
+int capture_loop(Capture *capture, int batch_size, CaptureHandler handler, void *arg);
+
+/*
+ * Sends a packet on the output interface, or writes it to the output file with the timestamp of
+ * pkthdr (the captured packet it was made from). May be called by several threads at once.
+ * Returns 0 on success.
+ */
+int capture_send(Capture *capture, const struct pcap_pkthdr *pkthdr, const unsigned char *data, int len);
+
+void capture_close(Capture *capture);
+
+#endif /* PACKET_CAPTURE_H_ */
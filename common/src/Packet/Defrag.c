@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include "Defrag.h"
+
+#define IPV6_HEADER_SIZE 40
+#define IPV6_FRAG_HEADER_SIZE 8
+
+static inline unsigned int hash_key(in_addr_t ip_src, in_addr_t ip_dst, unsigned int id) {
+	return (ip_src ^ ip_dst ^ (id * 2654435761U)) & (DEFRAG_BUCKETS - 1);
+}
+
+static inline int same_datagram(DefragDatagram *dg, Packet *packet) {
+	return dg->id == packet->frag_id && dg->ip_src == packet->ip_src && dg->ip_dst == packet->ip_dst &&
+			dg->ip_version == packet->ip_version && dg->ip_proto == packet->ip_proto;
+}
+
+// Removes a datagram from the table (its memory is no longer counted)
+static void unlink_datagram(Defrag *defrag, DefragDatagram *dg) {
+	DefragDatagram **pp;
+
+	pp = &(defrag->buckets[hash_key(dg->ip_src, dg->ip_dst, dg->id)]);
+	while (*pp != dg) {
+		pp = &((*pp)->hnext);
+	}
+	*pp = dg->hnext;
+
+	if (dg->prev) {
+		dg->prev->next = dg->next;
+	} else {
+		defrag->head = dg->next;
+	}
+	if (dg->next) {
+		dg->next->prev = dg->prev;
+	} else {
+		defrag->tail = dg->prev;
+	}
+	defrag->mem -= dg->mem;
+}
+
+static DefragDatagram *new_datagram(Defrag *defrag, Packet *packet, unsigned long now) {
+	DefragDatagram *dg;
+	unsigned int h;
+
+	dg = (DefragDatagram*)malloc(sizeof(DefragDatagram));
+	if (!dg) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
+	dg->ip_src = packet->ip_src;
+	dg->ip_dst = packet->ip_dst;
+	dg->id = packet->frag_id;
+	dg->ip_version = packet->ip_version;
+	dg->ip_proto = packet->ip_proto;
+	dg->num_fragments = 0;
+	dg->total_len = 0;
+	dg->expires = now + defrag->timeout;
+	dg->mem = sizeof(DefragDatagram);
+	dg->overlap = 0;
+
+	h = hash_key(dg->ip_src, dg->ip_dst, dg->id);
+	dg->hnext = defrag->buckets[h];
+	defrag->buckets[h] = dg;
+
+	dg->next = NULL;
+	dg->prev = defrag->tail;
+	if (defrag->tail) {
+		defrag->tail->next = dg;
+	} else {
+		defrag->head = dg;
+	}
+	defrag->tail = dg;
+
+	defrag->mem += dg->mem;
+	return dg;
+}
+
+void defrag_init(Defrag *defrag, unsigned long max_mem, unsigned long timeout, int policy) {
+	memset(defrag, 0, sizeof(Defrag));
+	defrag->max_mem = max_mem;
+	defrag->timeout = timeout;
+	defrag->policy = policy;
+}
+
+int defrag_add(Defrag *defrag, InPacket *pkt, unsigned long now, DefragDatagram **complete) {
+	Packet *packet;
+	DefragDatagram *dg;
+	DefragFragment *f;
+	unsigned int captured, len, covered;
+	int i;
+
+	packet = &(pkt->packet);
+	if (!PACKET_IS_FRAGMENT(packet) || !packet->ip_version)
+		return DEFRAG_REJECTED;
+
+	// The whole fragment must be captured, and all but the last carry multiples of 8 bytes
+	captured = pkt->pkthdr.caplen - packet->l3_offset;
+	if (packet->ip_len > captured || packet->ip_len < packet->ip_hdr_len)
+		return DEFRAG_REJECTED;
+	len = packet->ip_len - packet->ip_hdr_len;
+	if ((packet->frag_more && (len == 0 || (len & 7))) || packet->ip_hdr_len + packet->frag_offset + len > DEFRAG_MAX_DATAGRAM)
+		return DEFRAG_REJECTED;
+
+	dg = defrag->buckets[hash_key(packet->ip_src, packet->ip_dst, packet->frag_id)];
+	while (dg && !same_datagram(dg, packet)) {
+		dg = dg->hnext;
+	}
+	if (!dg) {
+		dg = new_datagram(defrag, packet, now);
+	}
+	if (dg->num_fragments == DEFRAG_MAX_FRAGMENTS)
+		return DEFRAG_REJECTED;
+
+	// Find the position (after fragments at the same offset) and check for overlaps
+	i = dg->num_fragments;
+	while (i > 0 && dg->fragments[i - 1].offset > packet->frag_offset) {
+		i--;
+	}
+	if ((i > 0 && dg->fragments[i - 1].offset + dg->fragments[i - 1].len > packet->frag_offset) ||
+			(i < dg->num_fragments && dg->fragments[i].offset < packet->frag_offset + len)) {
+		if (!dg->overlap) {
+			dg->overlap = 1;
+			defrag->overlaps++;
+		}
+	}
+	memmove(&(dg->fragments[i + 1]), &(dg->fragments[i]), (dg->num_fragments - i) * sizeof(DefragFragment));
+	f = &(dg->fragments[i]);
+	f->packet = pkt;
+	f->offset = packet->frag_offset;
+	f->len = len;
+	f->arrival = dg->num_fragments;
+	dg->num_fragments++;
+
+	if (!packet->frag_more && !dg->total_len) {
+		dg->total_len = packet->frag_offset + len;
+	}
+	dg->mem += sizeof(InPacket) + pkt->pkthdr.caplen;
+	defrag->mem += sizeof(InPacket) + pkt->pkthdr.caplen;
+
+	if (!dg->total_len)
+		return DEFRAG_HELD;
+
+	// Complete when the fragments cover the payload without gaps
+	covered = 0;
+	for (i = 0; i < dg->num_fragments && dg->fragments[i].offset <= covered; i++) {
+		if (dg->fragments[i].offset + dg->fragments[i].len > covered) {
+			covered = dg->fragments[i].offset + dg->fragments[i].len;
+		}
+	}
+	if (covered < dg->total_len)
+		return DEFRAG_HELD;
+
+	unlink_datagram(defrag, dg);
+	defrag->reassembled++;
+	*complete = dg;
+	return DEFRAG_COMPLETE;
+}
+
+DefragDatagram *defrag_next_expired(Defrag *defrag, unsigned long now) {
+	DefragDatagram *dg;
+
+	dg = defrag->head;
+	if (!dg)
+		return NULL;
+	if (dg->expires <= now) {
+		defrag->expired++;
+	} else if (defrag->mem > defrag->max_mem) {
+		defrag->evicted++;
+	} else {
+		return NULL;
+	}
+	unlink_datagram(defrag, dg);
+	return dg;
+}
+
+int defrag_reassemble(Defrag *defrag, DefragDatagram *dg, unsigned char *buf) {
+	DefragFragment *f;
+	InPacket *first;
+	unsigned char order[DEFRAG_MAX_FRAGMENTS];
+	unsigned int hdr_len, len;
+	int i;
+
+	// The header of the first fragment (the first received at offset 0)
+	first = dg->fragments[0].packet;
+	hdr_len = first->packet.ip_hdr_len;
+	memcpy(buf, first->pktdata + first->packet.l3_offset, hdr_len);
+
+	// Copy the fragments in arrival order, so with overlaps the last one written wins
+	for (i = 0; i < dg->num_fragments; i++) {
+		order[dg->fragments[i].arrival] = i;
+	}
+	for (i = 0; i < dg->num_fragments; i++) {
+		f = &(dg->fragments[order[(defrag->policy == DEFRAG_POLICY_LAST) ? i : dg->num_fragments - 1 - i]]);
+		if (f->offset >= dg->total_len)
+			continue;
+		len = (f->offset + f->len > dg->total_len) ? dg->total_len - f->offset : f->len;
+		memcpy(buf + hdr_len + f->offset, f->packet->pktdata + f->packet->packet.l3_offset + f->packet->packet.ip_hdr_len, len);
+	}
+
+	// Fix the lengths (the checksum is left as is: the datagram is only scanned)
+	if (dg->ip_version == PACKET_IPV4) {
+		((struct ip*)buf)->ip_len = htons(hdr_len + dg->total_len);
+		((struct ip*)buf)->ip_off = 0;
+	} else {
+		((struct ip6_hdr*)buf)->ip6_plen = htons(hdr_len - IPV6_HEADER_SIZE + dg->total_len);
+		// The header ends with the Fragment header: clear its offset and M flag (an atomic fragment),
+		// so the headers of the reassembled payload are parsed
+		memset(buf + hdr_len - IPV6_FRAG_HEADER_SIZE + 2, 0, 2);
+	}
+	return hdr_len + dg->total_len;
+}
+
+void defrag_free_datagram(DefragDatagram *datagram) {
+	free(datagram);
+}
+
+void defrag_destroy(Defrag *defrag) {
+	DefragDatagram *dg;
+	int i;
+
+	while ((dg = defrag->head)) {
+		unlink_datagram(defrag, dg);
+		for (i = 0; i < dg->num_fragments; i++) {
+			free_buffered_packet(dg->fragments[i].packet);
+		}
+		defrag_free_datagram(dg);
+	}
+}
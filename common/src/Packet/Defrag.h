@@ -0,0 +1,95 @@
+#ifndef PACKET_DEFRAG_H_
+#define PACKET_DEFRAG_H_
+
+#include "PacketBuffer.h"
+
+/*
+ * IPv4/IPv6 fragment reassembly, so a scanner sees the payload of a fragmented datagram in one piece.
+ * The fragments themselves are held (not copied) until the datagram is complete, times out, or is
+ * evicted by the memory cap, and are then handed back to the caller, which still forwards each of them.
+ * A Defrag is not thread safe: it is meant to be owned by one worker (all fragments of a datagram
+ * must be dispatched to the same worker).
+ */
+
+#define DEFRAG_BUCKETS 1024 // Must be a power of 2
+#define DEFRAG_MAX_FRAGMENTS 64 // Per datagram (more fragments are rejected)
+#define DEFRAG_MAX_DATAGRAM 65535 // IP header included
+#define DEFRAG_BUFFER_SIZE (2 * (DEFRAG_MAX_DATAGRAM + 1)) // For defrag_reassemble (the first fragment's header may be longer than the others')
+
+// Overlapping fragments: which copy of the overlapping bytes is reassembled
+#define DEFRAG_POLICY_FIRST 0 // The first received (BSD, Windows)
+#define DEFRAG_POLICY_LAST 1 // The last received
+
+// defrag_add results
+#define DEFRAG_REJECTED -1 // Not held (not a fragment, or bad offsets): the caller keeps the packet
+#define DEFRAG_HELD 0
+#define DEFRAG_COMPLETE 1
+
+typedef struct {
+	InPacket *packet;
+	unsigned short offset; // Of the fragment data in the datagram payload
+	unsigned short len;
+	unsigned char arrival; // Order of arrival
+} DefragFragment;
+
+typedef struct st_defrag_datagram {
+	// Key
+	in_addr_t ip_src;
+	in_addr_t ip_dst;
+	unsigned int id;
+	unsigned char ip_version;
+	unsigned char ip_proto;
+
+	DefragFragment fragments[DEFRAG_MAX_FRAGMENTS]; // Sorted by offset
+	int num_fragments;
+	unsigned int total_len; // Of the datagram payload (0 until the last fragment arrives)
+	unsigned long expires; // Milliseconds
+	unsigned long mem;
+	int overlap;
+	struct st_defrag_datagram *hnext; // Hash bucket chain
+	struct st_defrag_datagram *next, *prev; // Arrival order (the expiry and eviction order)
+} DefragDatagram;
+
+typedef struct {
+	DefragDatagram *buckets[DEFRAG_BUCKETS];
+	DefragDatagram *head, *tail;
+	unsigned long mem; // Held fragments and datagram state
+	unsigned long max_mem;
+	unsigned long timeout; // Milliseconds
+	int policy;
+	// Statistics
+	unsigned long reassembled;
+	unsigned long expired;
+	unsigned long evicted;
+	unsigned long overlaps;
+} Defrag;
+
+void defrag_init(Defrag *defrag, unsigned long max_mem, unsigned long timeout, int policy);
+
+/*
+ * Holds a fragment (pkt must be a parsed fragment). Returns DEFRAG_HELD, DEFRAG_REJECTED, or
+ * DEFRAG_COMPLETE and sets *complete to the datagram, which is then no longer held by defrag.
+ */
+int defrag_add(Defrag *defrag, InPacket *pkt, unsigned long now, DefragDatagram **complete);
+
+/*
+ * Returns the oldest incomplete datagram if it timed out or the memory cap is exceeded (it is
+ * then no longer held by defrag), or NULL. Call until it returns NULL after each defrag_add and
+ * periodically. Pass now = (unsigned long)-1 to flush all datagrams.
+ */
+DefragDatagram *defrag_next_expired(Defrag *defrag, unsigned long now);
+
+/*
+ * Writes the reassembled datagram (the first fragment's IP header with its length fixed, then the
+ * whole payload) to buf, which must hold DEFRAG_BUFFER_SIZE bytes. Returns its length. An IPv6
+ * header keeps its Fragment header, as an atomic fragment's, so the payload's headers are parsed.
+ */
+int defrag_reassemble(Defrag *defrag, DefragDatagram *datagram, unsigned char *buf);
+
+// Frees a datagram returned by defrag (but not its fragment packets, which the caller forwards and frees)
+void defrag_free_datagram(DefragDatagram *datagram);
+
+// Frees all held datagrams and their packets
+void defrag_destroy(Defrag *defrag);
+
+#endif /* PACKET_DEFRAG_H_ */
@@ -0,0 +1,87 @@
+#ifndef PACKET_PACKET_H_
+#define PACKET_PACKET_H_
+
+#include <netinet/in.h>
+
+#define PACKET_IPV4 4
+#define PACKET_IPV6 6
+
+#define PACKET_TUNNEL_NONE 0
+#define PACKET_TUNNEL_GRE 1
+#define PACKET_TUNNEL_VXLAN 2
+
+typedef struct {
+	// IP (IPv4 or IPv6)
+	unsigned char ip_version;
+	in_addr_t ip_src; // IPv6: the address words XORed together (a flow key, not an address)
+	in_addr_t ip_dst;
+	unsigned short ip_id;
+	unsigned char ip_tos; // IPv6: traffic class
+	unsigned char ip_ttl; // IPv6: hop limit
+	unsigned char ip_proto; // IPv6: next header
+	unsigned short ip_len; // Header included
+	unsigned short l3_offset; // Offset of the IP header in the captured packet (link layer and VLAN tags skipped)
+	unsigned short ip_hdr_len; // IPv4: with options, IPv6: with extension headers, up to the Fragment header of a fragment (the fragment data follows it)
+
+	// Fragments (of the outer header): frag_offset is in bytes, and is non-zero for all but the first fragment, which have no transport header.
+	// The payload of an IPv6 fragment is all its fragment data, the first one's included: its headers are parsed after reassembly.
+	unsigned short frag_offset;
+	unsigned char frag_more;
+	unsigned int frag_id; // IPv4: ip_id, IPv6: fragment header identification
+
+	// GRE/VXLAN: the flow key (addresses, protocol, ports, seqnum) and the payload are the inner packet's.
+	// Fragmented tunnel packets are not decapsulated (until they are reassembled).
+	unsigned char tunnel;
+	unsigned short inner_l3_offset; // Offset of the inner IP header
+
+	union {
+		struct _icmp {
+			// ICMP
+			unsigned short icmp_type;
+			unsigned short icmp_code;
+		} icmp;
+		struct _transport {
+			// Transport
+			unsigned short tp_src;
+			unsigned short tp_dst;
+		} transport;
+	};
+	unsigned int seqnum;
+	unsigned char tcp_flags;
+
+	// Data
+	unsigned int payload_len;
+	unsigned char *payload;
+} Packet;
+
+#define PACKET_IS_FRAGMENT(packet) ((packet)->frag_offset || (packet)->frag_more)
+
+/*
+ * Parses a captured packet of the given pcap link type (DLT_*), skipping the link layer header and
+ * any 802.1Q/802.1ad (QinQ) tags, IPv4 options and IPv6 extension headers. GRE and VXLAN packets are
+ * parsed down to the inner packet (one level). Every read is bounded by caplen and by the IP length, so
+ * truncated and malformed packets never yield a payload beyond the captured data.
+ * Returns 0 on success, or -1 if the packet is not IP or its headers are truncated (the payload is then empty).
+ */
+int packet_parse(const unsigned char *data, unsigned int caplen, int linktype, Packet *packet);
+
+// Same as packet_parse, for data that starts with the IP header (len captured bytes)
+int packet_parse_ip(const unsigned char *data, unsigned int len, Packet *packet);
+
+// Length of the link layer header of the given pcap link type (without VLAN tags), or -1 if not supported
+int packet_link_header_length(int linktype);
+
+// Writes the TOS (IPv6: traffic class) of the IP header of a parsed packet
+static inline void packet_set_tos(unsigned char *data, Packet *packet, unsigned char tos) {
+	unsigned char *iphdr = data + packet->l3_offset;
+
+	if (packet->ip_version == PACKET_IPV6) {
+		iphdr[0] = (iphdr[0] & 0xF0) | (tos >> 4);
+		iphdr[1] = (iphdr[1] & 0x0F) | (tos << 4);
+	} else {
+		iphdr[1] = tos;
+	}
+	packet->ip_tos = tos;
+}
+
+#endif /* PACKET_PACKET_H_ */
@@ -0,0 +1,417 @@
+/*
+ * PacketBuffer.c
+ *
+ *  Created on: Jun 8, 2014
+ *      Author: yotamhc
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "PacketBuffer.h"
+
+#ifndef USE_MUTEX
+static struct timespec _100_nanos = {0, 100};
+#endif
+
+static inline void lock(PacketBuffer *q) {
+#ifdef USE_MUTEX
+	pthread_mutex_lock(&(q->mutex));
+#else
+	while (__sync_lock_test_and_set(&(q->lock), 1)) {
+		nanosleep(&_100_nanos, NULL);
+	}
+#endif
+}
+
+static inline void unlock(PacketBuffer *q) {
+#ifdef USE_MUTEX
+	pthread_mutex_unlock(&(q->mutex));
+#else
+	__sync_lock_release(&(q->lock));
+#endif
+}
+
+#define HASH_KEY(src_ip, dst_ip, src_port, dst_port, seqnum) \
+	hash_key((src_ip), (dst_ip), ((unsigned int)(src_port) << 16) | (dst_port), (seqnum))
+
+static inline unsigned int hash_key(unsigned int a, unsigned int b, unsigned int c, unsigned int d) {
+	unsigned int h;
+
+	// Multiplicative mixing of the key words (MurmurHash3 finalizer)
+	h = a * 0xCC9E2D51;
+	h ^= (b + 0x9E3779B9 + (h << 6) + (h >> 2)) * 0x1B873593;
+	h ^= (c + 0x9E3779B9 + (h << 6) + (h >> 2)) * 0xCC9E2D51;
+	h ^= (d + 0x9E3779B9 + (h << 6) + (h >> 2)) * 0x1B873593;
+	h ^= h >> 16;
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline unsigned int hash_packet(InPacket *pkt) {
+	return HASH_KEY(pkt->packet.ip_src, pkt->packet.ip_dst, pkt->packet.transport.tp_src, pkt->packet.transport.tp_dst, pkt->seqnum);
+}
+
+static inline void bucket_insert(PacketBuffer *q, PacketBufferItem *i) {
+	PacketBufferItem **bucket;
+
+	bucket = &(q->buckets[i->hash & (q->numBuckets - 1)]);
+	i->hprev = NULL;
+	i->hnext = *bucket;
+	if (*bucket)
+		(*bucket)->hprev = i;
+	*bucket = i;
+}
+
+static inline void bucket_remove(PacketBuffer *q, PacketBufferItem *i) {
+	if (i->hprev)
+		i->hprev->hnext = i->hnext;
+	else
+		q->buckets[i->hash & (q->numBuckets - 1)] = i->hnext;
+	if (i->hnext)
+		i->hnext->hprev = i->hprev;
+}
+
+static inline void fifo_remove(PacketBuffer *q, PacketBufferItem *i) {
+	if (i->prev)
+		i->prev->next = i->next;
+	else
+		q->head = i->next;
+	if (i->next)
+		i->next->prev = i->prev;
+	else
+		q->tail = i->prev;
+	q->size--;
+}
+
+static void alloc_buckets(PacketBuffer *q, unsigned int numBuckets) {
+	q->buckets = (PacketBufferItem**)calloc(numBuckets, sizeof(PacketBufferItem*));
+	if (!q->buckets) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
+	q->numBuckets = numBuckets;
+}
+
+// Doubles the number of buckets (keeps the load factor at most 1)
+static void grow_buckets(PacketBuffer *q) {
+	PacketBufferItem *i;
+
+	free(q->buckets);
+	alloc_buckets(q, q->numBuckets * 2);
+	for (i = q->head; i; i = i->next) {
+		bucket_insert(q, i);
+	}
+}
+
+// Timer callback of a buffered packet (the timer data is the buffer)
+static void item_expired(TimerWheelEntry *entry) {
+	PacketBufferItem *i;
+	PacketBuffer *q;
+	InPacket *packet;
+
+	i = (PacketBufferItem*)((char*)entry - offsetof(PacketBufferItem, timer));
+	q = (PacketBuffer*)(entry->data);
+
+	lock(q);
+	packet = i->packet;
+	fifo_remove(q, i);
+	bucket_remove(q, i);
+	free(i);
+	unlock(q);
+
+	q->expired(q, packet, q->expired_arg);
+}
+
+InPacket *copy_captured_packet(const struct pcap_pkthdr *pkthdr, const unsigned char *pktptr) {
+	InPacket *res;
+
+	res = (InPacket*)malloc(sizeof(InPacket));
+	if (!res) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
+	res->pkthdr = *pkthdr;
+	res->pktdata = (unsigned char*)malloc(sizeof(unsigned char) * pkthdr->caplen);
+	if (!(res->pktdata)) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
+	memcpy(res->pktdata, pktptr, sizeof(unsigned char) * pkthdr->caplen);
+	res->seqnum = 0;
+	res->timestamp = 0;
+	return res;
+}
+
+InPacket *buffer_packet(const struct pcap_pkthdr *pkthdr, const unsigned char *pktptr, int linktype) {
+	InPacket *res;
+
+	res = copy_captured_packet(pkthdr, pktptr);
+	packet_parse(res->pktdata, pkthdr->caplen, linktype, &(res->packet));
+	return res;
+}
+
+void packet_parse_batch(InPacket **packets, int count, int linktype) {
+	InPacket *next;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (i + PACKET_PARSE_PREFETCH < count) {
+			next = packets[i + PACKET_PARSE_PREFETCH];
+			__builtin_prefetch(next->pktdata);
+			__builtin_prefetch(next->pktdata + 64);
+		}
+		packet_parse(packets[i]->pktdata, packets[i]->pkthdr.caplen, linktype, &(packets[i]->packet));
+	}
+}
+
+void free_buffered_packet(InPacket *pkt) {
+	free(pkt->pktdata);
+	free(pkt);
+}
+
+void packet_buffer_init(PacketBuffer *q) {
+	q->size = 0;
+	q->head = q->tail = NULL;
+	q->wheel = NULL;
+	q->timeout = 0;
+	q->expired = NULL;
+	q->expired_arg = NULL;
+	alloc_buckets(q, PACKET_BUFFER_INITIAL_BUCKETS);
+#ifdef USE_MUTEX
+	pthread_mutex_init(&(q->mutex), NULL);
+#else
+	q->lock = 0;
+#endif
+}
+
+void packet_buffer_set_timeout(PacketBuffer *q, TimerWheel *wheel, unsigned long timeout, PacketExpiredCallback expired, void *arg) {
+	q->wheel = wheel;
+	q->timeout = timeout;
+	q->expired = expired;
+	q->expired_arg = arg;
+}
+
+void packet_buffer_destroy(PacketBuffer *q, int destroyItems) {
+	PacketBufferItem *item, *next;
+	item = q->head;
+	while (item) {
+		if (q->wheel) {
+			timer_wheel_remove(q->wheel, &(item->timer));
+		}
+		if (destroyItems) {
+			free(item->packet);
+		}
+		next = item->next;
+		free(item);
+		item = next;
+	}
+#ifdef USE_MUTEX
+	pthread_mutex_destroy(&(q->mutex));
+#endif
+	free(q->buckets);
+	q->buckets = NULL;
+	q->numBuckets = 0;
+	q->head = q->tail = NULL;
+	q->size = 0;
+}
+
+void packet_buffer_enqueue(PacketBuffer *q, InPacket *packet) {
+	PacketBufferItem *i;
+
+	lock(q);
+
+	i = (PacketBufferItem*)malloc(sizeof(PacketBufferItem));
+	if (!i) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
+	i->packet = packet;
+	i->hash = hash_packet(packet);
+	i->next = NULL;
+	i->prev = q->tail;
+	if (q->tail)
+		q->tail->next = i;
+	q->tail = i;
+	if (!q->head)
+		q->head = i;
+	q->size++;
+
+	if (q->size > q->numBuckets) {
+		grow_buckets(q);
+	} else {
+		bucket_insert(q, i);
+	}
+
+	timer_wheel_entry_init(&(i->timer), item_expired, q);
+	if (q->wheel) {
+		timer_wheel_add(q->wheel, &(i->timer), packet->timestamp + q->timeout);
+	}
+
+	unlock(q);
+}
+
+InPacket *packet_buffer_dequeue(PacketBuffer *q) {
+	void *res;
+	PacketBufferItem *i;
+
+	lock(q);
+
+	if (q->size == 0) {
+		unlock(q);
+		return NULL;
+	}
+
+	i = q->head;
+	res = i->packet;
+	fifo_remove(q, i);
+	bucket_remove(q, i);
+	if (q->wheel) {
+		timer_wheel_remove(q->wheel, &(i->timer));
+	}
+	free(i);
+
+	unlock(q);
+
+	return res;
+}
+
+InPacket *packet_buffer_peek(PacketBuffer *q) {
+	InPacket *res;
+
+	lock(q);
+	if (q->size == 0) {
+		unlock(q);
+		return NULL;
+	}
+
+	res = q->head->packet;
+	unlock(q);
+	return res;
+}
+
+InPacket *packet_buffer_pop(PacketBuffer *q, unsigned int src_ip, unsigned int dst_ip, unsigned short src_port, unsigned short dst_port, unsigned int seqnum) {
+	PacketBufferItem *i, *match;
+	InPacket *res;
+	unsigned int hash;
+
+	hash = HASH_KEY(src_ip, dst_ip, src_port, dst_port, seqnum);
+
+	lock(q);
+
+	if (q->size == 0) {
+		unlock(q);
+		return NULL;
+	}
+
+	// Bucket chains are newest first, so the oldest matching packet is the last match in the chain
+	match = NULL;
+	for (i = q->buckets[hash & (q->numBuckets - 1)]; i; i = i->hnext) {
+		if (i->hash == hash &&
+				i->packet->seqnum == seqnum &&
+				i->packet->packet.ip_src == src_ip &&
+				i->packet->packet.ip_dst == dst_ip &&
+				i->packet->packet.transport.tp_src == src_port &&
+				i->packet->packet.transport.tp_dst == dst_port) {
+			match = i;
+		}
+	}
+	if (!match) {
+		unlock(q);
+		return NULL;
+	}
+
+	// Remove element
+	res = match->packet;
+	fifo_remove(q, match);
+	bucket_remove(q, match);
+	if (q->wheel) {
+		timer_wheel_remove(q->wheel, &(match->timer));
+	}
+	free(match);
+
+	unlock(q);
+	return res;
+}
+
+#define TEST_PACKET_COUNT 4096 // More than PACKET_BUFFER_INITIAL_BUCKETS, to test growing
+
+#define ASSERT(cond, msg) \
+	if (!(cond)) { fprintf(stderr, "ASSERTION FAILED: %s\n", (msg)); exit(1); }
+
+int _main() {
+	// Small test program
+	InPacket packets[TEST_PACKET_COUNT];
+	int i;
+	PacketBuffer buff;
+	InPacket *pkt;
+
+	for (i = 0; i < TEST_PACKET_COUNT; i++) {
+		packets[i].packet.ip_src = i;
+		packets[i].packet.ip_dst = i+1;
+		packets[i].packet.ip_id = 0;
+		packets[i].packet.ip_len = 0;
+		packets[i].packet.ip_proto = 6;
+		packets[i].packet.ip_tos = 0;
+		packets[i].packet.ip_ttl = 64;
+		packets[i].packet.seqnum = i;
+		packets[i].seqnum = i;
+		packets[i].packet.payload_len = 5;
+		packets[i].packet.payload = (unsigned char *)"hello";
+		packets[i].packet.transport.tp_src = 80;
+		packets[i].packet.transport.tp_dst = 81;
+		packets[i].pktdata = (unsigned char*)"hello";
+		packets[i].pkthdr.caplen = 0;
+		packets[i].pkthdr.len = 5;
+		packets[i].pkthdr.ts.tv_sec = 0;
+		packets[i].pkthdr.ts.tv_usec = 0;
+	}
+
+	packet_buffer_init(&buff);
+
+	for (i = 0; i < TEST_PACKET_COUNT; i++) {
+		packet_buffer_enqueue(&buff, &(packets[i]));
+		ASSERT(buff.size == (i+1), "Unexpected size of queue after enqueue");
+	}
+
+	for (i = 0; i < TEST_PACKET_COUNT; i++) {
+		pkt = packet_buffer_dequeue(&buff);
+		ASSERT(pkt == &(packets[i]), "dequeued packet data is different");
+		ASSERT(buff.size == (TEST_PACKET_COUNT - i - 1), "Unexpected size of queue after dequeue");
+	}
+
+	ASSERT(buff.size == 0, "Queue should be empty by now");
+	ASSERT(buff.head == NULL, "Head is not NULL but queue is empty");
+	ASSERT(buff.tail == NULL, "Tail is not NULL but queue is empty");
+
+	for (i = 0; i < TEST_PACKET_COUNT; i++) {
+		packet_buffer_enqueue(&buff, &(packets[i]));
+		ASSERT(buff.size == (i+1), "Unexpected size of queue after enqueue");
+	}
+
+	for (i = 0; i < TEST_PACKET_COUNT; i += 7) {
+		pkt = packet_buffer_pop(&buff, packets[i].packet.ip_src, packets[i].packet.ip_dst, packets[i].packet.transport.tp_src, packets[i].packet.transport.tp_dst, packets[i].seqnum);
+		ASSERT(pkt == &(packets[i]), "poped packet data is different")
+		pkt = packet_buffer_pop(&buff, packets[i].packet.ip_src, packets[i].packet.ip_dst, packets[i].packet.transport.tp_src, packets[i].packet.transport.tp_dst, packets[i].seqnum);
+		ASSERT(pkt == NULL, "packet was poped twice")
+	}
+
+	for (i = 0; i < TEST_PACKET_COUNT; i++) {
+		if (i % 7 == 0)
+			continue;
+		pkt = packet_buffer_dequeue(&buff);
+		ASSERT(pkt == &(packets[i]), "dequeued packet data is different after pop");
+	}
+	ASSERT(buff.size == 0, "Queue should be empty by now");
+
+	packet_buffer_destroy(&buff, 0);
+
+	printf("TEST SUCCEEDED\n");
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * PacketBuffer.h
+ *
+ *  Created on: Jun 8, 2014
+ *      Author: yotamhc
+ */
+
+#ifndef PACKETBUFFER_H_
+#define PACKETBUFFER_H_
+
+#include <pthread.h>
+#include <pcap.h>
+#include "Packet.h"
+#include "TimerWheel.h"
+
+//#define USE_MUTEX
+
+typedef struct {
+	struct pcap_pkthdr pkthdr;
+	unsigned char *pktdata;
+	unsigned long timestamp; // Milliseconds
+	unsigned int seqnum;
+	Packet packet;
+} InPacket;
+
+#define PACKET_BUFFER_INITIAL_BUCKETS 1024 // Must be a power of 2
+
+typedef struct sq_item {
+	InPacket *packet;
+	struct sq_item *next, *prev; // FIFO order (for expiry)
+	struct sq_item *hnext, *hprev; // Hash bucket chain (for packet_buffer_pop)
+	unsigned int hash;
+	TimerWheelEntry timer; // Expiry (if the buffer has a timeout)
+} PacketBufferItem;
+
+/*
+ * A FIFO of buffered packets, also indexed by a hash table on (addresses, ports, seqnum)
+ * so a data packet and its result packet are joined in O(1).
+ */
+struct st_packet_buffer;
+
+// Called when a buffered packet times out (after it is removed from the buffer)
+typedef void (*PacketExpiredCallback)(struct st_packet_buffer *q, InPacket *packet, void *arg);
+
+typedef struct st_packet_buffer {
+	PacketBufferItem *head, *tail;
+	int size;
+	PacketBufferItem **buckets;
+	unsigned int numBuckets;
+	TimerWheel *wheel;
+	unsigned long timeout; // Milliseconds
+	PacketExpiredCallback expired;
+	void *expired_arg;
+#ifdef USE_MUTEX
+	pthread_mutex_t mutex;
+#else
+	int lock;
+#endif
+} PacketBuffer;
+
+// Copies a captured packet (pcap reuses its buffer) and parses the copy, so the parsed payload points into it
+InPacket *buffer_packet(const struct pcap_pkthdr *pkthdr, const unsigned char *pktptr, int linktype);
+
+// Copies a captured packet without parsing it, for packet_parse_batch
+InPacket *copy_captured_packet(const struct pcap_pkthdr *pkthdr, const unsigned char *pktptr);
+
+#define PACKET_PARSE_PREFETCH 4 // Packets ahead whose headers are prefetched
+
+// Parses a batch of copied packets, prefetching the headers of the next packets
+void packet_parse_batch(InPacket **packets, int count, int linktype);
+
+void free_buffered_packet(InPacket *pkt);
+
+void packet_buffer_init(PacketBuffer *q);
+
+void packet_buffer_destroy(PacketBuffer *q, int destroyItems);
+
+// Expire packets timeout milliseconds after their timestamp, using the given timer wheel
+void packet_buffer_set_timeout(PacketBuffer *q, TimerWheel *wheel, unsigned long timeout, PacketExpiredCallback expired, void *arg);
+
+void packet_buffer_enqueue(PacketBuffer *q, InPacket *packet);
+
+InPacket *packet_buffer_dequeue(PacketBuffer *q);
+
+InPacket *packet_buffer_peek(PacketBuffer *q);
+
+InPacket *packet_buffer_pop(PacketBuffer *q, unsigned int src_ip, unsigned int dst_ip, unsigned short src_port, unsigned short dst_port, unsigned int seqnum);
+
+#endif /* PACKETBUFFER_H_ */
@@ -0,0 +1,397 @@
+#include <string.h>
+#include <pcap.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <netinet/ip_icmp.h>
+#include "Packet.h"
+
+#define ETHER_HEADER_SIZE 14
+#define ETHER_TYPE_OFFSET 12
+#define VLAN_TAG_SIZE 4
+#define ETHER_TYPE_IPV4 0x0800
+#define ETHER_TYPE_IPV6 0x86DD
+#define ETHER_TYPE_VLAN 0x8100
+#define ETHER_TYPE_QINQ 0x88A8
+#define ETHER_TYPE_QINQ_OLD 0x9100
+#define ETHER_TYPE_TEB 0x6558 // Transparent Ethernet bridging (GRE)
+#define MAX_VLAN_TAGS 2
+
+#define IPV4_HEADER_MIN_SIZE 20
+#define IPV6_HEADER_SIZE 40
+#define TCP_HEADER_MIN_SIZE 20
+#define UDP_HEADER_SIZE 8
+#define ICMP_HEADER_MIN_SIZE 4
+#define IPV6_FRAG_HEADER_SIZE 8
+#define MAX_IPV6_EXT_HEADERS 8
+
+#define GRE_HEADER_MIN_SIZE 4
+#define GRE_FLAG_CSUM 0x8000
+#define GRE_FLAG_KEY 0x2000
+#define GRE_FLAG_SEQ 0x1000
+#define GRE_VERSION_MASK 0x0007
+#define VXLAN_UDP_PORT 4789 // Not 4790 (VXLAN-GPE): that carries the NSH match reports, which the apps decode themselves
+#define VXLAN_HEADER_SIZE 8
+#define VXLAN_FLAG_VNI 0x08
+
+// How an IPv6 next header value is skipped on the way to the transport header
+#define IPV6_EXT_NONE 0 // Not an extension header
+#define IPV6_EXT_OPTS 1 // Length in 8-octet units, not including the first 8 octets
+#define IPV6_EXT_FRAG 2 // Fixed 8 octets
+#define IPV6_EXT_AUTH 3 // Length in 4-octet units, not including the first 2 units
+
+#ifndef IPPROTO_MH
+#define IPPROTO_MH 135
+#endif
+
+#ifndef DLT_LINUX_SLL
+#define DLT_LINUX_SLL 113
+#endif
+
+int packet_link_header_length(int linktype) {
+	switch (linktype) {
+	case DLT_NULL:
+		return 4;
+	case DLT_EN10MB:
+		return ETHER_HEADER_SIZE;
+	case DLT_RAW:
+		return 0;
+	case DLT_LINUX_SLL:
+		return 16;
+	case DLT_SLIP:
+	case DLT_PPP:
+		return 24;
+	default:
+		return -1;
+	}
+}
+
+static inline void clear_packet(Packet *packet) {
+	memset(packet, 0, sizeof(Packet));
+}
+
+static const unsigned char ipv6_ext_headers[256] = {
+	[IPPROTO_HOPOPTS] = IPV6_EXT_OPTS,
+	[IPPROTO_ROUTING] = IPV6_EXT_OPTS,
+	[IPPROTO_FRAGMENT] = IPV6_EXT_FRAG,
+	[IPPROTO_AH] = IPV6_EXT_AUTH,
+	[IPPROTO_DSTOPTS] = IPV6_EXT_OPTS,
+	[IPPROTO_MH] = IPV6_EXT_OPTS,
+};
+
+static int parse_ip(const unsigned char *data, unsigned int len, Packet *packet, int tunnels);
+
+static inline unsigned short read_ushort(const unsigned char *data) {
+	return (data[0] << 8) | data[1];
+}
+
+/*
+ * Skips an Ethernet header and up to MAX_VLAN_TAGS tags. Returns the ether type of the
+ * encapsulated packet and sets its offset, or returns 0 if the header is truncated.
+ */
+static inline unsigned short parse_ethernet(const unsigned char *data, unsigned int len, unsigned int *offset) {
+	unsigned short ether_type;
+	unsigned int off;
+	int tags;
+
+	if (len < ETHER_HEADER_SIZE)
+		return 0;
+	ether_type = read_ushort(data + ETHER_TYPE_OFFSET);
+	off = ETHER_HEADER_SIZE;
+	for (tags = 0; (ether_type == ETHER_TYPE_VLAN || ether_type == ETHER_TYPE_QINQ || ether_type == ETHER_TYPE_QINQ_OLD) && tags < MAX_VLAN_TAGS; tags++) {
+		if (len < off + VLAN_TAG_SIZE)
+			return 0;
+		ether_type = read_ushort(data + off + 2);
+		off += VLAN_TAG_SIZE;
+	}
+	*offset = off;
+	return ether_type;
+}
+
+/*
+ * Parses the packet carried by a GRE or VXLAN tunnel and takes its flow key and payload. The outer
+ * IP header fields (version, TOS, length, offset) are kept: they describe the frame the middlebox forwards.
+ * inner is the tunnel payload (len bytes), inner_type the ether type of what it carries.
+ */
+static inline void parse_tunnel(const unsigned char *data, const unsigned char *inner, unsigned int len, unsigned short inner_type, unsigned char tunnel, Packet *packet) {
+	Packet innerPacket;
+	unsigned int offset;
+
+	offset = 0;
+	if (inner_type == ETHER_TYPE_TEB) {
+		inner_type = parse_ethernet(inner, len, &offset);
+	}
+	if (inner_type != ETHER_TYPE_IPV4 && inner_type != ETHER_TYPE_IPV6)
+		return;
+	// One level only: a tunnel inside a tunnel is scanned as the inner packet's payload
+	if (parse_ip(inner + offset, len - offset, &innerPacket, 0) < 0)
+		return;
+
+	packet->ip_src = innerPacket.ip_src;
+	packet->ip_dst = innerPacket.ip_dst;
+	packet->ip_proto = innerPacket.ip_proto;
+	packet->transport = innerPacket.transport;
+	packet->seqnum = innerPacket.seqnum;
+	packet->tcp_flags = innerPacket.tcp_flags;
+	packet->payload = innerPacket.payload;
+	packet->payload_len = innerPacket.payload_len;
+	packet->tunnel = tunnel;
+	packet->inner_l3_offset = (inner + offset) - data;
+}
+
+static inline void parse_gre(const unsigned char *ip, const unsigned char *data, unsigned int len, Packet *packet) {
+	unsigned short flags;
+	unsigned int hdr_len;
+
+	if (len < GRE_HEADER_MIN_SIZE)
+		return;
+	flags = read_ushort(data);
+	if (flags & GRE_VERSION_MASK)
+		return; // Not plain GRE (e.g. PPTP)
+	hdr_len = GRE_HEADER_MIN_SIZE + ((flags & GRE_FLAG_CSUM) ? 4 : 0) + ((flags & GRE_FLAG_KEY) ? 4 : 0) + ((flags & GRE_FLAG_SEQ) ? 4 : 0);
+	if (len < hdr_len)
+		return;
+	parse_tunnel(ip, data + hdr_len, len - hdr_len, read_ushort(data + 2), PACKET_TUNNEL_GRE, packet);
+}
+
+static inline void parse_vxlan(const unsigned char *ip, const unsigned char *data, unsigned int len, Packet *packet) {
+	if (len < VXLAN_HEADER_SIZE || !(data[0] & VXLAN_FLAG_VNI))
+		return;
+	parse_tunnel(ip, data + VXLAN_HEADER_SIZE, len - VXLAN_HEADER_SIZE, ETHER_TYPE_TEB, PACKET_TUNNEL_VXLAN, packet);
+}
+
+// Parses the transport header at data (len bytes of IP payload, already bounded by the IP length and caplen)
+static inline void parse_transport(const unsigned char *ip, const unsigned char *data, unsigned int len, Packet *packet, int tunnels) {
+	const struct tcphdr *tcphdr;
+	const struct udphdr *udphdr;
+	const struct icmp *icmphdr;
+	unsigned int transport_len;
+
+	if (packet->frag_offset) {
+		// Not the first fragment: there is no transport header, scan the fragment as is
+		packet->payload = (unsigned char *)data;
+		packet->payload_len = len;
+		return;
+	}
+
+	switch (packet->ip_proto) {
+	case IPPROTO_TCP:
+		if (len < TCP_HEADER_MIN_SIZE)
+			return;
+		tcphdr = (const struct tcphdr*)data;
+#ifdef __APPLE__
+		transport_len = 4 * tcphdr->th_off;
+		packet->transport.tp_src = tcphdr->th_sport;
+		packet->transport.tp_dst = tcphdr->th_dport;
+		packet->seqnum = tcphdr->th_seq;
+		packet->tcp_flags = tcphdr->th_flags;
+#elif __linux__
+		transport_len = 4 * tcphdr->doff;
+		packet->transport.tp_src = tcphdr->source;
+		packet->transport.tp_dst = tcphdr->dest;
+		packet->seqnum = tcphdr->seq;
+		packet->tcp_flags = data[13];
+#endif
+		if (transport_len < TCP_HEADER_MIN_SIZE || transport_len > len)
+			return;
+		break;
+
+	case IPPROTO_UDP:
+		if (len < UDP_HEADER_SIZE)
+			return;
+		udphdr = (const struct udphdr*)data;
+		transport_len = UDP_HEADER_SIZE;
+#ifdef __APPLE__
+		packet->transport.tp_src = udphdr->uh_sport;
+		packet->transport.tp_dst = udphdr->uh_dport;
+		packet->seqnum = udphdr->uh_sum;
+#elif __linux__
+		packet->transport.tp_src = udphdr->source;
+		packet->transport.tp_dst = udphdr->dest;
+		packet->seqnum = udphdr->check;
+#endif
+		break;
+
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		if (len < ICMP_HEADER_MIN_SIZE)
+			return;
+		icmphdr = (const struct icmp*)data;
+		packet->icmp.icmp_type = icmphdr->icmp_type;
+		packet->icmp.icmp_code = icmphdr->icmp_code;
+		return;
+
+	default:
+		// Unknown transport, scan the whole IP payload
+		transport_len = 0;
+		break;
+	}
+
+	packet->payload = (unsigned char *)(data + transport_len);
+	packet->payload_len = len - transport_len;
+
+	if (tunnels && !packet->frag_more) {
+		if (packet->ip_proto == IPPROTO_GRE) {
+			parse_gre(ip, packet->payload, packet->payload_len, packet);
+		} else if (packet->ip_proto == IPPROTO_UDP && packet->transport.tp_dst == htons(VXLAN_UDP_PORT)) {
+			parse_vxlan(ip, packet->payload, packet->payload_len, packet);
+		}
+	}
+}
+
+static inline unsigned int fold_ipv6_address(const struct in6_addr *addr) {
+	unsigned int words[4];
+
+	memcpy(words, addr, sizeof(words));
+	return words[0] ^ words[1] ^ words[2] ^ words[3];
+}
+
+/*
+ * Skips the IPv6 extension headers between data + *hdr_len and data + len, and sets ip_proto to
+ * the transport protocol. A fragment stops at its Fragment header: what follows is the fragmentable
+ * part, and ip_proto is the Fragment header's next header. Returns -1 if an extension header is
+ * truncated or there are too many.
+ */
+static inline int skip_ipv6_ext_headers(const unsigned char *data, unsigned int len, unsigned int *hdr_len, Packet *packet) {
+	const unsigned char *ext;
+	unsigned int off, ext_len;
+	unsigned char type;
+	int i;
+
+	off = *hdr_len;
+	for (i = 0; (type = ipv6_ext_headers[packet->ip_proto]) != IPV6_EXT_NONE; i++) {
+		if (i == MAX_IPV6_EXT_HEADERS || len < off + 8)
+			return -1;
+		ext = data + off;
+		switch (type) {
+		case IPV6_EXT_FRAG:
+			ext_len = IPV6_FRAG_HEADER_SIZE;
+			packet->frag_offset = read_ushort(ext + 2) & 0xFFF8;
+			packet->frag_more = ext[3] & 0x01;
+			memcpy(&(packet->frag_id), ext + 4, sizeof(packet->frag_id));
+			packet->frag_id = ntohl(packet->frag_id);
+			break;
+		case IPV6_EXT_AUTH:
+			ext_len = (ext[1] + 2) * 4;
+			break;
+		default:
+			ext_len = (ext[1] + 1) * 8;
+			break;
+		}
+		if (len < off + ext_len)
+			return -1;
+		packet->ip_proto = ext[0];
+		off += ext_len;
+		if (type == IPV6_EXT_FRAG && PACKET_IS_FRAGMENT(packet)) {
+			// (not an atomic fragment, whose headers go on as if it had no Fragment header)
+			break;
+		}
+	}
+	*hdr_len = off;
+	return 0;
+}
+
+static int parse_ip(const unsigned char *data, unsigned int len, Packet *packet, int tunnels) {
+	const struct ip *iphdr;
+	const struct ip6_hdr *ip6hdr;
+	unsigned int hdr_len, ip_len;
+
+	clear_packet(packet);
+	if (len < 1)
+		return -1;
+
+	switch (data[0] >> 4) {
+	case PACKET_IPV4:
+		if (len < IPV4_HEADER_MIN_SIZE)
+			return -1;
+		iphdr = (const struct ip*)data;
+		// Options are skipped with the header length
+		hdr_len = 4 * iphdr->ip_hl;
+		ip_len = ntohs(iphdr->ip_len);
+		if (hdr_len < IPV4_HEADER_MIN_SIZE || ip_len < hdr_len)
+			return -1;
+		packet->ip_version = PACKET_IPV4;
+		packet->ip_src = iphdr->ip_src.s_addr;
+		packet->ip_dst = iphdr->ip_dst.s_addr;
+		packet->ip_id = ntohs(iphdr->ip_id);
+		packet->ip_tos = iphdr->ip_tos;
+		packet->ip_ttl = iphdr->ip_ttl;
+		packet->ip_proto = iphdr->ip_p;
+		packet->frag_offset = (ntohs(iphdr->ip_off) & IP_OFFMASK) * 8;
+		packet->frag_more = (ntohs(iphdr->ip_off) & IP_MF) ? 1 : 0;
+		packet->frag_id = packet->ip_id;
+		break;
+
+	case PACKET_IPV6:
+		if (len < IPV6_HEADER_SIZE)
+			return -1;
+		ip6hdr = (const struct ip6_hdr*)data;
+		hdr_len = IPV6_HEADER_SIZE;
+		ip_len = IPV6_HEADER_SIZE + ntohs(ip6hdr->ip6_plen);
+		packet->ip_version = PACKET_IPV6;
+		packet->ip_src = fold_ipv6_address(&(ip6hdr->ip6_src));
+		packet->ip_dst = fold_ipv6_address(&(ip6hdr->ip6_dst));
+		packet->ip_tos = (ntohl(ip6hdr->ip6_flow) >> 20) & 0xFF;
+		packet->ip_ttl = ip6hdr->ip6_hlim;
+		packet->ip_proto = ip6hdr->ip6_nxt;
+		break;
+
+	default:
+		return -1;
+	}
+	packet->ip_len = ip_len;
+
+	// Captured data may be shorter (snaplen) or longer (link layer padding) than the IP packet
+	if (ip_len > len)
+		ip_len = len;
+	if (ip_len < hdr_len)
+		return -1;
+	if (packet->ip_version == PACKET_IPV6 && skip_ipv6_ext_headers(data, ip_len, &hdr_len, packet) < 0)
+		return -1;
+	packet->ip_hdr_len = hdr_len;
+
+	if (packet->ip_version == PACKET_IPV6 && PACKET_IS_FRAGMENT(packet)) {
+		// The headers after the Fragment header are parsed once the datagram is reassembled
+		packet->payload = (unsigned char *)(data + hdr_len);
+		packet->payload_len = ip_len - hdr_len;
+		return 0;
+	}
+
+	parse_transport(data, data + hdr_len, ip_len - hdr_len, packet, tunnels);
+	return 0;
+}
+
+int packet_parse_ip(const unsigned char *data, unsigned int len, Packet *packet) {
+	return parse_ip(data, len, packet, 1);
+}
+
+int packet_parse(const unsigned char *data, unsigned int caplen, int linktype, Packet *packet) {
+	unsigned int offset;
+	unsigned short ether_type;
+	int hdr_len;
+
+	if (linktype == DLT_EN10MB) {
+		ether_type = parse_ethernet(data, caplen, &offset);
+		if (ether_type != ETHER_TYPE_IPV4 && ether_type != ETHER_TYPE_IPV6) {
+			clear_packet(packet);
+			return -1;
+		}
+	} else {
+		hdr_len = packet_link_header_length(linktype);
+		if (hdr_len < 0 || caplen < (unsigned int)hdr_len) {
+			clear_packet(packet);
+			return -1;
+		}
+		offset = hdr_len;
+	}
+
+	if (packet_parse_ip(data + offset, caplen - offset, packet) < 0)
+		return -1;
+	packet->l3_offset = offset;
+	if (packet->tunnel != PACKET_TUNNEL_NONE) {
+		packet->inner_l3_offset += offset;
+	}
+	return 0;
+}
@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "Stream.h"
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_RST 0x04
+
+// Sequence numbers wrap around: compare them by their (signed) distance
+#define SEQ_DIFF(a, b) ((int)((a) - (b)))
+
+#define SEGMENT_MEM(pkt) (sizeof(StreamSegment) + sizeof(InPacket) + (pkt)->pkthdr.caplen)
+
+static inline unsigned int hash_key(in_addr_t ip_src, in_addr_t ip_dst, unsigned short tp_src, unsigned short tp_dst) {
+	unsigned int h;
+
+	h = ip_src ^ (ip_dst * 2654435761U) ^ (((unsigned int)tp_src << 16) | tp_dst);
+	h ^= h >> 16;
+	return h & (STREAM_BUCKETS - 1);
+}
+
+static Stream *get_stream(StreamTable *table, Packet *packet, unsigned int seq) {
+	Stream *s;
+	unsigned int h;
+
+	h = hash_key(packet->ip_src, packet->ip_dst, packet->transport.tp_src, packet->transport.tp_dst);
+	for (s = table->buckets[h]; s; s = s->hnext) {
+		if (s->ip_src == packet->ip_src && s->ip_dst == packet->ip_dst &&
+				s->tp_src == packet->transport.tp_src && s->tp_dst == packet->transport.tp_dst) {
+			// Most recently seen last
+			if (s != table->tail) {
+				if (s->prev) {
+					s->prev->next = s->next;
+				} else {
+					table->head = s->next;
+				}
+				s->next->prev = s->prev;
+				s->prev = table->tail;
+				s->next = NULL;
+				table->tail->next = s;
+				table->tail = s;
+			}
+			return s;
+		}
+	}
+
+	// A new flow (or one picked up in the middle) starts at this segment
+	s = (Stream*)malloc(sizeof(Stream));
+	if (!s) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
+	s->ip_src = packet->ip_src;
+	s->ip_dst = packet->ip_dst;
+	s->tp_src = packet->transport.tp_src;
+	s->tp_dst = packet->transport.tp_dst;
+	s->next_seq = seq;
+	s->scan_state = 0;
+	s->delivered = 0;
+	s->bypass = 0;
+	s->held = NULL;
+	s->held_bytes = 0;
+	s->gap_next = s->gap_prev = NULL;
+
+	s->hnext = table->buckets[h];
+	table->buckets[h] = s;
+
+	s->next = NULL;
+	s->prev = table->tail;
+	if (table->tail) {
+		table->tail->next = s;
+	} else {
+		table->head = s;
+	}
+	table->tail = s;
+
+	table->mem += sizeof(Stream);
+	return s;
+}
+
+static void remove_stream(StreamTable *table, Stream *s) {
+	Stream **pp;
+
+	pp = &(table->buckets[hash_key(s->ip_src, s->ip_dst, s->tp_src, s->tp_dst)]);
+	while (*pp != s) {
+		pp = &((*pp)->hnext);
+	}
+	*pp = s->hnext;
+
+	if (s->prev) {
+		s->prev->next = s->next;
+	} else {
+		table->head = s->next;
+	}
+	if (s->next) {
+		s->next->prev = s->prev;
+	} else {
+		table->tail = s->prev;
+	}
+
+	table->mem -= sizeof(Stream);
+	free(s);
+}
+
+static void gap_remove(StreamTable *table, Stream *s) {
+	if (s->gap_prev) {
+		s->gap_prev->gap_next = s->gap_next;
+	} else {
+		table->gap_head = s->gap_next;
+	}
+	if (s->gap_next) {
+		s->gap_next->gap_prev = s->gap_prev;
+	} else {
+		table->gap_tail = s->gap_prev;
+	}
+	s->gap_next = s->gap_prev = NULL;
+}
+
+// Delivers a segment that starts at or before next_seq
+static inline void deliver_segment(StreamTable *table, Stream *s, InPacket *pkt, unsigned int seq, unsigned int len) {
+	unsigned int skip;
+	int delivered;
+
+	skip = 0;
+	delivered = SEQ_DIFF(s->next_seq, seq);
+	if (delivered > 0 && len > 0) {
+		if ((unsigned int)delivered >= len) {
+			skip = len;
+			table->retransmitted++;
+		} else {
+			skip = delivered;
+			table->trimmed++;
+		}
+	}
+	// (an empty segment, such as a FIN sent after lost data, does not fill gaps)
+	if (len > 0 && SEQ_DIFF(seq + len, s->next_seq) > 0) {
+		s->next_seq = seq + len;
+	}
+	table->deliver(s, pkt, skip, table->deliver_arg);
+	s->delivered += len - skip;
+}
+
+// Delivers the held segments that are now in order, or all of them (skipping the gaps) if flush is set
+static void deliver_held(StreamTable *table, Stream *s, int flush) {
+	StreamSegment *seg;
+
+	if (!s->held)
+		return;
+
+	while ((seg = s->held) && (flush || SEQ_DIFF(seg->seq, s->next_seq) <= 0)) {
+		s->held = seg->next;
+		s->held_bytes -= seg->len;
+		table->mem -= SEGMENT_MEM(seg->packet);
+		if (SEQ_DIFF(seg->seq, s->next_seq) > 0) {
+			// Give up on the missing bytes: the scan cannot continue across them
+			s->next_seq = seg->seq;
+			s->scan_state = 0;
+			table->gaps++;
+		} else {
+			table->reordered++;
+		}
+		deliver_segment(table, s, seg->packet, seg->seq, seg->len);
+		free(seg);
+	}
+
+	if (!s->held) {
+		gap_remove(table, s);
+	}
+}
+
+static void hold_segment(StreamTable *table, Stream *s, InPacket *pkt, unsigned int seq, unsigned int len, unsigned long now) {
+	StreamSegment *seg, **pp;
+
+	seg = (StreamSegment*)malloc(sizeof(StreamSegment));
+	if (!seg) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
+	seg->packet = pkt;
+	seg->seq = seq;
+	seg->len = len;
+
+	if (!s->held) {
+		s->gap_since = now;
+		s->gap_next = NULL;
+		s->gap_prev = table->gap_tail;
+		if (table->gap_tail) {
+			table->gap_tail->gap_next = s;
+		} else {
+			table->gap_head = s;
+		}
+		table->gap_tail = s;
+	}
+
+	// After the segments with the same seq (a copy of one of them is then delivered as a retransmission)
+	pp = &(s->held);
+	while (*pp && SEQ_DIFF((*pp)->seq, seq) <= 0) {
+		pp = &((*pp)->next);
+	}
+	seg->next = *pp;
+	*pp = seg;
+
+	s->held_bytes += len;
+	table->mem += SEGMENT_MEM(pkt);
+}
+
+// Skips the oldest gaps, then forgets the least recently seen flows, until the memory cap is met
+static void enforce_max_mem(StreamTable *table) {
+	Stream *s;
+
+	while (table->mem > table->max_mem && table->gap_head) {
+		deliver_held(table, table->gap_head, 1);
+	}
+	while (table->mem > table->max_mem && (s = table->head)) {
+		remove_stream(table, s);
+		table->evicted++;
+	}
+}
+
+void stream_table_init(StreamTable *table, unsigned long max_mem, StreamDeliverCallback deliver, void *arg) {
+	memset(table, 0, sizeof(StreamTable));
+	table->max_mem = max_mem;
+	table->deliver = deliver;
+	table->deliver_arg = arg;
+}
+
+void stream_table_segment(StreamTable *table, InPacket *pkt, unsigned long now) {
+	Packet *packet;
+	Stream *s;
+	unsigned int seq, len;
+	unsigned char flags;
+
+	// The packet may be freed once it is delivered
+	packet = &(pkt->packet);
+	seq = ntohl(packet->seqnum);
+	len = packet->payload_len;
+	flags = packet->tcp_flags;
+	if (flags & TCP_FLAG_SYN) {
+		// The SYN takes one sequence number before the data
+		seq++;
+	}
+
+	s = get_stream(table, packet, seq);
+	s->last_seen = now;
+
+	if ((flags & TCP_FLAG_SYN) && s->next_seq != seq) {
+		// A new connection on the same ports
+		deliver_held(table, s, 1);
+		s->next_seq = seq;
+		s->scan_state = 0;
+	}
+
+	if (s->bypass) {
+		// Order does not matter any more
+		deliver_held(table, s, 1);
+		table->deliver(s, pkt, 0, table->deliver_arg);
+	} else if (len > 0 && SEQ_DIFF(seq, s->next_seq) > 0) {
+		if (s->held_bytes + len <= STREAM_MAX_HELD) {
+			// Out of order: hold it until the gap before it is filled
+			hold_segment(table, s, pkt, seq, len, now);
+		} else {
+			// Out of budget for this flow: skip its gaps
+			deliver_held(table, s, 1);
+			if (SEQ_DIFF(seq, s->next_seq) > 0) {
+				s->next_seq = seq;
+				s->scan_state = 0;
+				table->gaps++;
+			}
+			deliver_segment(table, s, pkt, seq, len);
+		}
+	} else {
+		// The fast path: in order (or a retransmission), with nothing held
+		if (len > 0 && seq == s->next_seq) {
+			table->in_order++;
+		}
+		deliver_segment(table, s, pkt, seq, len);
+		deliver_held(table, s, 0);
+	}
+
+	if (flags & (TCP_FLAG_FIN | TCP_FLAG_RST)) {
+		deliver_held(table, s, 1);
+		remove_stream(table, s);
+	}
+
+	enforce_max_mem(table);
+}
+
+void stream_table_expire(StreamTable *table, unsigned long now) {
+	Stream *s;
+
+	while ((s = table->gap_head) && s->gap_since + STREAM_GAP_TIMEOUT <= now) {
+		deliver_held(table, s, 1);
+	}
+	while ((s = table->head) && s->last_seen + STREAM_IDLE_TIMEOUT <= now) {
+		deliver_held(table, s, 1);
+		remove_stream(table, s);
+	}
+}
+
+void stream_table_destroy(StreamTable *table) {
+	Stream *s;
+
+	while ((s = table->head)) {
+		deliver_held(table, s, 1);
+		remove_stream(table, s);
+	}
+}
@@ -0,0 +1,85 @@
+#ifndef PACKET_STREAM_H_
+#define PACKET_STREAM_H_
+
+#include "PacketBuffer.h"
+
+/*
+ * TCP stream reassembly, so a scanner that keeps its state per flow sees each direction of a
+ * connection in order. Segments are delivered (to a callback) in sequence order: in-order segments
+ * at once (the common case, with no copy or buffering), out-of-order segments are held (up to a byte
+ * budget) until the gap before them is filled, and the bytes of retransmitted segments that were
+ * already delivered are marked to be skipped. Every segment is delivered exactly once, so the
+ * caller still forwards all of them. A gap that is not filled in time (or for which the budget
+ * runs out) is skipped.
+ * A flow the caller no longer scans (see bypass) skips all of this.
+ * A StreamTable is not thread safe: it is meant to be owned by one worker (all the segments of a
+ * flow must be dispatched to the same worker).
+ */
+
+#define STREAM_BUCKETS 4096 // Must be a power of 2
+#define STREAM_MAX_HELD 65536 // Bytes of out-of-order segments held per flow
+#define STREAM_GAP_TIMEOUT 500 // Milliseconds to wait for a missing segment
+#define STREAM_IDLE_TIMEOUT 60000 // Milliseconds until an idle flow is forgotten
+
+typedef struct st_stream_segment {
+	InPacket *packet;
+	unsigned int seq;
+	unsigned int len;
+	struct st_stream_segment *next;
+} StreamSegment;
+
+typedef struct st_stream {
+	// Key (one direction of a connection)
+	in_addr_t ip_src;
+	in_addr_t ip_dst;
+	unsigned short tp_src;
+	unsigned short tp_dst;
+
+	unsigned int next_seq; // Next byte to deliver
+	int scan_state; // Owned by the scanner, reset to 0 when a gap is skipped
+	unsigned long delivered; // Payload bytes delivered so far (not counting skipped ones)
+	int bypass; // Set by the caller: deliver segments as they arrive, without holding them
+	StreamSegment *held; // Out-of-order segments, sorted by seq
+	unsigned int held_bytes;
+	unsigned long last_seen; // Milliseconds
+	unsigned long gap_since;
+	struct st_stream *hnext; // Hash bucket chain
+	struct st_stream *next, *prev; // Least recently seen first (for idle flows and eviction)
+	struct st_stream *gap_next, *gap_prev; // Flows with held segments, oldest gap first
+} Stream;
+
+/*
+ * Delivers a segment in sequence order: the first skip bytes of its payload were already delivered
+ * (skip is the whole payload for a retransmission). The callback owns the packet.
+ */
+typedef void (*StreamDeliverCallback)(Stream *stream, InPacket *packet, unsigned int skip, void *arg);
+
+typedef struct {
+	Stream *buckets[STREAM_BUCKETS];
+	Stream *head, *tail;
+	Stream *gap_head, *gap_tail;
+	unsigned long mem; // Flows and held segments
+	unsigned long max_mem;
+	StreamDeliverCallback deliver;
+	void *deliver_arg;
+	// Statistics
+	unsigned long in_order;
+	unsigned long reordered; // Held until the gap before them was filled
+	unsigned long retransmitted; // Delivered before, skipped entirely
+	unsigned long trimmed; // Partially delivered before
+	unsigned long gaps; // Skipped gaps
+	unsigned long evicted; // Flows forgotten before they were idle, for memory
+} StreamTable;
+
+void stream_table_init(StreamTable *table, unsigned long max_mem, StreamDeliverCallback deliver, void *arg);
+
+// Passes a parsed TCP segment (which the table then owns) to its flow
+void stream_table_segment(StreamTable *table, InPacket *pkt, unsigned long now);
+
+// Skips the gaps that timed out and forgets idle flows. Call periodically.
+void stream_table_expire(StreamTable *table, unsigned long now);
+
+// Delivers all the held segments and frees all flows
+void stream_table_destroy(StreamTable *table);
+
+#endif /* PACKET_STREAM_H_ */
@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+#include "TimerWheel.h"
+
+void timer_wheel_init(TimerWheel *wheel, unsigned long now) {
+	memset(wheel, 0, sizeof(TimerWheel));
+	wheel->now = now;
+}
+
+void timer_wheel_entry_init(TimerWheelEntry *entry, TimerCallback callback, void *data) {
+	entry->expires = 0;
+	entry->next = NULL;
+	entry->pprev = NULL;
+	entry->callback = callback;
+	entry->data = data;
+}
+
+static inline void slot_insert(TimerWheelEntry **slot, TimerWheelEntry *entry) {
+	entry->next = *slot;
+	if (*slot)
+		(*slot)->pprev = &(entry->next);
+	*slot = entry;
+	entry->pprev = slot;
+}
+
+static inline void slot_unlink(TimerWheelEntry *entry) {
+	*(entry->pprev) = entry->next;
+	if (entry->next)
+		entry->next->pprev = entry->pprev;
+	entry->next = NULL;
+	entry->pprev = NULL;
+}
+
+// Puts entry in the slot matching its distance from the current tick
+static void place(TimerWheel *wheel, TimerWheelEntry *entry) {
+	unsigned long expires, delta;
+	int level, shift;
+
+	expires = entry->expires;
+	delta = expires - wheel->now;
+	if (delta < TIMER_WHEEL_LEVEL0_SIZE) {
+		slot_insert(&(wheel->level0[expires & (TIMER_WHEEL_LEVEL0_SIZE - 1)]), entry);
+		return;
+	}
+	shift = TIMER_WHEEL_LEVEL0_BITS;
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 2; level++) {
+		if (delta < (1UL << (shift + TIMER_WHEEL_LEVEL_BITS)))
+			break;
+		shift += TIMER_WHEEL_LEVEL_BITS;
+	}
+	slot_insert(&(wheel->levels[level][(expires >> shift) & (TIMER_WHEEL_LEVEL_SIZE - 1)]), entry);
+}
+
+void timer_wheel_add(TimerWheel *wheel, TimerWheelEntry *entry, unsigned long expires) {
+	if (entry->pprev)
+		timer_wheel_remove(wheel, entry);
+
+	if (expires <= wheel->now) {
+		expires = wheel->now + 1;
+	} else if (expires - wheel->now > TIMER_WHEEL_MAX_DELAY) {
+		expires = wheel->now + TIMER_WHEEL_MAX_DELAY;
+	}
+	entry->expires = expires;
+	place(wheel, entry);
+	wheel->pending++;
+}
+
+void timer_wheel_remove(TimerWheel *wheel, TimerWheelEntry *entry) {
+	if (!entry->pprev)
+		return;
+	slot_unlink(entry);
+	wheel->pending--;
+}
+
+// Moves the entries of a higher level slot down to the levels below it
+static void cascade(TimerWheel *wheel, int level, int index) {
+	TimerWheelEntry *entry, *next;
+
+	entry = wheel->levels[level][index];
+	wheel->levels[level][index] = NULL;
+	while (entry) {
+		next = entry->next;
+		entry->next = NULL;
+		entry->pprev = NULL;
+		place(wheel, entry);
+		entry = next;
+	}
+}
+
+void timer_wheel_advance(TimerWheel *wheel, unsigned long now) {
+	TimerWheelEntry *entry;
+	TimerWheelEntry **slot;
+	unsigned long tick;
+	int level, shift, index;
+
+	while (wheel->now < now) {
+		if (wheel->pending == 0) {
+			// Nothing to fire, skip ahead
+			wheel->now = now;
+			break;
+		}
+
+		tick = ++(wheel->now);
+
+		// Entering a new round of a level: bring down the entries of the matching slot of the level above
+		if ((tick & (TIMER_WHEEL_LEVEL0_SIZE - 1)) == 0) {
+			shift = TIMER_WHEEL_LEVEL0_BITS;
+			for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+				index = (tick >> shift) & (TIMER_WHEEL_LEVEL_SIZE - 1);
+				cascade(wheel, level, index);
+				if (index != 0)
+					break;
+				shift += TIMER_WHEEL_LEVEL_BITS;
+			}
+		}
+
+		slot = &(wheel->level0[tick & (TIMER_WHEEL_LEVEL0_SIZE - 1)]);
+		while ((entry = *slot) != NULL) {
+			slot_unlink(entry);
+			wheel->pending--;
+			entry->callback(entry);
+		}
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef TIMERWHEEL_H_
+#define TIMERWHEEL_H_
+
+/*
+ * Hierarchical timer wheel with a resolution of 1 millisecond.
+ * Level 0 has a slot per millisecond for the next 256 ms, and each of the higher levels covers
+ * 64 times the range of the level below it (up to ~18.6 hours, longer timeouts are clamped).
+ * Adding and removing a timer is O(1). The wheel is not thread safe: it is meant to be driven
+ * by the thread that owns the timers (the capture loop).
+ */
+
+#define TIMER_WHEEL_LEVEL0_BITS 8
+#define TIMER_WHEEL_LEVEL_BITS 6
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_LEVEL0_SIZE (1 << TIMER_WHEEL_LEVEL0_BITS)
+#define TIMER_WHEEL_LEVEL_SIZE (1 << TIMER_WHEEL_LEVEL_BITS)
+#define TIMER_WHEEL_MAX_DELAY ((1UL << (TIMER_WHEEL_LEVEL0_BITS + (TIMER_WHEEL_LEVELS - 1) * TIMER_WHEEL_LEVEL_BITS)) - 1)
+
+struct tw_entry;
+
+typedef void (*TimerCallback)(struct tw_entry *entry);
+
+typedef struct tw_entry {
+	unsigned long expires; // In milliseconds
+	struct tw_entry *next;
+	struct tw_entry **pprev; // Points to the previous entry's next field (or to the slot). NULL if not pending.
+	TimerCallback callback;
+	void *data;
+} TimerWheelEntry;
+
+typedef struct {
+	unsigned long now; // Last processed tick
+	int pending;
+	TimerWheelEntry *level0[TIMER_WHEEL_LEVEL0_SIZE];
+	TimerWheelEntry *levels[TIMER_WHEEL_LEVELS - 1][TIMER_WHEEL_LEVEL_SIZE];
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel *wheel, unsigned long now);
+
+void timer_wheel_entry_init(TimerWheelEntry *entry, TimerCallback callback, void *data);
+
+// Schedules entry to fire at the given time (in milliseconds). Times in the past fire on the next tick.
+void timer_wheel_add(TimerWheel *wheel, TimerWheelEntry *entry, unsigned long expires);
+
+// Cancels entry if it is pending
+void timer_wheel_remove(TimerWheel *wheel, TimerWheelEntry *entry);
+
+// Fires all timers that expire up to now (in milliseconds). Callbacks may add and remove timers.
+void timer_wheel_advance(TimerWheel *wheel, unsigned long now);
+
+#endif /* TIMERWHEEL_H_ */
@@ -6,28 +6,43 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <stdio.h>
+#include <sys/time.h>
 #include "../Common/Flags.h"
 #include "ACBuilder.h"
 #include "NodeQueue.h"
 #include "../Common/json.h"
+#include "../Common/Timer.h"
 
 #define READ_BUFFER_SIZE 1024
-#define MAX_STATES 65536
 #define MAX_PATTERN_LENGTH 1024
 
 Node *createNewNode(ACTree *tree, Node *parent) {
-	Node *node = (Node*)malloc(sizeof(Node));
-	node->id = tree->size++;
-	node->gotos = hashmap_create();
-	if (node->gotos == NULL) {
-		fprintf(stderr, "ERROR: Cannot create new hashmap\n");
-		exit(1);
+	Node *node;
+
+	if ((tree->size >> NODE_BLOCK_BITS) >= tree->numBlocks) {
+		tree->blocks = (Node**)realloc(tree->blocks, sizeof(Node*) * (tree->numBlocks + 1));
+		if (tree->blocks == NULL) {
+			fprintf(stderr, "FATAL: Out of memory\n");
+			exit(1);
+		}
+		tree->blocks[tree->numBlocks] = (Node*)malloc(sizeof(Node) * NODE_BLOCK_SIZE);
+		if (tree->blocks[tree->numBlocks] == NULL) {
+			fprintf(stderr, "FATAL: Out of memory\n");
+			exit(1);
+		}
+		tree->numBlocks++;
 	}
+	node = AC_GET_NODE(tree, tree->size);
+	node->id = tree->size++;
+	node->gotos = NULL;
+	node->gotosCapacity = 0;
 	node->failure = NULL;
 	node->numGotos = 0;
 	node->match = 0;
+	node->rules = NULL;
 	node->numRules = 0;
 	node->hasFailInto = 0;
 	if (parent != NULL) {
@@ -35,101 +50,161 @@ Node *createNewNode(ACTree *tree, Node *parent) {
 	} else {
 		node->depth = 0;
 	}
-	node->isFirstLevelNode = 0;
-	node->isSecondLevelNode = 0;
-	node->c1 = 0;
-	node->c2 = 0;
 	node->marked = 0;
-	memset(node->rules, 0, sizeof(MatchRule) * MAX_RULES_PER_STATE);
 	return node;
 }
 
-Pair *createNewPair(char c, Node *node) {
-	Pair *p = (Pair*)malloc(sizeof(Pair));
-	p->c = c;
-	p->ptr = node;
-	return p;
+// Returns the index of the first goto of node whose character is not less than c
+static inline int findGotoIndex(Node *node, unsigned char c) {
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = node->numGotos;
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		if ((unsigned char)node->gotos[mid].c < c) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static void addGoto(Node *node, char c, Node *next) {
+	Pair *gotos;
+	int idx;
+
+	if (node->numGotos == node->gotosCapacity) {
+		if (node->gotosCapacity == 0) {
+			// Most nodes have a single child
+			gotos = &(node->firstGoto);
+			node->gotosCapacity = 1;
+		} else {
+			gotos = (Pair*)malloc(sizeof(Pair) * node->gotosCapacity * 2);
+			if (gotos == NULL) {
+				fprintf(stderr, "FATAL: Out of memory\n");
+				exit(1);
+			}
+			memcpy(gotos, node->gotos, sizeof(Pair) * node->numGotos);
+			if (node->gotos != &(node->firstGoto)) {
+				free(node->gotos);
+			}
+			node->gotosCapacity *= 2;
+		}
+		node->gotos = gotos;
+	}
+
+	idx = findGotoIndex(node, (unsigned char)c);
+	memmove(&(node->gotos[idx + 1]), &(node->gotos[idx]), sizeof(Pair) * (node->numGotos - idx));
+	node->gotos[idx].c = c;
+	node->gotos[idx].ptr = next;
+	node->numGotos++;
 }
 
 Node *acGetNextNode(Node *node, char c) {
-	Pair *pair;
-	pair = (Pair*)(hashmap_get(node->gotos, (int)c));
-	if (pair == NULL)
-		return NULL;
-	return pair->ptr;
+	int idx;
+
+	idx = findGotoIndex(node, (unsigned char)c);
+	if (idx < node->numGotos && node->gotos[idx].c == c)
+		return node->gotos[idx].ptr;
+	return NULL;
 }
 
-void enter(ACTree *tree, MatchRule *rule) {
+// Adds the pattern of rule to the tree and returns its accepting node. The rule itself is placed
+// in the rule list of the node later on (see placeRules).
+Node *enter(ACTree *tree, MatchRule *rule) {
 	Node *state = tree->root;
 	int j = 0, p;
 	Node *next, *newState;
 	char *pattern;
 	int len;
-	MatchRule *ruleCpy;
 
 	pattern = rule->pattern;
 	len = rule->len;
 
-	while ((next = acGetNextNode(state, pattern[j])) != NULL && j < len) {
+	while (j < len && (next = acGetNextNode(state, pattern[j])) != NULL) {
 		state = next;
 		j++;
 	}
 
 	for (p = j; p < len; p++) {
 		newState = createNewNode(tree, state);
-		Pair *pair = createNewPair(pattern[p], newState);
-		hashmap_put(state->gotos, pattern[p], pair);
-		state->numGotos++;
+		addGoto(state, pattern[p], newState);
 		state = newState;
 	}
 
 	// Match
 	state->match = 1;
+	state->numRules++;
 
-	if (state->numRules >= MAX_RULES_PER_STATE) {
-		fprintf(stderr, "[ACBuilder] Too many rules for a single state: %d\n", state->id);
+	return state;
+}
+
+// Groups the rules by their accepting node (keeping the file order within each node)
+static void placeRules(ACTree *tree, MatchRule *rules, int *ruleIdx, int *ruleState, int count) {
+	Node *node;
+	int i, offset;
+
+	tree->rules = (MatchRule*)malloc(sizeof(MatchRule) * (count + 1));
+	if (tree->rules == NULL) {
+		fprintf(stderr, "FATAL: Out of memory\n");
 		exit(1);
 	}
-	ruleCpy = &(state->rules[state->numRules]);
-	state->numRules++;
-	ruleCpy->pattern = (char*)malloc(sizeof(char) * (len + 1));
-	memcpy(ruleCpy->pattern, pattern, sizeof(char) * len);
-	ruleCpy->is_regex = 0;
-	ruleCpy->len = len;
-	ruleCpy->rid = rule->rid;
+
+	offset = 0;
+	for (i = 0; i < tree->size; i++) {
+		node = AC_GET_NODE(tree, i);
+		if (node->numRules > 0) {
+			node->rules = &(tree->rules[offset]);
+			offset += node->numRules;
+			node->numRules = 0;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		node = AC_GET_NODE(tree, ruleState[i]);
+		node->rules[node->numRules] = rules[ruleIdx[i]];
+		node->rules[node->numRules].is_regex = 0;
+		node->numRules++;
+	}
 }
 
 void constructFailures(ACTree *tree) {
-	NodeQueue q;
+	Node **queue;
 	Node *root, *state, *r, *s;
 	Pair *pair;
-	HashMap *map;
 	char a;
+	int i, head, tail;
 	int toL0, toL1, toL2;
 
 	toL0 = toL1 = toL2 = 0;
 
-	nodequeue_init(&q);
+	// Every node is enqueued exactly once
+	queue = (Node**)malloc(sizeof(Node*) * tree->size);
+	if (queue == NULL) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
+	head = tail = 0;
 
 	root = tree->root;
 	root->failure = root;
 
-	map = root->gotos;
-	hashmap_iterator_reset(map);
-	while ((pair = hashmap_iterator_next(map)) != NULL) {
-		nodequeue_enqueue(&q, pair->ptr);
+	for (i = 0; i < root->numGotos; i++) {
+		pair = &(root->gotos[i]);
+		queue[tail++] = pair->ptr;
 		pair->ptr->failure = root;
 		toL0++;
 	}
 
-	while (!nodequeue_isempty(&q)) {
-		r = nodequeue_dequeue(&q);
-		map = r->gotos;
-		hashmap_iterator_reset(map);
-		while ((pair = hashmap_iterator_next(map)) != NULL) {
+	while (head < tail) {
+		r = queue[head++];
+		for (i = 0; i < r->numGotos; i++) {
+			pair = &(r->gotos[i]);
 			a = pair->c;
 			s = pair->ptr;
-			nodequeue_enqueue(&q, s);
+			queue[tail++] = s;
 			if (r->failure == NULL)
 				r->failure = root;
 			state = r->failure;
@@ -153,41 +228,32 @@ void constructFailures(ACTree *tree) {
 		}
 	}
 
-	nodequeue_destroy_elements(&q, 1);
-}
-
-void findFails(Node *node, int *l0, int *l1, int *l2) {
-	Pair *pair;
-
-	if (node->failure->depth == 1)
-		(*l1)++;
-	else if (node->failure->depth == 2)
-		(*l2)++;
-	else if (node->failure->depth == 0)
-		(*l0)++;
-
-	hashmap_iterator_reset(node->gotos);
-	while ((pair = hashmap_iterator_next(node->gotos))) {
-		findFails(pair->ptr, l0, l1, l2);
-	}
+	free(queue);
 }
 
 void getL2nums(ACTree *tree) {
 	Node *root = tree->root;
-	Pair *pair;
-	int l0, l1, l2;
+	Node *node;
+	int i, l0, l1, l2;
 
 	l1 = root->numGotos;
 	l2 = 0;
 
-	hashmap_iterator_reset(root->gotos);
-	while ((pair = hashmap_iterator_next(root->gotos))) {
-		l2 += pair->ptr->numGotos;
+	for (i = 0; i < root->numGotos; i++) {
+		l2 += root->gotos[i].ptr->numGotos;
 	}
 
 	l0 = l1 = l2 = 0;
 
-	findFails(root, &l0, &l1, &l2);
+	for (i = 1; i < tree->size; i++) {
+		node = AC_GET_NODE(tree, i);
+		if (node->failure->depth == 1)
+			l1++;
+		else if (node->failure->depth == 2)
+			l2++;
+		else if (node->failure->depth == 0)
+			l0++;
+	}
 }
 
 void printPair(void *data) {
@@ -203,7 +269,12 @@ void printPair(void *data) {
 void printNode(Node *node) {
 	int i, j, val;
 	printf("Node ID: %d, Depth: %d, Gotos: ", node->id, node->depth);
-	hashmap_print(node->gotos, &printPair);
+	for (i = 0; i < node->numGotos; i++) {
+		if (i > 0) {
+			printf(", ");
+		}
+		printPair(&(node->gotos[i]));
+	}
 	printf(", Failure: %d, Match: %d", node->failure->id, node->match);
 	if (node->match) {
 		printf(" (messages: ");//, node->message);
@@ -234,7 +305,6 @@ void printNode(Node *node) {
 void acPrintTree(ACTree *tree) {
 	NodeQueue queue;
 	Node *node;
-	Pair *pair;
 	int i;
 
 	nodequeue_init(&queue);
@@ -250,24 +320,27 @@ void acPrintTree(ACTree *tree) {
 		}
 		printNode(node);
 
-		hashmap_iterator_reset(node->gotos);
-		while ((pair = hashmap_iterator_next(node->gotos)) != NULL) {
-			nodequeue_enqueue(&queue, pair->ptr);
+		for (i = 0; i < node->numGotos; i++) {
+			nodequeue_enqueue(&queue, node->gotos[i].ptr);
 		}
 	}
 
 	nodequeue_destroy_elements(&queue, 1);
 }
 
+#define HEX_VAL(c) \
+	(((c) >= '0' && (c) <= '9') ? ((c) - '0') : \
+	 ((c) >= 'a' && (c) <= 'f') ? ((c) - 'a' + 10) : \
+	 ((c) >= 'A' && (c) <= 'F') ? ((c) - 'A' + 10) : -1)
+
+// Converts |XX| hex escapes to bytes. A '|' that does not start a complete escape is taken literally.
+// bin may be the same buffer as pattern.
 int pattern_to_bin(char *pattern, int len, char *bin) {
-	int i, j;
-	char hex[3];
-	hex[2] = '\0';
-	for (i = 0, j = 0; i < len && pattern[i] != '\0'; i++) {
-		if (pattern[i] == '|') {
-			hex[0] = pattern[i+1];
-			hex[1] = pattern[i+2];
-			bin[j] = (char)strtol(hex, NULL, 16);
+	int i, j, hi, lo;
+	for (i = 0, j = 0; i < len; i++) {
+		if (pattern[i] == '|' && i + 3 < len && pattern[i+3] == '|' &&
+				(hi = HEX_VAL(pattern[i+1])) >= 0 && (lo = HEX_VAL(pattern[i+2])) >= 0) {
+			bin[j] = (char)((hi << 4) | lo);
 			i += 3;
 			j++;
 		} else {
@@ -278,116 +351,219 @@ int pattern_to_bin(char *pattern, int len, char *bin) {
 	return j;
 }
 
-void *match_rule_parser(char ***pairs, int numPairs, void *result) {
+static unsigned int parse_uint(json_token *value) {
+	unsigned int n;
 	int i;
-	MatchRule *rule;
-	int pat_len;
-	char pattern[MAX_PATTERN_LENGTH];
 
-	rule = (MatchRule*)result;
+	n = 0;
+	for (i = 0; i < value->len && value->start[i] >= '0' && value->start[i] <= '9'; i++) {
+		n = n * 10 + (value->start[i] - '0');
+	}
+	return n;
+}
+
+// Parses the fields of the current JSON object into rule. The binary pattern is written to arena.
+// Returns the number of arena bytes used, or -1 if the object is not a match rule.
+static int parse_match_rule(json_file *f, MatchRule *rule, char *arena) {
+	json_token key, value;
+	int res, len;
+
 	rule->is_regex = 0;
 	rule->len = -1;
 	rule->rid = 0;
+	rule->offset = 0;
+	rule->depth = 0;
 	rule->pattern = NULL;
+	len = 0;
 
-	for (i = 0; i < numPairs; i++) {
-		if (strcmp(pairs[i][0], "className") == 0) {
-			if (strcmp(pairs[i][1], "\"MatchRule\"") != 0 && strcmp(pairs[i][1], "'MatchRule'") != 0) {
-				fprintf(stderr, "[ACBuilder] Invalid JSON object class: %s.\n", pairs[i][1]);
-				exit(1);
+	while ((res = json_next_field(f, &key, &value)) > 0) {
+		switch (key.len) {
+		case 3:
+			if (json_token_equals(&key, "rid", 3)) {
+				rule->rid = parse_uint(&value);
 			}
-		} else if (strcmp(pairs[i][0], "pattern") == 0) {
-			pat_len = strlen(pairs[i][1]);
-			rule->len = pattern_to_bin(&(pairs[i][1][1]), pat_len - 2, pattern);
-			rule->pattern = (char*)malloc(sizeof(char) * rule->len);
-			memcpy(rule->pattern, pattern, sizeof(char) * rule->len);
-		} else if (strcmp(pairs[i][0], "is_regex") == 0) {
-			if (strcmp(pairs[i][1], "true") == 0) {
-				rule->is_regex = 1;
+			break;
+		case 5:
+			if (json_token_equals(&key, "depth", 5)) {
+				rule->depth = (unsigned short)parse_uint(&value);
 			}
-		} else if (strcmp(pairs[i][0], "rid") == 0) {
-			rule->rid = (unsigned int)atoi(pairs[i][1]);
-		} else {
+			break;
+		case 6:
+			if (json_token_equals(&key, "offset", 6)) {
+				rule->offset = (unsigned short)parse_uint(&value);
+			}
+			break;
+		case 7:
+			if (json_token_equals(&key, "pattern", 7) && value.type == JSON_STRING) {
+				// Both steps only shrink the data, so they are done in place
+				len = json_decode_string(&value, arena);
+				len = pattern_to_bin(arena, len, arena);
+				rule->pattern = arena;
+				rule->len = len;
+			}
+			break;
+		case 8:
+			if (json_token_equals(&key, "is_regex", 8)) {
+				rule->is_regex = (value.type == JSON_TRUE);
+			}
+			break;
+		case 9:
+			if (json_token_equals(&key, "className", 9) &&
+					!(value.type == JSON_STRING && json_token_equals(&value, "MatchRule", 9))) {
+				fprintf(stderr, "[ACBuilder] Invalid JSON object class: %.*s.\n", value.len, value.start);
+				exit(1);
+			}
+			break;
+		default:
 			// Ignore other fields
+			break;
 		}
 	}
+	if (res < 0) {
+		exit(res);
+	}
 
-	return result + sizeof(MatchRule);
+	return (rule->pattern != NULL) ? len : -1;
 }
 
-#define MAX_RULES_FOR_DFA 65536
-#define MAX_RULES 65536
+// Loads all match rules from a JSON file into a single preallocated arena
+static int load_match_rules(const char *path, MatchRuleSet *set) {
+	json_file f;
+	int maxRules, len;
+	MatchRule *rule;
+	char *arena;
+
+	set->rules = NULL;
+	set->patterns = NULL;
+	set->numRules = 0;
+
+	if (json_open(&f, path) < 0) {
+		return -1;
+	}
+
+	// Neither the object count nor the decoded pattern bytes can exceed what is in the file
+	maxRules = json_count_objects(&f);
+	set->rules = (MatchRule*)malloc(sizeof(MatchRule) * (maxRules + 1));
+	set->patterns = (char*)malloc(sizeof(char) * (f.size + 1));
+	if (!set->rules || !set->patterns) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
+
+	arena = set->patterns;
+	while (json_next_object(&f)) {
+		rule = &(set->rules[set->numRules]);
+		len = parse_match_rule(&f, rule, arena);
+		if (len < 0) {
+			continue;
+		}
+		arena += len;
+		set->numRules++;
+	}
+
+	json_close(&f);
+	return set->numRules;
+}
+
+static void free_match_rules(MatchRuleSet *set) {
+	free(set->rules);
+	free(set->patterns);
+}
 
 int acBuildTree(ACTree *tree, const char *path, int max_rules) {
-	MatchRule rules[MAX_RULES];
+	MatchRuleSet set;
+	MatchRule *rules;
+	Node *state;
+	int *ruleIdx, *ruleState;
 	int i, count, numRules;
+	Timer timer;
 
-	json_parser parser = match_rule_parser;
-
-	numRules = parse_json_file(path, parser, rules);
+	tree->root = NULL;
+	tree->size = 0;
+	tree->blocks = NULL;
+	tree->numBlocks = 0;
+	tree->rules = NULL;
+	tree->patterns = NULL;
+
+	startTiming(&timer);
+	numRules = load_match_rules(path, &set);
+	endTiming(&timer);
 	if (numRules < 0) {
 		// Error
 		exit(numRules);
 	} else if (numRules == 0) {
 		// No rules
+		free_match_rules(&set);
 		return 0;
 	}
+	rules = set.rules;
+
+	ruleIdx = (int*)malloc(sizeof(int) * numRules);
+	ruleState = (int*)malloc(sizeof(int) * numRules);
+	if (!ruleIdx || !ruleState) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
 
-	tree->size = 0;
 	count = 0;
 	i = 0;
 	tree->root = createNewNode(tree, NULL);
 
-	while (i < numRules && (MAX_RULES_FOR_DFA <= 0 || count < MAX_RULES_FOR_DFA) && (max_rules <= 0 || count < max_rules)) {
+	while (i < numRules && (max_rules <= 0 || count < max_rules)) {
 		if (rules[i].len < MIN_PATTERN_LENGTH) {
 			i++;
 			continue;
 		}
-		enter(tree, &(rules[i]));
+		state = enter(tree, &(rules[i]));
+		ruleIdx[count] = i;
+		ruleState[count] = state->id;
 		i++;
 		count++;
 	}
 
+	placeRules(tree, rules, ruleIdx, ruleState, count);
+	free(ruleIdx);
+	free(ruleState);
+
 	constructFailures(tree);
 
 	getL2nums(tree);
 
-	for (i = 0; i < numRules; i++) {
-		if (rules[i].pattern) {
-			free(rules[i].pattern);
-		}
-	}
+	// The rules now refer to the patterns arena, which is kept until the tree is destroyed
+	tree->patterns = set.patterns;
+	free(set.rules);
 
 	printf("+---------- AC DFA Info ----------+\n");
 	printf("| Total rules: %18d |\n", count);
 	printf("| Total states: %17d |\n", tree->size);
-	printf("| Total bytes: %18d |\n", tree->size * 4 * 256);
+	printf("| Total bytes: %18lu |\n", (unsigned long)tree->size * 4 * 256);
+	printf("| Rules load time (us): %9lu |\n", timer.micros);
+	printf("| Rules loaded/sec: %13.0f |\n", (timer.micros > 0) ? numRules * 1000000.0 / timer.micros : 0.0);
 	printf("+---------------------------------+\n");
 
 	return count;
 }
 
-void acDestroyNodesRecursive(Node *node) {
-	Pair *pair;
-	Node *child;
-	HashMap *map = node->gotos;
-	hashmap_iterator_reset(map);
+void acDestroyTreeNodes(ACTree *tree) {
+	Node *node;
 	int i;
 
-	while ((pair = (Pair*)hashmap_iterator_next(map)) != NULL) {
-		child = pair->ptr;
-		acDestroyNodesRecursive(child);
-		free(pair);
-	}
-	hashmap_destroy(map);
-	for (i = 0; i < MAX_RULES_PER_STATE; i++) {
-		if (node->rules[i].pattern) {
-			free(node->rules[i].pattern);
+	for (i = 0; i < tree->size; i++) {
+		node = AC_GET_NODE(tree, i);
+		if (node->gotosCapacity > 1) {
+			free(node->gotos);
 		}
 	}
-	free(node);
-}
-
-void acDestroyTreeNodes(ACTree *tree) {
-	acDestroyNodesRecursive(tree->root);
+	for (i = 0; i < tree->numBlocks; i++) {
+		free(tree->blocks[i]);
+	}
+	free(tree->blocks);
+	free(tree->rules);
+	free(tree->patterns);
+	tree->blocks = NULL;
+	tree->numBlocks = 0;
+	tree->rules = NULL;
+	tree->patterns = NULL;
+	tree->root = NULL;
+	tree->size = 0;
 }
@@ -11,7 +11,9 @@
 #include "../Common/HashMap/HashMap.h"
 #include "../Common/MatchRule.h"
 
-#define MAX_RULES_PER_STATE 64
+// Nodes are allocated in blocks of NODE_BLOCK_SIZE, so node IDs map directly to their storage
+#define NODE_BLOCK_BITS 16
+#define NODE_BLOCK_SIZE (1 << NODE_BLOCK_BITS)
 
 struct st_node;
 
@@ -23,16 +25,15 @@ typedef struct {
 typedef struct st_node {
 	int id;
 	int numGotos;
+	int gotosCapacity;
 	int match;
-	MatchRule rules[MAX_RULES_PER_STATE];
+	MatchRule *rules; // Points into the rule list of the tree
 	int numRules;
-	HashMap *gotos;
+	Pair *gotos; // Sorted by (unsigned) character
+	Pair firstGoto; // Inline storage for the goto of single-child nodes
 	struct st_node *failure;
 	int hasFailInto; // TRUE if some other node fails into this node
 	int depth;
-	char c1, c2;
-	int isFirstLevelNode;
-	int isSecondLevelNode;
 	int marked;
 } Node;
 
@@ -46,9 +47,16 @@ typedef struct {
 typedef struct {
 	Node *root;
 	int size;
+	Node **blocks; // Node storage (see NODE_BLOCK_SIZE)
+	int numBlocks;
+	MatchRule *rules; // Rules of all nodes, grouped by node
+	char *patterns; // Binary patterns of the rules
 #ifdef PCRE
 	HashMap *state_pcre_map;
 #endif
 } ACTree;
 
+#define AC_GET_NODE(tree, id) \
+	(&((tree)->blocks[(id) >> NODE_BLOCK_BITS][(id) & (NODE_BLOCK_SIZE - 1)]))
+
 #endif /* ACTYPES_H_ */
@@ -0,0 +1,152 @@
+/*
+ * BuildBenchmark.c
+ *
+ * Measures rule loading and automaton construction on synthetic rule sets.
+ * Generates a rules file of random binary patterns (in the rule-converter format) and reports
+ * the build time and peak memory of the Aho-Corasick trie and, optionally, of the full DFA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "../AhoCorasick/ACBuilder.h"
+#include "../StateMachine/TableStateMachineGenerator.h"
+#include "../Sniffer/RuleId.h"
+#include "../Common/Timer.h"
+
+#define USAGE "Usage: %s [rules=<#>] [minlen=<#>] [maxlen=<#>] [alphabet=<#>] [seed=<#>] [file=<path>] [keep] [dfa] [threads=<#>] [fulldepth=<#>]\n\trules=<#>\tNumber of synthetic patterns (default: 1000000)\n\tminlen=<#>\tMinimal pattern length (default: 8)\n\tmaxlen=<#>\tMaximal pattern length (default: 16)\n\talphabet=<#>\tNumber of distinct pattern bytes (default: 256)\n\tseed=<#>\tRandom seed (default: 1)\n\tfile=<path>\tRules file to generate (default: a temporary file)\n\tkeep\t\tDo not delete the generated rules file\n\tdfa\t\tAlso build the full table DFA (requires 1KB per full row state)\n\tthreads=<#>\tNumber of threads for building the DFA (default: 1)\n\tfulldepth=<#>\tUse sparse DFA rows from this depth on (default: 0, all full)\n"
+
+#define DEFAULT_NUM_RULES 1000000
+#define DEFAULT_MIN_LEN 8
+#define DEFAULT_MAX_LEN 16
+
+static long get_peak_rss_kb() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+// Writes num_rules random patterns with rule IDs 1..num_rules (so large sets need 32 bit rule IDs)
+static int generate_rules(const char *path, int num_rules, int min_len, int max_len, int alphabet, unsigned int seed) {
+	FILE *f;
+	int i, j, len;
+
+	f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "[Benchmark] ERROR: Cannot create rules file: %s\n", path);
+		return -1;
+	}
+	srand(seed);
+	for (i = 0; i < num_rules; i++) {
+		len = min_len + rand() % (max_len - min_len + 1);
+		fprintf(f, "{ className: 'MatchRule', rid: %d, pattern: '", i + 1);
+		for (j = 0; j < len; j++) {
+			fprintf(f, "|%02x|", rand() % alphabet);
+		}
+		fprintf(f, "', is_regex: false }\n");
+	}
+	fclose(f);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	char path[256];
+	char *file = NULL;
+	char *param, *arg;
+	int num_rules, min_len, max_len, alphabet, keep, dfa, threads, full_depth, count, i, fd;
+	unsigned int seed;
+	ACTree tree;
+	TableStateMachine *machine;
+	Timer timer;
+
+	num_rules = DEFAULT_NUM_RULES;
+	min_len = DEFAULT_MIN_LEN;
+	max_len = DEFAULT_MAX_LEN;
+	alphabet = 256;
+	seed = 1;
+	keep = 0;
+	dfa = 0;
+	threads = 1;
+	full_depth = 0;
+
+	for (i = 1; i < argc; i++) {
+		param = strsep(&argv[i], "=");
+		arg = argv[i];
+		if (strcmp(param, "rules") == 0 && arg) {
+			num_rules = atoi(arg);
+		} else if (strcmp(param, "minlen") == 0 && arg) {
+			min_len = atoi(arg);
+		} else if (strcmp(param, "maxlen") == 0 && arg) {
+			max_len = atoi(arg);
+		} else if (strcmp(param, "alphabet") == 0 && arg) {
+			alphabet = atoi(arg);
+		} else if (strcmp(param, "seed") == 0 && arg) {
+			seed = (unsigned int)atoi(arg);
+		} else if (strcmp(param, "file") == 0 && arg) {
+			file = arg;
+		} else if (strcmp(param, "keep") == 0) {
+			keep = 1;
+		} else if (strcmp(param, "dfa") == 0) {
+			dfa = 1;
+		} else if (strcmp(param, "threads") == 0 && arg) {
+			threads = atoi(arg);
+		} else if (strcmp(param, "fulldepth") == 0 && arg) {
+			full_depth = atoi(arg);
+		} else {
+			fprintf(stderr, "Unknown parameter: %s\n", param);
+			fprintf(stderr, USAGE, argv[0]);
+			exit(1);
+		}
+	}
+
+	if (num_rules < 1 || min_len < 1 || max_len < min_len || max_len > MAX_PATTERN_LENGTH || alphabet < 1 || alphabet > 256 || threads < 1 || full_depth < 0) {
+		fprintf(stderr, USAGE, argv[0]);
+		exit(1);
+	}
+
+	if (!file) {
+		strcpy(path, "/tmp/moly-bench-rules-XXXXXX");
+		fd = mkstemp(path);
+		if (fd < 0) {
+			fprintf(stderr, "[Benchmark] ERROR: Cannot create temporary file\n");
+			exit(1);
+		}
+		close(fd);
+		file = path;
+	}
+
+	printf("[Benchmark] Generating %d patterns of length %d-%d to %s\n", num_rules, min_len, max_len, file);
+	if (generate_rules(file, num_rules, min_len, max_len, alphabet, seed) < 0) {
+		exit(1);
+	}
+
+	// Trie only (rules load, goto and failure construction)
+	startTiming(&timer);
+	count = acBuildTree(&tree, file, 0);
+	acDestroyTreeNodes(&tree);
+	endTiming(&timer);
+	printf("[Benchmark] Trie build time (ms): %lu\n", timer.micros / 1000);
+	printf("[Benchmark] Peak RSS after trie (KB): %ld\n", get_peak_rss_kb());
+
+	if (dfa) {
+		startTiming(&timer);
+		machine = generateTableStateMachine(file, 0, threads, full_depth, 0);
+		endTiming(&timer);
+		printf("[Benchmark] DFA build time (ms, %d threads): %lu\n", threads, timer.micros / 1000);
+		printf("[Benchmark] DFA states: %u\n", machine->numStates);
+		printf("[Benchmark] Rule ID width: %d\n", (machine->max_rid > RULE_ID_MAX_16) ? RULE_ID_SIZE_32 : RULE_ID_SIZE_16);
+		printf("[Benchmark] Peak RSS after DFA (KB): %ld\n", get_peak_rss_kb());
+		destroyTableStateMachine(machine);
+	}
+
+	printf("[Benchmark] Rules used: %d\n", count);
+
+	if (!keep) {
+		unlink(file);
+	}
+
+	return 0;
+}
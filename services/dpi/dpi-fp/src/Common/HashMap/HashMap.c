@@ -49,11 +49,11 @@ void hashmap_put(HashMap *map, int key, void *value) {
 }
 
 int hashmap_remove(HashMap *map, int key) {
-	HashObject *hm = map->map;
 	HashObject *obj = NULL;
-	HASH_FIND_INT(hm, &key, obj);
+	HASH_FIND_INT(map->map, &key, obj);
 	if (obj != NULL) {
-		HASH_DEL(hm, obj);
+		// (on the map itself, which changes if obj is its head)
+		HASH_DEL(map->map, obj);
 		free(obj);
 		return 1;
 	}
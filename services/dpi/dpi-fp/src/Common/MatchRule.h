@@ -15,6 +15,16 @@ typedef struct {
 	int len;
 	int is_regex;
 	unsigned int rid;
+	// Where Snort looks for the pattern: it starts at offset or later and ends within depth bytes
+	// of offset (depth 0: anywhere after offset). Matches elsewhere are not reported.
+	unsigned short offset;
+	unsigned short depth;
 } MatchRule;
 
+typedef struct {
+	MatchRule *rules;
+	int numRules;
+	char *patterns; // Arena holding the binary patterns of all rules
+} MatchRuleSet;
+
 #endif /* MATCHRULE_H_ */
@@ -0,0 +1,39 @@
+#ifndef COMMON_RULEEXPORT_H_
+#define COMMON_RULEEXPORT_H_
+
+#include <stdint.h>
+
+/*
+ * Binary rule export stream (sent by Snort in its 'socket' export mode, see snort.h there).
+ * A stream of records: a header followed by len bytes, all integers in network order.
+ * Every export is a transaction: BEGIN, then the REMOVE/ADD records of the rules that changed since
+ * the previous one, then COMMIT. A BEGIN with RULE_EXPORT_FLAG_RESET (the first export on a
+ * connection) starts from an empty rule set.
+ */
+
+#define RULE_EXPORT_RECORD_BEGIN 1 // rid: generation. Payload: RULE_EXPORT_MAGIC, RULE_EXPORT_VERSION
+#define RULE_EXPORT_RECORD_ADD 2 // rid: rule ID. Payload: [RuleExportPosition,] the pattern (in Snort content syntax)
+#define RULE_EXPORT_RECORD_REMOVE 3 // rid: rule ID
+#define RULE_EXPORT_RECORD_COMMIT 4 // rid: generation
+
+#define RULE_EXPORT_FLAG_RESET 0x01 // BEGIN
+#define RULE_EXPORT_FLAG_REGEX 0x02 // ADD
+#define RULE_EXPORT_FLAG_POSITION 0x04 // ADD: the payload starts with a RuleExportPosition
+
+#define RULE_EXPORT_MAGIC "MRX"
+#define RULE_EXPORT_VERSION 2
+
+typedef struct {
+	uint8_t type;
+	uint8_t flags;
+	uint16_t len;
+	uint32_t rid;
+} RuleExportRecordHdr;
+
+// Where Snort looks for the pattern of a rule in the packet data (see MatchRule)
+typedef struct {
+	uint16_t offset;
+	uint16_t depth;
+} RuleExportPosition;
+
+#endif /* COMMON_RULEEXPORT_H_ */
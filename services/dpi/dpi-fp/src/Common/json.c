@@ -8,157 +8,267 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "json.h"
 
-#define MAX_JSON_OBJECT_LEN 4096
-#define MAX_FIELDS_IN_OBJECT 20
+#define IS_SPACE(c) \
+	((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
 
-int parse_single_object(char *data, int len, void *result, json_parser parser, void **nextresult) {
-	int i, j, level, start, end, inquote, pair_start, pair, eqsign, spsign;
-	char quote_type;
-	char ***pairs; //[MAX_FIELDS_IN_OBJECT][2][MAX_JSON_OBJECT_LEN];
+#define HEX_VAL(c) \
+	(((c) >= '0' && (c) <= '9') ? ((c) - '0') : \
+	 ((c) >= 'a' && (c) <= 'f') ? ((c) - 'a' + 10) : \
+	 ((c) >= 'A' && (c) <= 'F') ? ((c) - 'A' + 10) : -1)
 
-	pairs = (char***)malloc(sizeof(char**) * MAX_FIELDS_IN_OBJECT);
-	for (i = 0; i < MAX_FIELDS_IN_OBJECT; i++) {
-		pairs[i] = (char**)malloc(sizeof(char*) * 2);
+int json_open(json_file *f, const char *path) {
+	struct stat st;
+	void *data;
+	int fd;
+
+	f->data = f->pos = f->end = NULL;
+	f->size = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "[JSON] ERROR: Cannot open JSON file: %s\n", path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "[JSON] ERROR: Cannot stat JSON file: %s\n", path);
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
 	}
 
-	pair_start = -1;
-	start = end = -1;
-	inquote = 0;
-	level = 0;
-	pair = 0;
-
-	for (i = 0; i < len; i++) {
-		if (!inquote && data[i] == '{') {
-			level++;
-			if (level == 1)
-				start = i;
-			continue;
-		} else if (!inquote && data[i] == '}') {
-			level--;
-			if (level == 0) {
-				end = i;
-			} else if (level < 0) {
-				fprintf(stderr, "[JSON] ERROR: Invalid JSON data.\n");
-				return -2;
-			}
-		} else if (!inquote && (data[i] == '"' || data[i] == '\'')) {
-			inquote = 1;
-			quote_type = data[i];
-			continue;
-		} else if (inquote && data[i] == quote_type) {
-			inquote = 0;
-			continue;
-		} else if (data[i] == ' ' || data[i] == '\t' || data[i] == '\n' || data[i] == '\r') {
-			continue;
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "[JSON] ERROR: Cannot map JSON file: %s\n", path);
+		return -1;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	f->data = f->pos = (const char*)data;
+	f->size = st.st_size;
+	f->end = f->data + f->size;
+	return 0;
+}
+
+void json_close(json_file *f) {
+	if (f->data) {
+		munmap((void*)f->data, f->size);
+	}
+	f->data = f->pos = f->end = NULL;
+	f->size = 0;
+}
+
+int json_count_objects(json_file *f) {
+	const char *p, *end;
+	int count;
+
+	count = 0;
+	p = f->data;
+	end = f->end;
+	while (p && (p = memchr(p, '{', end - p)) != NULL) {
+		count++;
+		p++;
+	}
+	return count;
+}
+
+// Returns a pointer to the closing quote of the string starting at p (just after the opening quote).
+// Single-quoted strings are the legacy rule file format (see rule-converter.js): their contents are
+// taken literally, as quotes are always hex-encoded there and backslashes are pattern bytes.
+static inline const char *skip_string(const char *p, const char *end, char quote, int *escaped) {
+	if (quote == '\'') {
+		p = memchr(p, quote, end - p);
+		return p;
+	}
+	while (p < end) {
+		if (*p == quote) {
+			return p;
+		} else if (*p == '\\') {
+			*escaped = 1;
+			p++;
 		}
-		if (inquote) {
-			continue;
-		} else if (pair_start == -1) {
-			pair_start = i;
-			continue;
-		} else if (data[i] == ',' || end != -1) {
-			if (pair == MAX_FIELDS_IN_OBJECT) {
-				fprintf(stderr, "[JSON] ERROR: Too many fields in a single object. Recompile JSON with higher value for MAX_FIELDS_IN_OBJECT (current: %d).\n", MAX_FIELDS_IN_OBJECT);
-				return -3;
-			}
-			eqsign = -1;
-			spsign = -1;
-			for (j = pair_start; j < i; j++) {
-				if (data[j] == ':') {
-					eqsign = j;
-					break;
-				} else if (data[j] == ' ' || data[j] == '\t' || data[j] == '\n' || data[j] == '\r') {
-					spsign = j;
-				} else if (data[j] == '"' || data[j] == '\'') {
-					break;
-				}
-			}
-			if (eqsign == -1) {
-				fprintf(stderr, "[JSON] ERROR: Invalid JSON data.\n");
-				return -2;
-			}
-			if (spsign == -1)
-				spsign = eqsign;
-
-			pairs[pair][0] = (char*)malloc(sizeof(char) * (j - pair_start + 1));
-			strncpy(pairs[pair][0], &(data[pair_start]), j - pair_start);
-			pair_start = -1;
-			for (j = eqsign+1; j < i; j++) {
-				if (pair_start == -1 && data[j] != ' ' && data[j] != '\t' && data[j] != '\n' && data[j] != '\r') {
-					pair_start = j;
-					break;
-				}
-			}
-			if (pair_start == -1) {
-				fprintf(stderr, "[JSON] ERROR: Invalid JSON data.\n");
-				return -2;
-			}
-			for (j = i-1; j > pair_start; j--) {
-				if (data[j] != ' ' && data[j] != '\t' && data[j] != '\n' && data[j] != '\r') {
-					break;
-				}
-			}
-			pairs[pair][1] = (char*)malloc(sizeof(char) * (j - pair_start + 2));
-			strncpy(pairs[pair][1], &(data[pair_start]), j - pair_start + 1);
-			pair_start = -1;
-			pair++;
-			if (end != -1) {
+		p++;
+	}
+	return NULL;
+}
+
+int json_next_object(json_file *f) {
+	const char *p, *end;
+	int escaped;
+
+	p = f->pos;
+	end = f->end;
+	while (p < end) {
+		if (*p == '{') {
+			f->pos = p + 1;
+			return 1;
+		} else if (*p == '"' || *p == '\'') {
+			p = skip_string(p + 1, end, *p, &escaped);
+			if (!p)
 				break;
-			}
-			continue;
 		}
+		p++;
 	}
-	if (inquote || (start == 0 && end <= 0)) {
-		fprintf(stderr, "[JSON] ERROR: Invalid JSON data.\n");
-		return -2;
-	} else if (start < 0 && end < 0) {
-		// No more data
+	f->pos = end;
+	return 0;
+}
+
+static inline const char *skip_spaces(const char *p, const char *end) {
+	while (p < end && IS_SPACE(*p))
+		p++;
+	return p;
+}
+
+int json_next_field(json_file *f, json_token *key, json_token *value) {
+	const char *p, *end, *q;
+
+	p = f->pos;
+	end = f->end;
+
+	p = skip_spaces(p, end);
+	if (p < end && *p == ',')
+		p = skip_spaces(p + 1, end);
+	if (p >= end || *p == '}') {
+		f->pos = (p < end) ? p + 1 : end;
 		return 0;
 	}
 
-	(*nextresult) = parser(pairs, pair, result);
-	return end + 1;
+	// Key (quoted or bare identifier)
+	key->type = JSON_STRING;
+	key->escaped = 0;
+	if (*p == '"' || *p == '\'') {
+		q = skip_string(p + 1, end, *p, &(key->escaped));
+		if (!q)
+			goto invalid;
+		key->start = p + 1;
+		key->len = q - key->start;
+		p = q + 1;
+	} else {
+		key->start = p;
+		while (p < end && *p != ':' && !IS_SPACE(*p))
+			p++;
+		key->len = p - key->start;
+	}
+	p = skip_spaces(p, end);
+	if (p >= end || *p != ':')
+		goto invalid;
+	p = skip_spaces(p + 1, end);
+	if (p >= end)
+		goto invalid;
+
+	// Value
+	value->escaped = 0;
+	switch (*p) {
+	case '"':
+	case '\'':
+		q = skip_string(p + 1, end, *p, &(value->escaped));
+		if (!q)
+			goto invalid;
+		value->type = JSON_STRING;
+		value->start = p + 1;
+		value->len = q - value->start;
+		p = q + 1;
+		break;
+	case '{':
+	case '[':
+		// Leave nested containers to json_next_object
+		value->type = JSON_CONTAINER;
+		value->start = p;
+		value->len = 0;
+		f->pos = p;
+		return 0;
+	default:
+		value->start = p;
+		while (p < end && *p != ',' && *p != '}' && *p != ']' && !IS_SPACE(*p))
+			p++;
+		value->len = p - value->start;
+		if (json_token_equals(value, "true", 4)) {
+			value->type = JSON_TRUE;
+		} else if (json_token_equals(value, "false", 5)) {
+			value->type = JSON_FALSE;
+		} else if (json_token_equals(value, "null", 4)) {
+			value->type = JSON_NULL;
+		} else {
+			value->type = JSON_NUMBER;
+		}
+		break;
+	}
+
+	f->pos = p;
+	return 1;
+
+invalid:
+	fprintf(stderr, "[JSON] ERROR: Invalid JSON data (offset: %ld).\n", (long)(p - f->data));
+	f->pos = end;
+	return -2;
 }
 
-int parse_json_file(const char *path, json_parser parser, void *results) {
-	FILE *f;
-	char data[MAX_JSON_OBJECT_LEN];
-	char temp[MAX_JSON_OBJECT_LEN];
-	void *res_ptr;
-	int len, last;
-	int next, count;
+int json_decode_string(const json_token *tok, char *out) {
+	const char *p, *end;
+	int i, j, code;
 
-	f = fopen(path, "r");
-	if (!f) {
-		fprintf(stderr, "[JSON] ERROR: Cannot open JSON file: %s\n", path);
-		return -1;
+	if (!tok->escaped) {
+		memmove(out, tok->start, tok->len);
+		return tok->len;
 	}
 
-	res_ptr = results;
-	last = 0;
-	next = 0;
-	count = 0;
-	while (1) {
-		len = fread(&(data[last]), 1, MAX_JSON_OBJECT_LEN - last, f) + last;
-		if (len <= 0)
-			break;
-
-		next = parse_single_object(data, len, res_ptr, parser, &res_ptr);
-		if (next < 0) {
-			return next;
+	p = tok->start;
+	end = p + tok->len;
+	j = 0;
+	while (p < end) {
+		if (*p != '\\' || p + 1 == end) {
+			out[j++] = *p++;
+			continue;
 		}
-		if (next == 0) {
+		p++;
+		switch (*p) {
+		case 'b': out[j++] = '\b'; break;
+		case 'f': out[j++] = '\f'; break;
+		case 'n': out[j++] = '\n'; break;
+		case 'r': out[j++] = '\r'; break;
+		case 't': out[j++] = '\t'; break;
+		case 'u':
+			code = 0;
+			for (i = 1; i <= 4 && p + i < end && HEX_VAL(p[i]) >= 0; i++) {
+				code = (code << 4) | HEX_VAL(p[i]);
+			}
+			if (i <= 4) {
+				// Malformed escape, keep it as is
+				out[j++] = 'u';
+				break;
+			}
+			p += 4;
+			// Encode as UTF-8 (a \uXXXX sequence is 6 bytes long, so this never outgrows the input)
+			if (code < 0x80) {
+				out[j++] = (char)code;
+			} else if (code < 0x800) {
+				out[j++] = (char)(0xC0 | (code >> 6));
+				out[j++] = (char)(0x80 | (code & 0x3F));
+			} else {
+				out[j++] = (char)(0xE0 | (code >> 12));
+				out[j++] = (char)(0x80 | ((code >> 6) & 0x3F));
+				out[j++] = (char)(0x80 | (code & 0x3F));
+			}
+			break;
+		default:
+			// \" \' \\ \/ and any other escaped character stand for themselves
+			out[j++] = *p;
 			break;
 		}
-		count++;
-
-		last = len - next;
-		memcpy(temp, &(data[next]), last);
-		memcpy(data, temp, last);
+		p++;
 	}
+	return j;
+}
 
-	fclose(f);
-	return count;
+int json_token_equals(const json_token *tok, const char *str, int len) {
+	return tok->len == len && memcmp(tok->start, str, len) == 0;
 }
@@ -8,9 +8,51 @@
 #ifndef JSON_H_
 #define JSON_H_
 
-typedef void *(*json_parser)(char ***pairs, int numPairs, void *result);
-typedef void (*test_func)();
+#include <stddef.h>
 
-int parse_json_file(const char *path, json_parser parser, void *results);
+#define JSON_STRING 	0x01
+#define JSON_NUMBER 	0x02
+#define JSON_TRUE 		0x03
+#define JSON_FALSE 		0x04
+#define JSON_NULL 		0x05
+#define JSON_CONTAINER 	0x06 // Nested object or array (not consumed by json_next_field)
+
+typedef struct {
+	const char *data; // Memory mapped file contents
+	const char *pos;
+	const char *end;
+	size_t size;
+} json_file;
+
+typedef struct {
+	const char *start; // For strings: first byte after the opening quote
+	int len; // Raw length in the file (escape sequences not decoded)
+	int type;
+	int escaped; // Strings only: TRUE if the string contains backslash escapes
+} json_token;
+
+// Maps the file into memory. Returns 0 on success, -1 if the file cannot be opened or mapped.
+int json_open(json_file *f, const char *path);
+void json_close(json_file *f);
+
+// Upper bound on the number of objects in the file (used for preallocating results).
+int json_count_objects(json_file *f);
+
+// Advances to the next object in the file, at any nesting level.
+// Returns 1 if an object was found, 0 at end of data.
+int json_next_object(json_file *f);
+
+// Reads the next key/value pair of the current object.
+// Returns 1 if a pair was read, 0 at the end of the object or when the value is a nested
+// container (it is left for json_next_object), -2 on invalid data.
+int json_next_field(json_file *f, json_token *key, json_token *value);
+
+// Writes the decoded string value of a token to out (which must hold at least tok->len bytes).
+// Escape sequences are decoded in double-quoted (standard JSON) strings only.
+// Returns the number of bytes written.
+int json_decode_string(const json_token *tok, char *out);
+
+// Returns TRUE if the token equals the given string (escapes are not decoded)
+int json_token_equals(const json_token *tok, const char *str, int len);
 
 #endif /* JSON_H_ */
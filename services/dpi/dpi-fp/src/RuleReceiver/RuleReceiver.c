@@ -0,0 +1,308 @@
+/*
+ * A local stand-in for the DPI controller: receives the binary rule export stream of Snort (its
+ * 'socket' export mode, see Common/RuleExport.h), keeps the current rule set, and writes it out
+ * as a rules file for the DPI service after every transaction.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../Common/HashMap/HashMap.h"
+#include "../Common/RuleExport.h"
+
+#define USAGE "Usage: %s (socket=<path>|port=<#>) out=<file>\n\tsocket=<path>\tListen on a Unix socket\n\tport=<#>\tListen on a TCP port\n\tout=<file>\tRules file to write (replaced after every export)\n"
+
+#define MAX_RECORD_LEN 65535
+#define IS_PATTERN_CHAR(c) ((c) > ' ' && (c) < 0x7F && (c) != '\'' && (c) != '|')
+
+typedef struct {
+	char *pattern; // In the rules file syntax (|XX| escapes)
+	int is_regex;
+	unsigned int offset; // Both 0 if the pattern may be anywhere
+	unsigned int depth;
+} ReceivedRule;
+
+static void free_rules(HashMap *rules) {
+	ReceivedRule *rule;
+
+	hashmap_iterator_reset(rules);
+	while ((rule = (ReceivedRule*)hashmap_iterator_next(rules))) {
+		free(rule->pattern);
+		free(rule);
+	}
+	hashmap_destroy(rules);
+}
+
+static void remove_rule(HashMap *rules, unsigned int rid) {
+	ReceivedRule *rule;
+
+	rule = (ReceivedRule*)hashmap_get(rules, (int)rid);
+	if (rule) {
+		hashmap_remove(rules, (int)rid);
+		free(rule->pattern);
+		free(rule);
+	}
+}
+
+static inline void put_byte(char *out, int *j, unsigned char c) {
+	if (IS_PATTERN_CHAR(c)) {
+		out[(*j)++] = c;
+	} else {
+		*j += sprintf(out + *j, "|%02x|", c);
+	}
+}
+
+/*
+ * Converts a Snort content pattern (|XX XX| hex blocks, backslash escapes) to the rules file
+ * syntax, where every byte that is not a plain printable character is a |XX| escape.
+ */
+static char *content_to_pattern(const char *content, int len) {
+	char *out;
+	int i, j, hex, hi;
+
+	// A byte takes at most 4 characters
+	out = (char*)malloc(len * 4 + 1);
+	if (!out) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
+
+	hex = 0;
+	hi = -1;
+	for (i = 0, j = 0; i < len; i++) {
+		if (content[i] == '|') {
+			hex = !hex;
+			hi = -1;
+		} else if (hex) {
+			if (content[i] == ' ')
+				continue;
+			if (hi < 0) {
+				hi = content[i];
+				continue;
+			}
+			char digits[3] = { (char)hi, content[i], '\0' };
+			put_byte(out, &j, (unsigned char)strtol(digits, NULL, 16));
+			hi = -1;
+		} else if (content[i] == '\\' && i + 1 < len) {
+			put_byte(out, &j, (unsigned char)content[++i]);
+		} else {
+			put_byte(out, &j, (unsigned char)content[i]);
+		}
+	}
+	out[j] = '\0';
+	return out;
+}
+
+// Writes the rule set to a temporary file, then renames it over the rules file, so the file is never partially written
+static int write_rules(HashMap *rules, const char *path) {
+	char tmp[4096];
+	HashObject *entry;
+	ReceivedRule *rule;
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		return -1;
+	}
+	hashmap_iterator_reset(rules);
+	while ((entry = hashmap_iterator_next_entry(rules))) {
+		rule = (ReceivedRule*)entry->data;
+		fprintf(f, "{ className: 'MatchRule', rid: %u, pattern: '%s', is_regex: %s",
+				(unsigned int)entry->key, rule->pattern, rule->is_regex ? "true" : "false");
+		if (rule->offset || rule->depth) {
+			fprintf(f, ", offset: %u, depth: %u", rule->offset, rule->depth);
+		}
+		fprintf(f, " }\n");
+	}
+	if (fclose(f) != 0) {
+		return -1;
+	}
+	return rename(tmp, path);
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+	size_t got;
+	ssize_t n;
+
+	for (got = 0; got < len; got += n) {
+		n = read(fd, (char*)buf + got, len - got);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+		} else if (n <= 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Applies the records of a connection to the rule set until it is closed
+static void receive_rules(int fd, HashMap **rules, const char *out) {
+	RuleExportRecordHdr hdr;
+	RuleExportPosition position;
+	ReceivedRule *rule;
+	static char payload[MAX_RECORD_LEN + 1];
+	unsigned int rid, added, removed;
+	int len, pos_len;
+
+	added = removed = 0;
+	while (read_full(fd, &hdr, sizeof(hdr)) == 0) {
+		len = ntohs(hdr.len);
+		rid = ntohl(hdr.rid);
+		if (read_full(fd, payload, len) < 0) {
+			break;
+		}
+		payload[len] = '\0';
+
+		switch (hdr.type) {
+		case RULE_EXPORT_RECORD_BEGIN:
+			if (len < 4 || memcmp(payload, RULE_EXPORT_MAGIC, 3) != 0 || payload[3] != RULE_EXPORT_VERSION) {
+				fprintf(stderr, "[RuleReceiver] ERROR: Not a supported rule export stream\n");
+				return;
+			}
+			if (hdr.flags & RULE_EXPORT_FLAG_RESET) {
+				free_rules(*rules);
+				*rules = hashmap_create();
+			}
+			added = removed = 0;
+			break;
+		case RULE_EXPORT_RECORD_ADD:
+			memset(&position, 0, sizeof(position));
+			pos_len = 0;
+			if (hdr.flags & RULE_EXPORT_FLAG_POSITION) {
+				pos_len = sizeof(position);
+				if (len < pos_len) {
+					fprintf(stderr, "[RuleReceiver] ERROR: Truncated record of rule %u\n", rid);
+					return;
+				}
+				memcpy(&position, payload, pos_len);
+			}
+			remove_rule(*rules, rid);
+			rule = (ReceivedRule*)malloc(sizeof(ReceivedRule));
+			if (!rule) {
+				fprintf(stderr, "FATAL: Out of memory\n");
+				exit(1);
+			}
+			rule->pattern = content_to_pattern(payload + pos_len, len - pos_len);
+			rule->is_regex = (hdr.flags & RULE_EXPORT_FLAG_REGEX) != 0;
+			rule->offset = ntohs(position.offset);
+			rule->depth = ntohs(position.depth);
+			hashmap_put(*rules, (int)rid, rule);
+			added++;
+			break;
+		case RULE_EXPORT_RECORD_REMOVE:
+			remove_rule(*rules, rid);
+			removed++;
+			break;
+		case RULE_EXPORT_RECORD_COMMIT:
+			if (write_rules(*rules, out) < 0) {
+				fprintf(stderr, "[RuleReceiver] ERROR: Cannot write rules file %s: %s\n", out, strerror(errno));
+			} else {
+				printf("[RuleReceiver] Rule set %u: %d rules (%u added, %u removed)\n", rid, hashmap_size(*rules), added, removed);
+			}
+			break;
+		default:
+			fprintf(stderr, "[RuleReceiver] ERROR: Unknown record type: %d\n", hdr.type);
+			return;
+		}
+	}
+}
+
+static int listen_on(const char *path, int port) {
+	int sock, one;
+
+	if (path) {
+		struct sockaddr_un addr;
+
+		if (strlen(path) >= sizeof(addr.sun_path)) {
+			fprintf(stderr, "[RuleReceiver] ERROR: Socket path is too long: %s\n", path);
+			exit(1);
+		}
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path);
+		unlink(path);
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+			fprintf(stderr, "[RuleReceiver] ERROR: Cannot bind to %s: %s\n", path, strerror(errno));
+			exit(1);
+		}
+	} else {
+		struct sockaddr_in addr;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(port);
+		sock = socket(AF_INET, SOCK_STREAM, 0);
+		one = 1;
+		if (sock < 0 || setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+				bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+			fprintf(stderr, "[RuleReceiver] ERROR: Cannot bind to port %d: %s\n", port, strerror(errno));
+			exit(1);
+		}
+	}
+	if (listen(sock, 1) < 0) {
+		fprintf(stderr, "[RuleReceiver] ERROR: Cannot listen: %s\n", strerror(errno));
+		exit(1);
+	}
+	return sock;
+}
+
+int main(int argc, char *argv[]) {
+	char *path = NULL;
+	char *out = NULL;
+	int port = 0;
+	char *param, *arg;
+	HashMap *rules;
+	int i, sock, fd;
+
+	for (i = 1; i < argc; i++) {
+		param = strsep(&argv[i], "=");
+		arg = argv[i];
+		if (!arg) {
+			fprintf(stderr, USAGE, argv[0]);
+			exit(1);
+		}
+		if (strcmp(param, "socket") == 0) {
+			path = arg;
+		} else if (strcmp(param, "port") == 0) {
+			port = atoi(arg);
+		} else if (strcmp(param, "out") == 0) {
+			out = arg;
+		} else {
+			fprintf(stderr, "Unknown parameter: %s\n", param);
+			fprintf(stderr, USAGE, argv[0]);
+			exit(1);
+		}
+	}
+	if ((path == NULL) == (port <= 0) || out == NULL) {
+		fprintf(stderr, USAGE, argv[0]);
+		exit(1);
+	}
+
+	sock = listen_on(path, port);
+	rules = hashmap_create();
+	printf("[RuleReceiver] Waiting for rules...\n");
+	fflush(stdout);
+
+	// One exporter at a time: a new connection starts a new rule set
+	while ((fd = accept(sock, NULL, NULL)) >= 0 || errno == EINTR) {
+		if (fd < 0)
+			continue;
+		receive_rules(fd, &rules, out);
+		close(fd);
+		fflush(stdout);
+	}
+
+	fprintf(stderr, "[RuleReceiver] ERROR: Cannot accept connections: %s\n", strerror(errno));
+	free_rules(rules);
+	close(sock);
+	return 1;
+}
@@ -1,14 +1,13 @@
 #ifndef SNIFFER_RULEID_H_
 #define SNIFFER_RULEID_H_
 
-/* The rule ID size can be of two sizes: uint16, uint32.
- * Out of the box the size is uint16, in order to save space. */
-#define RULE_ID_SIZE 16
+/* Rule IDs are 32 bits wide internally. On the wire, match reports carry either uint16 rule IDs
+ * (out of the box, in order to save space) or uint32 rule IDs when the rule set needs them.
+ * The width in use is announced in the type field of the NSH metadata TLV (see NSH/Constants.h). */
+#define RULE_ID_SIZE_16 16
+#define RULE_ID_SIZE_32 32
+#define RULE_ID_MAX_16 0xFFFF
 
-#if RULE_ID_SIZE == 16
-	typedef uint16_t rule_id_t;
-#else
-	typedef uint32_t rule_id_t;
-#endif
+typedef uint32_t rule_id_t;
 
 #endif /* SNIFFER_RULEID_H_ */
@@ -21,27 +21,35 @@
 #include "../StateMachine/TableStateMachine.h"
 #include "../StateMachine/TableStateMachineGenerator.h"
 #include "../Common/Types.h"
-#include "../Common/PacketBuffer.h"
-#include "../Common/NSH/Types.h"
-#include "../Common/NSH/Constants.h"
-#include "MatchReport.h"
-#include "MatchReportRange.h"
+#include "Packet/PacketBuffer.h"
+#include "Packet/Capture.h"
+#include "Packet/Defrag.h"
+#include "Packet/Stream.h"
+#include "NSH/Types.h"
+#include "NSH/Constants.h"
+#include "NSH/MatchReport.h"
 #include "checksum.h"
 #include "RuleId.h"
 
 #define MAX_PACKET_SIZE 65535
 #define MAX_REPORTED_RULES 1024
-#define STR_ANY "any"
-#define STR_FILTER "ip"
 #define MAGIC_NUM 0xDEE4
 #define MAX_THREADS 8
 #define MAX_REPORTS_PER_PACKET 350
+#define NO_DEFRAG -1
+// A TCP segment with a parsed header (fragments are scanned as datagrams, not fed to the stream reassembly)
+#define IS_TCP_SEGMENT(p) ((p)->ip_proto == IPPROTO_TCP && !PACKET_IS_FRAGMENT(p) && (p)->payload)
+#define DEFAULT_DEFRAG_MEM 4096 // KB per worker
+#define DEFAULT_DEFRAG_TIMEOUT 1000 // milliseconds
+#define DEFAULT_STREAM_MEM 16384 // KB per worker
+#define NUM_PORTS 65536
+#define PORT_DEPTH_UNSET 0xFFFFFFFF
 
 #define USE_NSH 1
 #define MATCH_REPORT_INDEX 0
 #define MATCH_REPORT_RANGE_INDEX 1
 
-#define USAGE "Usage: %s (in=<iface>|infile=<file>) (out=<iface>|outfile=<file>) rules=<file> [max=<#>] [workers=<#>] [noreport] [batch]\n\tin=<iface>\tSet input capture interface\n\tout=<iface>\tSet output interface\n\tinfile=<file>\tSet input pcap file (cannot use with 'in')\n\toutfile=<file>\tSet output pcap file (cannot use with 'out', not implemented yet)\n\trules=<file>\tSet rules file\n\tmax=<#>\t\tMaximal number of rules to use from file\n\tworkers=<#>\tSet number of workers (default: 1)\n\tnoreport\tDo not send report packets. Handle report internally.\n\tbatch\t\tReport results in batch mode\n\nThis tool may require root privileges.\n"
+#define USAGE "Usage: %s (in=<iface>|infile=<file>) (out=<iface>|outfile=<file>) rules=<file> [max=<#>] [workers=<#>] [dfathreads=<#>] [fulldepth=<#>] [ridsize=<16|32>] [defrag=<first|last|off>] [defragmem=<#>] [defragtimeout=<#>] [streams] [streammem=<#>] [depth=<#>] [portdepth=<port>:<#>]... [markclean] [noreport] [batch]\n\tin=<iface>\tSet input capture interface\n\tout=<iface>\tSet output interface\n\tinfile=<file>\tSet input pcap file (cannot use with 'in')\n\toutfile=<file>\tSet output pcap file (cannot use with 'out'), e.g. to make NSH traffic for Snort offline\n\trules=<file>\tSet rules file\n\tmax=<#>\t\tMaximal number of rules to use from file\n\tworkers=<#>\tSet number of workers (default: 1)\n\tdfathreads=<#>\tSet number of threads for building the DFA (default: 1)\n\tfulldepth=<#>\tUse full DFA rows only for states shallower than this, sparse rows for the rest (default: 0, all full)\n\tridsize=<#>\tRule ID width in NSH match reports (default: 16, or 32 if the rule set needs it)\n\tdefrag=<policy>\tReassemble IP fragments before scanning, keeping the first or last copy of overlapping data (default: first)\n\tdefragmem=<#>\tMemory for held fragments per worker, in KB (default: 4096)\n\tdefragtimeout=<#>\tFragment reassembly timeout in milliseconds (default: 1000)\n\tstreams\t\tReassemble TCP streams, so patterns that span segments are found (one scan state per flow)\n\tstreammem=<#>\tMemory for TCP flows and held segments per worker, in KB (default: 16384)\n\tdepth=<#>\tScan only the first bytes of each TCP flow direction, forward the rest directly (default: 0, no limit; implies 'streams')\n\tportdepth=<port>:<#>\tScan depth for flows to or from a server port, overriding 'depth' (0 for no limit; may be repeated)\n\tmarkclean\tSend scanned packets without matches in an NSH header too (with no reports), so they can be told from packets that were not scanned\n\tnoreport\tDo not send report packets. Handle report internally.\n\tbatch\t\tReport results in batch mode\n\nThis tool may require root privileges.\n"
 
 #define GET_MBPS(bytes, usecs) \
 	((bytes) * 8.0 * 1000000) / ((usecs) * 1024 * 1024)
@@ -52,14 +60,19 @@ struct st_processor_data;
 
 void *worker_start(void *);
 static inline int roundup(int x);
-static inline int remove_impostor_match_reports(MatchReport *match_reports, int num_mr, int mr_range_len);
-static inline void add_match_report_range(rule_id_t rid, uint16_t position, uint16_t length, MatchReportRange *mr_range, int num_mr_range);
-static inline void init_match_report_range(rule_id_t rid, uint16_t pos, uint16_t len, MatchReportRange *mr_range);
+static inline int remove_impostor_match_reports(MatchReport32 *match_reports, int num_mr, int mr_range_len);
+static inline void add_match_report_range(rule_id_t rid, uint16_t position, uint16_t length, MatchReportRange32 *mr_range, int num_mr_range);
+static inline void init_match_report_range(rule_id_t rid, uint16_t pos, uint16_t len, MatchReportRange32 *mr_range);
 
 typedef struct {
 	int id;
 	struct st_processor_data *processor;
 	PacketBuffer *queue;
+	Defrag defrag;
+	StreamTable streams;
+	// Scan buffers of the worker (for the stream delivery callback)
+	ContentMatchReport *reports;
+	unsigned char *data;
 #ifdef __linux__
 	cpu_set_t cpuset;
 	pthread_attr_t attr;
@@ -69,15 +82,15 @@ typedef struct {
 typedef struct st_processor_data {
 	int counter;
 	TableStateMachine *machine;
-	int linkHdrLen;
-	pcap_t *pcap_in;
-	pcap_t *pcap_out;
+	int linktype;
+	Capture *capture;
 	struct timeval start, end;
 	struct timeval first_packet[MAX_THREADS], last_packet[MAX_THREADS];
 	int started[MAX_THREADS];
 	long bytes[MAX_THREADS];
 	// For Standalone middlebox mode that does not report its matches
 	int no_report;
+	int mark_clean; // Send scanned packets without matches in NSH too (with no reports)
 	long total_reports[MAX_THREADS];
 	int terminated;
 	pthread_t workers[MAX_THREADS];
@@ -86,6 +99,13 @@ typedef struct st_processor_data {
 	int num_workers;
 	int next_queue;
 	int batch_mode;
+	int rid_size; // Rule ID width in NSH match reports (RULE_ID_SIZE_16 or RULE_ID_SIZE_32)
+	int defrag_policy; // DEFRAG_POLICY_*, or NO_DEFRAG
+	int streams; // Reassemble TCP streams
+	unsigned int scan_depth; // Bytes scanned per TCP flow direction (0 for no limit)
+	unsigned int *port_depth; // Scan depth by server port (PORT_DEPTH_UNSET for scan_depth), or NULL
+	long bypassed_flows[MAX_THREADS];
+	long bypassed_bytes[MAX_THREADS];
 } ProcessorData;
 
 typedef struct {
@@ -102,7 +122,10 @@ typedef struct {
 
 static ProcessorData *_global_processor;
 
-ProcessorData *init_processor(TableStateMachine *machine, pcap_t *pcap_in, pcap_t *pcap_out, int linkHdrLen, int num_workers, int no_report, int batch) {
+static void deliver_segment(Stream *stream, InPacket *pkt, unsigned int skip, void *arg);
+
+ProcessorData *init_processor(TableStateMachine *machine, Capture *capture, int num_workers, int no_report, int mark_clean, int batch, int rid_size,
+		int defrag_policy, unsigned long defrag_mem, unsigned long defrag_timeout, int streams, unsigned long stream_mem, unsigned int scan_depth, unsigned int *port_depth) {
 	int i;
 	ProcessorData *processor;
 
@@ -110,13 +133,18 @@ ProcessorData *init_processor(TableStateMachine *machine, pcap_t *pcap_in, pcap_
 
 	processor->counter = 0;
 	processor->machine = machine;
-	processor->pcap_in = pcap_in;
-	processor->pcap_out = pcap_out;
-	processor->linkHdrLen = linkHdrLen;
+	processor->capture = capture;
+	processor->linktype = capture->linktype;
 	processor->no_report = no_report;
+	processor->mark_clean = mark_clean;
 	processor->terminated = 0;
 	processor->next_queue = 0;
 	processor->batch_mode = batch;
+	processor->rid_size = rid_size;
+	processor->defrag_policy = defrag_policy;
+	processor->streams = streams;
+	processor->scan_depth = scan_depth;
+	processor->port_depth = port_depth;
 
 	processor->num_workers = num_workers;
 	for (i = 0; i < num_workers; i++) {
@@ -124,9 +152,13 @@ ProcessorData *init_processor(TableStateMachine *machine, pcap_t *pcap_in, pcap_
 		processor->started[i] = 0;
 		processor->bytes[i] = 0;
 		processor->total_reports[i] = 0;
+		processor->bypassed_flows[i] = 0;
+		processor->bypassed_bytes[i] = 0;
 		processor->workerData[i].id = i;
 		processor->workerData[i].processor = processor;
 		processor->workerData[i].queue = &(processor->queues[i]);
+		defrag_init(&(processor->workerData[i].defrag), defrag_mem * 1024, defrag_timeout, defrag_policy);
+		stream_table_init(&(processor->workerData[i].streams), stream_mem * 1024, deliver_segment, &(processor->workerData[i]));
 #ifdef __linux__
 		CPU_ZERO(&(processor->workerData[i].cpuset));
 		CPU_SET(i, &(processor->workerData[i].cpuset));
@@ -143,102 +175,17 @@ ProcessorData *init_processor(TableStateMachine *machine, pcap_t *pcap_in, pcap_
 }
 
 void destroy_processor(ProcessorData *processor) {
+	free(processor->port_depth);
 	free(processor);
 }
 
-static inline void parse_packet(ProcessorData *processor, const unsigned char *packetptr, Packet *packet) {
-    struct ip* iphdr;
-    struct icmp* icmphdr;
-    struct tcphdr* tcphdr;
-    struct udphdr* udphdr;
-    //char iphdrInfo[256], srcip[256], dstip[256];
-    //unsigned short id, seq;
-    unsigned int transport_len;
-
-    // Skip the datalink layer header and get the IP header fields.
-    packetptr += processor->linkHdrLen;
-    iphdr = (struct ip*)packetptr;
-    packet->ip_src = iphdr->ip_src.s_addr;
-    packet->ip_dst = iphdr->ip_dst.s_addr;
-    packet->ip_id = ntohs(iphdr->ip_id);
-    packet->ip_tos = iphdr->ip_tos;
-    packet->ip_ttl = iphdr->ip_ttl;
-    packet->ip_proto = iphdr->ip_p;
-    packet->ip_len = ntohs(iphdr->ip_len);
-
-    packet->payload = NULL;
-    packet->payload_len = 0;
-
-    /*
-    strcpy(srcip, inet_ntoa(iphdr->ip_src));
-    strcpy(dstip, inet_ntoa(iphdr->ip_dst));
-    sprintf(iphdrInfo, "ID:%d TOS:0x%x, TTL:%d IpLen:%d DgLen:%d",
-            ntohs(iphdr->ip_id), iphdr->ip_tos, iphdr->ip_ttl,
-            4*iphdr->ip_hl, ntohs(iphdr->ip_len));
-    */
-
-    // Advance to the transport layer header then parse and display
-    // the fields based on the type of header: tcp, udp or icmp.
-    packetptr += 4*iphdr->ip_hl;
-    switch (iphdr->ip_p)
-    {
-    case IPPROTO_TCP:
-        tcphdr = (struct tcphdr*)packetptr;
-#ifdef __APPLE__
-        transport_len = 4 * tcphdr->th_off;
-        packet->transport.tp_src = tcphdr->th_sport;
-        packet->transport.tp_dst = tcphdr->th_dport;
-        packet->seqnum = tcphdr->th_seq;
-#elif __linux__
-        transport_len = 4 * tcphdr->doff;
-        packet->transport.tp_src = tcphdr->source;
-        packet->transport.tp_dst = tcphdr->dest;
-        packet->seqnum = tcphdr->seq;
-#endif
-        packet->payload_len = ntohs(iphdr->ip_len) - (4*iphdr->ip_hl) - transport_len;
-        packetptr += transport_len;
-        packet->payload = (unsigned char *)packetptr;
-        break;
-
-    case IPPROTO_UDP:
-        udphdr = (struct udphdr*)packetptr;
-        transport_len = 8;
-#ifdef __APPLE__
-        packet->transport.tp_src = udphdr->uh_sport;
-        packet->transport.tp_dst = udphdr->uh_dport;
-        packet->seqnum = udphdr->uh_sum;
-#elif __linux__
-        packet->transport.tp_src = udphdr->source;
-        packet->transport.tp_dst = udphdr->dest;
-        packet->seqnum = udphdr->check;
-#endif
-        /*
-        printf("UDP  %s:%d -> %s:%d\n", srcip, ntohs(udphdr->uh_sport),
-               dstip, ntohs(udphdr->uh_dport));
-        printf("%s\n", iphdrInfo);
-        */
-        packet->payload_len = ntohs(iphdr->ip_len) - (4*iphdr->ip_hl) - transport_len;
-        packetptr += transport_len;
-        packet->payload = (unsigned char *)packetptr;
-        break;
-
-    case IPPROTO_ICMP:
-        icmphdr = (struct icmp*)packetptr;
-        packet->icmp.icmp_type = icmphdr->icmp_type;
-        packet->icmp.icmp_code = icmphdr->icmp_code;
-        packet->seqnum = 0;
-        /*
-        printf("ICMP %s -> %s\n", srcip, dstip);
-        printf("%s\n", iphdrInfo);
-        memcpy(&id, (u_char*)icmphdr+4, 2);
-        memcpy(&seq, (u_char*)icmphdr+6, 2);
-        printf("Type:%d Code:%d ID:%d Seq:%d\n", icmphdr->type, icmphdr->code,
-               ntohs(id), ntohs(seq));
-        */
-        packet->payload_len = 0;
-        packet->payload = NULL;
-        break;
-    }
+// Whether Snort would look for the pattern of a rule where it was found (position is its last byte in the payload)
+static inline int rule_position_matches(MatchRule *rule, int position) {
+	if (rule->offset && position - rule->len + 1 < rule->offset)
+		return 0;
+	if (rule->depth && position >= rule->offset + rule->depth)
+		return 0;
+	return 1;
 }
 
 static inline int find_results(ProcessorData *processor, ContentMatchReport *reports, int num_reports, ResultPacketReport *rules) {
@@ -250,6 +197,8 @@ static inline int find_results(ProcessorData *processor, ContentMatchReport *rep
 		state_rules = processor->machine->matchRules[reports[i].state];
 		num_rules = processor->machine->numRules[reports[i].state];
 		for (j = 0; j < num_rules; j++) {
+			if (!rule_position_matches(&(state_rules[j]), reports[i].position))
+				continue;
 			rules[r].rid = state_rules[j].rid;
 			rules[r].idx = reports[i].position - state_rules[j].len;
 			r++;
@@ -259,23 +208,24 @@ static inline int find_results(ProcessorData *processor, ContentMatchReport *rep
 }
 
 static inline int find_detection_results(ProcessorData *processor, ContentMatchReport *reports, int num_reports,
-		MatchReport *match_reports, MatchReportRange *match_reports_range, int *num_match_reports_by_type) {
+		MatchReport32 *match_reports, MatchReportRange32 *match_reports_range, int *num_match_reports_by_type) {
 	int i,j, num_mr, num_mr_range, num_rules;
-	MatchReportRange tmp_mr_range;
+	MatchReportRange32 tmp_mr_range;
 	MatchRule *state_rules;
 
 	num_mr = 0;
 	num_mr_range = 0;
+	tmp_mr_range.rid = (rule_id_t)-1;
+	tmp_mr_range.position = 0;
+	tmp_mr_range.length = 0;
 	for (i = 0; i < num_reports; i++) {
 		state_rules = processor->machine->matchRules[reports[i].state];
 		num_rules = processor->machine->numRules[reports[i].state];
 		for (j = 0; j < num_rules; j++) {
+			if (!rule_position_matches(&(state_rules[j]), reports[i].position))
+				continue;
 			// Enter a MatchReport to the result array, we might override it later in case this is actually part of a MatchReportRange.
-#if RULE_ID_SIZE == 16
-			match_reports[num_mr].rid = htons(state_rules[j].rid);
-#else
 			match_reports[num_mr].rid = htonl(state_rules[j].rid);
-#endif
 			match_reports[num_mr].position = htons(reports[i].position - state_rules[j].len);
 			match_reports[num_mr].is_range = 0;
 			num_mr++;
@@ -322,7 +272,7 @@ static inline int find_detection_results(ProcessorData *processor, ContentMatchR
 	return num_mr + num_mr_range;
 }
 
-static inline int remove_impostor_match_reports(MatchReport *match_reports, int num_mr, int mr_range_len) {
+static inline int remove_impostor_match_reports(MatchReport32 *match_reports, int num_mr, int mr_range_len) {
 	int last_mr_inser_idx = num_mr - 1;
 	int mr_reset_idx = last_mr_inser_idx - mr_range_len;
 	match_reports[mr_reset_idx].rid = match_reports[last_mr_inser_idx].rid;
@@ -332,18 +282,14 @@ static inline int remove_impostor_match_reports(MatchReport *match_reports, int
 	return mr_reset_idx + 1;
 }
 
-static inline void add_match_report_range(rule_id_t rid, uint16_t position, uint16_t length, MatchReportRange *mr_range, int num_mr_range) {
-#if RULE_ID_SIZE == 16
-	mr_range[num_mr_range].rid = htons(rid);
-#else
+static inline void add_match_report_range(rule_id_t rid, uint16_t position, uint16_t length, MatchReportRange32 *mr_range, int num_mr_range) {
 	mr_range[num_mr_range].rid = htonl(rid);
-#endif
 	mr_range[num_mr_range].position = htons(position);
 	mr_range[num_mr_range].is_range = 1;
 	mr_range[num_mr_range].length = htons(length);
 }
 
-static inline void init_match_report_range(rule_id_t rid, uint16_t pos, uint16_t len, MatchReportRange *mr_range) {
+static inline void init_match_report_range(rule_id_t rid, uint16_t pos, uint16_t len, MatchReportRange32 *mr_range) {
 	mr_range->rid = rid;
 	mr_range->position = pos - len;
 	mr_range->length = 1;
@@ -363,8 +309,11 @@ static inline int build_result_packet(ProcessorData *processor, const struct pca
 		return 0;
 	}
 
-	// Find results
+	// Find results (all of them may be where Snort does not look for them)
 	r = find_results(processor, reports, num_reports, rules);
+	if (r == 0) {
+		return 0;
+	}
 
 	// TODO: Break into several packets
 	if (r > MAX_REPORTS_PER_PACKET) {
@@ -375,7 +324,7 @@ static inline int build_result_packet(ProcessorData *processor, const struct pca
 	data_len = 12 + (r * 4); // 12 = result packet header (e.g. magic num).
 
 	// Copy L2 headers
-	hdrs_len = pkthdr->len - in_packet->ip_len;
+	hdrs_len = in_packet->l3_offset;
 	memcpy(result, packetptr, hdrs_len);
 
 	// Build IP header
@@ -418,11 +367,41 @@ static inline int build_result_packet(ProcessorData *processor, const struct pca
 	return hdrs_len + 40 + (r * sizeof(ResultPacketReport));
 }
 
+// Writes the match reports to the packet metadata in the negotiated rule ID width. Returns the number of bytes written.
+static inline int write_match_reports(ProcessorData *processor, MatchReport32 *match_reports, int num_mr,
+		MatchReportRange32 *match_reports_range, int num_mr_range, unsigned char *dst) {
+	MatchReport *mr;
+	MatchReportRange *mr_range;
+	int i;
+
+	if (processor->rid_size == RULE_ID_SIZE_32) {
+		memcpy(dst, match_reports, num_mr * sizeof(MatchReport32));
+		memcpy(dst + num_mr * sizeof(MatchReport32), match_reports_range, num_mr_range * sizeof(MatchReportRange32));
+		return num_mr * sizeof(MatchReport32) + num_mr_range * sizeof(MatchReportRange32);
+	}
+
+	// Narrow rule IDs (values are in network order)
+	mr = (MatchReport*)dst;
+	for (i = 0; i < num_mr; i++) {
+		mr[i].rid = htons((uint16_t)ntohl(match_reports[i].rid));
+		mr[i].is_range = match_reports[i].is_range;
+		mr[i].position = match_reports[i].position;
+	}
+	mr_range = (MatchReportRange*)(dst + num_mr * sizeof(MatchReport));
+	for (i = 0; i < num_mr_range; i++) {
+		mr_range[i].rid = htons((uint16_t)ntohl(match_reports_range[i].rid));
+		mr_range[i].is_range = match_reports_range[i].is_range;
+		mr_range[i].position = match_reports_range[i].position;
+		mr_range[i].length = match_reports_range[i].length;
+	}
+	return num_mr * sizeof(MatchReport) + num_mr_range * sizeof(MatchReportRange);
+}
+
 static inline int build_nsh_result_packet(ProcessorData *processor, const struct pcap_pkthdr *pkthdr, const unsigned char *packetptr,
 		Packet *in_packet, ContentMatchReport *reports, int num_reports, unsigned char *result) {
 	int hdrs_len, NSH_CONST_LEN, match_report_size, match_report_range_size, nsh_var_len, nsh_var_len_round, data_len;
-	MatchReport match_reports[MAX_REPORTED_RULES];
-	MatchReportRange match_reports_range[MAX_REPORTED_RULES];
+	MatchReport32 match_reports[MAX_REPORTED_RULES];
+	MatchReportRange32 match_reports_range[MAX_REPORTED_RULES];
 	int num_match_reports_by_type[2] = {0, 0}; // Array for counting the number of match reports (idx = 0) and match report range (idx = 1).
 	int num_match_reports; // The total number of match reports (match reports + match report range).
 	VxLANHdr *vxLanHdr;
@@ -432,11 +411,7 @@ static inline int build_nsh_result_packet(ProcessorData *processor, const struct
     struct ip *iphdr = (struct ip*)result;
     struct udphdr *udphdr;
 
-	if (num_reports == 0) {
-		return 0;
-	}
-
-	// Find results
+	// Find results (there may be none: the packet is then only marked as scanned)
 	num_match_reports = find_detection_results(processor, reports, num_reports, match_reports, match_reports_range, num_match_reports_by_type);
 	if (num_match_reports > MAX_REPORTS_PER_PACKET) {
 		if (num_match_reports_by_type[MATCH_REPORT_INDEX] >= MAX_REPORTS_PER_PACKET) {
@@ -452,15 +427,20 @@ static inline int build_nsh_result_packet(ProcessorData *processor, const struct
 
 	// Compute data length
 	NSH_CONST_LEN = sizeof(VxLANHdr) + sizeof(NSHBaseHdr) + sizeof(NSHVarLenMDHdr);
-	match_report_size = num_match_reports_by_type[MATCH_REPORT_INDEX] * sizeof(MatchReport);
-	match_report_range_size = num_match_reports_by_type[MATCH_REPORT_RANGE_INDEX] * sizeof(MatchReportRange);
+	if (processor->rid_size == RULE_ID_SIZE_32) {
+		match_report_size = num_match_reports_by_type[MATCH_REPORT_INDEX] * sizeof(MatchReport32);
+		match_report_range_size = num_match_reports_by_type[MATCH_REPORT_RANGE_INDEX] * sizeof(MatchReportRange32);
+	} else {
+		match_report_size = num_match_reports_by_type[MATCH_REPORT_INDEX] * sizeof(MatchReport);
+		match_report_range_size = num_match_reports_by_type[MATCH_REPORT_RANGE_INDEX] * sizeof(MatchReportRange);
+	}
 	nsh_var_len = match_report_size + match_report_range_size;
 	nsh_var_len_round = roundup(nsh_var_len); // Need to write the length in 4-byte words, so round up if needed.
 	data_len = NSH_CONST_LEN + nsh_var_len_round + in_packet->ip_len;
 
 
 	// Copy L2 headers
-	hdrs_len = pkthdr->len - in_packet->ip_len;
+	hdrs_len = in_packet->l3_offset;
 	memcpy(result, packetptr, hdrs_len);
 
 	// Build IP header
@@ -516,15 +496,16 @@ static inline int build_nsh_result_packet(ProcessorData *processor, const struct
 
 	// Build NSH Variable Length Context Header.
 	varLenMd = (NSHVarLenMDHdr *)&(result[hdrs_len + IP_HEADER_SIZE + UDP_HEADER_SIZE + sizeof(VxLANHdr) + sizeof(NSHBaseHdr)]);
-	varLenMd->tlv_class = 3;
-	varLenMd->type = 1;
+	varLenMd->tlv_class = NSH_MD_CLASS_DPI;
+	varLenMd->type = (processor->rid_size == RULE_ID_SIZE_32) ? NSH_MD_TYPE_MATCH_REPORTS_RID32 : NSH_MD_TYPE_MATCH_REPORTS;
 	uint8_t varFlags = 0;
 	uint8_t varLength =  nsh_var_len_round / 4; // Need to write the length in 4-byte words
 	varLenMd->rrr_len = (varFlags << 5) + varLength;
 
 	// Write the variable metadata to the packet.
-	memcpy(&(result[hdrs_len + IP_HEADER_SIZE + UDP_HEADER_SIZE + NSH_CONST_LEN]), match_reports, match_report_size);
-	memcpy(&(result[hdrs_len + IP_HEADER_SIZE + UDP_HEADER_SIZE + NSH_CONST_LEN + match_report_size]), match_reports_range, match_report_range_size);
+	write_match_reports(processor, match_reports, num_match_reports_by_type[MATCH_REPORT_INDEX],
+			match_reports_range, num_match_reports_by_type[MATCH_REPORT_RANGE_INDEX],
+			&(result[hdrs_len + IP_HEADER_SIZE + UDP_HEADER_SIZE + NSH_CONST_LEN]));
 
 	if (nsh_var_len < nsh_var_len_round) {
 		// In case the we performed a round up. Fill the additional bytes with zero (AKAK zero padding).
@@ -547,33 +528,9 @@ static inline int roundup(int x) {
 	return round;
 }
 
-static inline InPacket *buffer_packet(Packet *packet, const struct pcap_pkthdr *pkthdr, const unsigned char *pktptr, unsigned int seqnum_key) {
-	InPacket *res;
-
-	res = (InPacket*)malloc(sizeof(InPacket));
-	if (!res) {
-		fprintf(stderr, "FATAL: Out of memory\n");
-		exit(1);
-	}
-	res->pkthdr = *pkthdr;
-	res->pktdata = (unsigned char*)malloc(sizeof(unsigned char) * pkthdr->len);
-	if (!(res->pktdata)) {
-		fprintf(stderr, "FATAL: Out of memory\n");
-		exit(1);
-	}
-	memcpy(res->pktdata, pktptr, sizeof(unsigned char) * pkthdr->len);
-	res->seqnum = seqnum_key;
-	res->timestamp = time(0);
-	res->packet = *packet;
-	res->packet.payload = (unsigned char *)malloc(sizeof(unsigned char) * packet->payload_len);
-	memcpy(res->packet.payload, packet->payload, packet->payload_len);
-	return res;
-}
-
-static inline void free_buffered_packet(InPacket *pkt) {
-	free(pkt->pktdata);
-	free(pkt->packet.payload);
-	free(pkt);
+// Result packets are built as IPv4/UDP next to the data packet, so they need a complete IPv4 capture
+static inline int can_report(InPacket *pkt) {
+	return pkt->packet.ip_version == PACKET_IPV4 && pkt->packet.l3_offset + pkt->packet.ip_len <= pkt->pkthdr.caplen;
 }
 
 static inline int count_results_for_noreport_mode(ProcessorData *processor, ContentMatchReport *reports, int num_reports) {
@@ -584,29 +541,217 @@ static inline int count_results_for_noreport_mode(ProcessorData *processor, Cont
 	return r;
 }
 
+static inline unsigned long get_time_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+// Forwards a packet and its match reports (res reports, with positions in its payload), and frees it. A packet that was not scanned is forwarded as is.
+static void send_packet(ProcessorData *processor, int id, InPacket *pkt, int scanned, ContentMatchReport *reports, int res, unsigned char *data) {
+	Packet *packet;
+	unsigned char *ptr;
+	int size, r;
+
+	packet = &(pkt->packet);
+
+	if (processor->no_report) {
+		// Count reports
+		r = count_results_for_noreport_mode(processor, reports, res);
+		processor->total_reports[id] += r;
+		// Forward packet
+		capture_send(processor->capture, &(pkt->pkthdr), pkt->pktdata, pkt->pkthdr.caplen);
+	} else {
+		// Send original packet
+		if ((!res && !(USE_NSH && processor->mark_clean && scanned)) || !can_report(pkt)) {
+			// No matches (or no IPv4 result packet can carry them) - send as is
+			capture_send(processor->capture, &(pkt->pkthdr), pkt->pktdata, pkt->pkthdr.caplen);
+		} else if (USE_NSH) {
+			// (with no match reports if there were no matches and clean packets are marked)
+			size = build_nsh_result_packet(processor, &(pkt->pkthdr), pkt->pktdata, packet, reports, res, data);
+			if (size) {
+				// Send results packet
+				capture_send(processor->capture, &(pkt->pkthdr), data, size);
+			}
+		} else {
+			// Matches exist - change ECN to 11b and send
+			ptr = (unsigned char *)(pkt->pktdata);
+			packet_set_tos(ptr, packet, packet->ip_tos | 0xC0);
+			capture_send(processor->capture, &(pkt->pkthdr), ptr, pkt->pkthdr.caplen);
+
+			// Build results packet
+			size = build_result_packet(processor, &(pkt->pkthdr), pkt->pktdata, packet, reports, res, data);
+#ifdef VERBOSE
+			printf("Matches: %d, Input packet length: %u, Result packet length: %d, seqnum/checksum: %u\n", res, pkt->pkthdr.caplen, size, packet->seqnum);
+#endif
+			// Send results packet
+			if (size) {
+				capture_send(processor->capture, &(pkt->pkthdr), data, size);
+			}
+		}
+	}
+
+	free_buffered_packet(pkt);
+}
+
+// Scans bytes skip to end of the payload of a packet (report positions are still relative to the whole payload)
+static inline void scan_payload(ProcessorData *processor, int id, int *current, InPacket *pkt, unsigned int skip, unsigned int end, ContentMatchReport *reports, unsigned char *data) {
+	Packet *packet;
+	unsigned char *payload;
+	int res, i;
+
+	packet = &(pkt->packet);
+	payload = packet->payload + skip;
+
+	// Scan payload
+	MATCH_TABLE_MACHINE(processor->machine, *current, payload, end - skip, reports, res);
+	if (skip) {
+		for (i = 0; i < res; i++) {
+			reports[i].position += skip;
+		}
+	}
+
+	processor->bytes[id] += end - skip;
+
+	// (a packet with no payload is not marked as scanned: there is nothing to scan in it)
+	send_packet(processor, id, pkt, packet->payload_len > 0, reports, res, data);
+}
+
+static inline void scan_packet(ProcessorData *processor, int id, int *current, InPacket *pkt, ContentMatchReport *reports, unsigned char *data) {
+	// TODO: Per-flow scan of non-TCP traffic (remember current state for each flow)
+	scan_payload(processor, id, current, pkt, 0, pkt->packet.payload_len, reports, data);
+}
+
+// The scan depth of a TCP flow direction: that of its server port (either port may be the server's), or the global one
+static inline unsigned int get_scan_depth(ProcessorData *processor, Stream *stream) {
+	unsigned int depth;
+
+	if (processor->port_depth) {
+		if ((depth = processor->port_depth[ntohs(stream->tp_dst)]) != PORT_DEPTH_UNSET)
+			return depth;
+		if ((depth = processor->port_depth[ntohs(stream->tp_src)]) != PORT_DEPTH_UNSET)
+			return depth;
+	}
+	return processor->scan_depth;
+}
+
+/*
+ * Scans a TCP segment in stream order, continuing from the state its flow's previous segment ended in.
+ * Bytes already scanned (of a retransmission) are not scanned again, but the segment is still forwarded.
+ * Once the flow's scan depth is reached, the rest of the flow is forwarded without scanning.
+ */
+static void deliver_segment(Stream *stream, InPacket *pkt, unsigned int skip, void *arg) {
+	WorkerData *worker;
+	ProcessorData *processor;
+	unsigned int depth, end;
+
+	worker = (WorkerData*)arg;
+	processor = worker->processor;
+
+	if (stream->bypass) {
+		processor->bypassed_bytes[worker->id] += pkt->packet.payload_len;
+		send_packet(processor, worker->id, pkt, 0, worker->reports, 0, worker->data);
+		return;
+	}
+
+	end = pkt->packet.payload_len;
+	depth = get_scan_depth(processor, stream);
+	if (depth && stream->delivered + (end - skip) >= depth) {
+		// The last bytes of the flow to scan
+		end = skip + (depth - stream->delivered);
+		stream->bypass = 1;
+		processor->bypassed_flows[worker->id]++;
+		processor->bypassed_bytes[worker->id] += pkt->packet.payload_len - end;
+	}
+	scan_payload(processor, worker->id, &(stream->scan_state), pkt, skip, end, worker->reports, worker->data);
+}
+
+/*
+ * Scans the payload of a reassembled datagram at once, so patterns that span fragments are found.
+ * Each fragment is then forwarded with the reports that end in it, their positions mapped back to
+ * the fragment's own payload (a report of a pattern that starts in an earlier fragment has a negative index).
+ */
+static void scan_datagram(ProcessorData *processor, WorkerData *worker, int *current, DefragDatagram *dg, ContentMatchReport *reports, unsigned char *data, unsigned char *buf) {
+	Packet datagram;
+	DefragFragment *f;
+	Packet *packet;
+	unsigned char *frag_data;
+	unsigned int len, scan_start, start, end;
+	int res, i, r, first;
+
+	len = defrag_reassemble(&(worker->defrag), dg, buf);
+	packet_parse_ip(buf, len, &datagram);
+
+	MATCH_TABLE_MACHINE(processor->machine, *current, datagram.payload, datagram.payload_len, reports, res);
+
+	processor->bytes[worker->id] += datagram.payload_len;
+
+	// Offset of the scanned payload in the datagram payload (which follows the first fragment's header:
+	// IPv6 extension headers after the Fragment header are part of it)
+	scan_start = datagram.payload ? datagram.payload - (buf + dg->fragments[0].packet->packet.ip_hdr_len) : 0;
+
+	r = 0;
+	for (i = 0; i < dg->num_fragments; i++) {
+		f = &(dg->fragments[i]);
+		packet = &(f->packet->packet);
+		// Where the fragment's own payload starts (after the transport header in the first fragment)
+		frag_data = f->packet->pktdata + packet->l3_offset + packet->ip_hdr_len;
+		start = f->offset + (packet->payload ? packet->payload - frag_data : 0);
+		end = f->offset + f->len;
+		first = r;
+		while (r < res && scan_start + reports[r].position < end) {
+			reports[r].position = scan_start + reports[r].position - start;
+			r++;
+		}
+		send_packet(processor, worker->id, f->packet, 1, reports + first, r - first, data);
+	}
+	defrag_free_datagram(dg);
+}
+
+// Scans the fragments of the datagrams that could not be reassembled (in time, or in memory) one by one
+static void expire_datagrams(ProcessorData *processor, WorkerData *worker, int *current, ContentMatchReport *reports, unsigned char *data, unsigned long now) {
+	DefragDatagram *dg;
+	int i;
+
+	while ((dg = defrag_next_expired(&(worker->defrag), now))) {
+		for (i = 0; i < dg->num_fragments; i++) {
+			scan_packet(processor, worker->id, current, dg->fragments[i].packet, reports, data);
+		}
+		defrag_free_datagram(dg);
+	}
+}
+
 void *worker_start(void *param) {
 	WorkerData *workerData;
 	ProcessorData *processor;
 	PacketBuffer *queue;
 	InPacket *pkt;
+	DefragDatagram *dg;
+	unsigned long now;
 	int current;
-	int res, r;
-	Packet *packet;
-	unsigned char *ptr;
 	ContentMatchReport reports[MAX_REPORTS];
 	unsigned char data[MAX_PACKET_SIZE];
-	int size, id;
+	unsigned char datagram[DEFRAG_BUFFER_SIZE];
+	int id;
 
 	workerData = (WorkerData*)param;
 	processor = workerData->processor;
 	queue = workerData->queue;
 	id = workerData->id;
+	workerData->reports = reports;
+	workerData->data = data;
 	current = 0;
 
 	pkt = NULL;
 
 	while ((pkt = packet_buffer_dequeue(queue)) || !processor->terminated) {
 		if (!pkt) {
+			if (processor->defrag_policy != NO_DEFRAG) {
+				expire_datagrams(processor, workerData, &current, reports, data, get_time_ms());
+			}
+			if (processor->streams) {
+				stream_table_expire(&(workerData->streams), get_time_ms());
+			}
 			nanosleep(&_100_nanos, NULL);
 			continue;
 		}
@@ -616,69 +761,59 @@ void *worker_start(void *param) {
 			gettimeofday(&(processor->first_packet[id]), NULL);
 		}
 
-		packet = &(pkt->packet);
-
-		// Scan payload
-		// TODO: Per-flow scan (remember current state for each flow)
-		MATCH_TABLE_MACHINE(processor->machine, current, packet->payload, packet->payload_len, reports, res);
-
-		processor->bytes[id] += packet->payload_len;
-
-		if (processor->no_report) {
-			// Count reports
-			r = count_results_for_noreport_mode(processor, reports, res);
-			processor->total_reports[id] += r;
-			// Forward packet
-			pcap_sendpacket(processor->pcap_out, pkt->pktdata, pkt->pkthdr.len);
-		} else {
-			// Send original packet
-			if (!res) {
-				// No matches - send as is
-				pcap_sendpacket(processor->pcap_out, pkt->pktdata, pkt->pkthdr.len);
-			} else if (USE_NSH) {
-				size = build_nsh_result_packet(processor, &(pkt->pkthdr), pkt->pktdata, packet, reports, res, data);
-				if (size) {
-					// Send results packet
-					pcap_sendpacket(processor->pcap_out, data, size);
-				}
-			} else {
-				// Matches exist - change ECN to 11b and send
-				ptr = (unsigned char *)(pkt->pktdata);
-				ptr[processor->linkHdrLen + 1] = ptr[processor->linkHdrLen + 1] | 0xC0;
-				pcap_sendpacket(processor->pcap_out, ptr, pkt->pkthdr.len);
-
-				// Build results packet
-				size = build_result_packet(processor, &(pkt->pkthdr), pkt->pktdata, packet, reports, res, data);
-#ifdef VERBOSE
-				printf("Matches: %d, Input packet length: %u, Result packet length: %d, seqnum/checksum: %u\n", res, pkt->pkthdr.len, size, packet->seqnum);
-#endif
-				// Send results packet
-				if (size) {
-					pcap_sendpacket(processor->pcap_out, data, size);
-				}
+		if (processor->defrag_policy != NO_DEFRAG && PACKET_IS_FRAGMENT(&(pkt->packet))) {
+			now = pkt->timestamp;
+			switch (defrag_add(&(workerData->defrag), pkt, now, &dg)) {
+			case DEFRAG_COMPLETE:
+				scan_datagram(processor, workerData, &current, dg, reports, data, datagram);
+				break;
+			case DEFRAG_REJECTED:
+				scan_packet(processor, id, &current, pkt, reports, data);
+				break;
 			}
+			expire_datagrams(processor, workerData, &current, reports, data, now);
+		} else if (processor->streams && IS_TCP_SEGMENT(&(pkt->packet))) {
+			now = pkt->timestamp;
+			stream_table_segment(&(workerData->streams), pkt, now);
+			stream_table_expire(&(workerData->streams), now);
+		} else {
+			scan_packet(processor, id, &current, pkt, reports, data);
 		}
 
-		free_buffered_packet(pkt);
 		gettimeofday(&(processor->last_packet[id]), NULL);
 	}
 
+	// Forward the fragments that are still held
+	expire_datagrams(processor, workerData, &current, reports, data, (unsigned long)-1);
+	// And the TCP segments
+	stream_table_destroy(&(workerData->streams));
+
 	return NULL;
 }
 
-void process_packet(unsigned char *arg, const struct pcap_pkthdr *pkthdr, const unsigned char *packetptr) {
+void process_packets(InPacket **packets, int count, void *arg) {
 	ProcessorData *processor;
-	Packet packet;
-	InPacket *bpkt;
+	Packet *packet;
+	unsigned long now;
+	int i;
 
 	processor = (ProcessorData*)arg;
-
-	parse_packet(processor, packetptr, &packet);
-
-	bpkt = buffer_packet(&packet, pkthdr, packetptr, 0);
-	packet_buffer_enqueue(&(processor->queues[processor->next_queue]), bpkt);
-
-	processor->next_queue = (processor->next_queue + 1) % (processor->num_workers);
+	now = get_time_ms();
+
+	for (i = 0; i < count; i++) {
+		packet = &(packets[i]->packet);
+		packets[i]->timestamp = now;
+		if (PACKET_IS_FRAGMENT(packet)) {
+			// All the fragments of a datagram go to the same worker (which reassembles them)
+			packet_buffer_enqueue(&(processor->queues[(packet->ip_src ^ packet->ip_dst ^ packet->frag_id) % processor->num_workers]), packets[i]);
+		} else if (processor->streams && IS_TCP_SEGMENT(packet)) {
+			// All the segments of a flow go to the same worker (which reassembles its stream)
+			packet_buffer_enqueue(&(processor->queues[(packet->ip_src ^ packet->ip_dst ^ packet->transport.tp_src ^ packet->transport.tp_dst) % processor->num_workers]), packets[i]);
+		} else {
+			packet_buffer_enqueue(&(processor->queues[processor->next_queue]), packets[i]);
+			processor->next_queue = (processor->next_queue + 1) % (processor->num_workers);
+		}
+	}
 }
 
 void stop(int res) {
@@ -689,6 +824,11 @@ void stop(int res) {
 	double throughput[MAX_THREADS];
 	double total_throughput;
 	long total_reports;
+	Defrag *defrag;
+	unsigned long reassembled, expired, evicted, overlaps;
+	StreamTable *streams;
+	unsigned long in_order, reordered, retransmitted, trimmed, gaps, flows_evicted;
+	long bypassed_flows, bypassed_bytes;
 
 	_global_processor->terminated = 1;
 
@@ -740,7 +880,42 @@ void stop(int res) {
 		}
 	}
 
+	reassembled = expired = evicted = overlaps = 0;
+	for (i = 0; i < _global_processor->num_workers; i++) {
+		defrag = &(_global_processor->workerData[i].defrag);
+		reassembled += defrag->reassembled;
+		expired += defrag->expired;
+		evicted += defrag->evicted;
+		overlaps += defrag->overlaps;
+	}
+
+	in_order = reordered = retransmitted = trimmed = gaps = flows_evicted = 0;
+	for (i = 0; i < _global_processor->num_workers; i++) {
+		streams = &(_global_processor->workerData[i].streams);
+		in_order += streams->in_order;
+		reordered += streams->reordered;
+		retransmitted += streams->retransmitted;
+		trimmed += streams->trimmed;
+		gaps += streams->gaps;
+		flows_evicted += streams->evicted;
+	}
+
+	bypassed_flows = bypassed_bytes = 0;
+	for (i = 0; i < _global_processor->num_workers; i++) {
+		bypassed_flows += _global_processor->bypassed_flows[i];
+		bypassed_bytes += _global_processor->bypassed_bytes[i];
+	}
+
 	if (!_global_processor->batch_mode) {
+		if (_global_processor->defrag_policy != NO_DEFRAG) {
+			printf("[Sniffer] Fragmented datagrams: %lu reassembled, %lu timed out, %lu evicted, %lu with overlaps\n", reassembled, expired, evicted, overlaps);
+		}
+		if (_global_processor->streams) {
+			printf("[Sniffer] TCP segments: %lu in order, %lu reordered, %lu retransmitted, %lu trimmed; %lu gaps skipped, %lu flows evicted\n", in_order, reordered, retransmitted, trimmed, gaps, flows_evicted);
+		}
+		if (_global_processor->scan_depth || _global_processor->port_depth) {
+			printf("[Sniffer] Scan depth reached by %ld flows, %ld bytes forwarded without scanning\n", bypassed_flows, bypassed_bytes);
+		}
 		if (!(_global_processor->no_report)) {
 			printf("+--------------------------- Timing Results --------------------------+\n");
 			printf("| Thrd. | Total Time (usec) | Total Bytes (bytes) | Throughput (Mbps) |\n");
@@ -780,14 +955,18 @@ void stop(int res) {
 		} else {
 			printf("RES\tTOT\t%d\t------\t%ld\t%f\t%ld\n", _global_processor->machine->total_rules, total_bytes, total_throughput, total_reports);
 		}
+		if (_global_processor->defrag_policy != NO_DEFRAG) {
+			printf("FRG\t%lu\t%lu\t%lu\t%lu\n", reassembled, expired, evicted, overlaps);
+		}
+		if (_global_processor->streams) {
+			printf("STR\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\n", in_order, reordered, retransmitted, trimmed, gaps, flows_evicted);
+		}
+		if (_global_processor->scan_depth || _global_processor->port_depth) {
+			printf("DPT\t%ld\t%ld\n", bypassed_flows, bypassed_bytes);
+		}
 	}
 
-	if (_global_processor->pcap_in) {
-		pcap_close(_global_processor->pcap_in);
-	}
-	if (_global_processor->pcap_out) {
-		pcap_close(_global_processor->pcap_out);
-	}
+	capture_close(_global_processor->capture);
 
 	destroy_processor(_global_processor);
 
@@ -795,189 +974,16 @@ void stop(int res) {
 }
 
 
-void sniff(char *in_if, char *out_if, char *in_file, char *out_file, TableStateMachine *machine, int num_workers, int no_report, int batch) {
-	pcap_t *hpcap[2];
-	char errbuf[PCAP_ERRBUF_SIZE];
-	char *device_in = NULL, *device_out = NULL;
-	pcap_if_t *devices, *next_device;
-	int res;
-	struct bpf_program bpf;
+void sniff(char *in_if, char *out_if, char *in_file, char *out_file, TableStateMachine *machine, int num_workers, int no_report, int mark_clean, int batch, int rid_size,
+		int defrag_policy, unsigned long defrag_mem, unsigned long defrag_timeout, int streams, unsigned long stream_mem, unsigned int scan_depth, unsigned int *port_depth) {
+	Capture capture;
 	ProcessorData *processor;
-    int linktype[2], linkHdrLen, i;
-    char *mode;
-
-	memset(errbuf, 0, PCAP_ERRBUF_SIZE);
-
-	if (in_if || out_if) {
-		// Find available interfaces
-		if (pcap_findalldevs(&devices, errbuf)) {
-			fprintf(stderr, "[Sniffer] ERROR: Cannot find network interface (pcap_findalldevs error: %s)\n", errbuf);
-			exit(1);
-		}
-
-		// Find requested interface
-		next_device = devices;
-		while (next_device) {
-			printf("[Sniffer] Found network interface: %s\n", next_device->name);
-			if (in_if && (strcmp(in_if, next_device->name) == 0)) {
-				device_in = in_if;
-			}
-			if (out_if && (strcmp(out_if, next_device->name) == 0)) {
-				device_out = out_if;
-			}
-			next_device = next_device->next;
-		}
-		pcap_freealldevs(devices);
-		if (in_if && (strcmp(in_if, STR_ANY) == 0)) {
-			device_in = STR_ANY;
-		}
-
-		if (in_if && !device_in) {
-			fprintf(stderr, "[Sniffer] ERROR: Cannot find input network interface\n");
-			exit(1);
-		}
-		if (out_if && !device_out) {
-			fprintf(stderr, "[Sniffer] ERROR: Cannot find output network interface\n");
-			exit(1);
-		}
-	}
-
-	if (in_if) {
-		printf("[Sniffer] Sniffer is capturing from device: %s\n", device_in);
-	} else {
-		printf("[Sniffer] Sniffer is reading packets from file: %s\n", in_file);
-	}
-	if (out_if) {
-		printf("[Sniffer] Packets are sent on device: %s\n", device_out);
-	} else {
-		printf("[Sniffer] Packets written to file: %s\n", out_file);
-	}
-
-	if (in_if) {
-		hpcap[0] = pcap_create(device_in, errbuf);
-	} else {
-		hpcap[0] = pcap_open_offline(in_file, errbuf);
-	}
-	if (out_if) {
-		hpcap[1] = pcap_create(device_out, errbuf);
-	} else {
-		//hpcap[1] = pcap_dump_fopen(out_file, errbuf);
-	}
-
-	for (i = 0; i < 2; i++) {
-		mode = (i == 0) ? "input" : "output";
-		// Check pcap handle
-		if (!hpcap[i]) {
-			fprintf(stderr, "[Sniffer] ERROR: Cannot create %s pcap handle (pcap_create/pcap_open_offline error: %s)\n", mode ,errbuf);
-			exit(1);
-		}
-
-		if (in_if && i == 0) {
-			// Set promiscuous mode
-			pcap_set_promisc(hpcap[0], 1);
-		}
-
-		// Activate PCAP
-		if ((in_if && i == 0) || (out_if && i == 1)) {
-			res = pcap_activate(hpcap[i]);
-			switch (res) {
-			case 0:
-				// Success
-				break;
-			case PCAP_WARNING_PROMISC_NOTSUP:
-				fprintf(stderr, "[Sniffer] WARNING: Promiscuous mode is not supported\n");
-				exit(1);
-				break;
-			case PCAP_WARNING:
-				fprintf(stderr, "[Sniffer] WARNING: Unknown (%s)\n", pcap_geterr(hpcap[i]));
-				exit(1);
-				break;
-			case PCAP_ERROR_NO_SUCH_DEVICE:
-				fprintf(stderr, "[Sniffer] ERROR: Device not found\n");
-				exit(1);
-				break;
-			case PCAP_ERROR_PERM_DENIED:
-				fprintf(stderr, "[Sniffer] ERROR: Permission denied\n");
-				exit(1);
-				break;
-			case PCAP_ERROR_PROMISC_PERM_DENIED:
-				fprintf(stderr, "[Sniffer] ERROR: Permission denied for promiscuous mode\n");
-				exit(1);
-				break;
-			case PCAP_ERROR_RFMON_NOTSUP:
-				fprintf(stderr, "[Sniffer] ERROR: Monitor mode is not supported\n");
-				exit(1);
-				break;
-			case PCAP_ERROR_IFACE_NOT_UP:
-				fprintf(stderr, "[Sniffer] ERROR: Interface %s is not available\n", (i == 0) ? device_in : device_out);
-				exit(1);
-				break;
-			default:
-				fprintf(stderr, "[Sniffer] ERROR: Unknown (%s)\n", pcap_geterr(hpcap[i]));
-				exit(1);
-				break;
-			}
-		}
-
-		if (i == 0) {
-			if (in_if) {
-				// Set capture direction (ingress only)
-				res = pcap_setdirection(hpcap[0], PCAP_D_IN);
-				if (res) {
-					fprintf(stderr, "[Sniffer] ERROR: Cannot set capture direction (pcap_setdirection error: %s, return value: %d)\n", pcap_geterr(hpcap[0]), res);
-					exit(1);
-				}
-			}
-			// Compile PCAP filter (IP packets)
-			res = pcap_compile(hpcap[0], &bpf, STR_FILTER, 0, PCAP_NETMASK_UNKNOWN);
-			if (res) {
-				fprintf(stderr, "[Sniffer] ERROR: Cannot compile packet filter (pcap_compile error: %s)\n", pcap_geterr(hpcap[0]));
-				exit(1);
-			}
-
-			res = pcap_setfilter(hpcap[0], &bpf);
-			if (res) {
-				fprintf(stderr, "[Sniffer] ERROR: Cannot set packet filter (pcap_setfilter error: %s, return value: %d)\n", pcap_geterr(hpcap[0]), res);
-				exit(1);
-			}
-			pcap_freecode(&bpf);
-		}
-
-		// Find data link type
-		if ((linktype[i] = pcap_datalink(hpcap[i])) < 0)
-		{
-			fprintf(stderr, "[Sniffer] Cannot determine data link type (pcap_datalink error: %s)\n", pcap_geterr(hpcap[i]));
-			exit(1);
-		}
-		if (i == 1 && linktype[0] != linktype[1]) {
-			fprintf(stderr, "[Sniffer] Incompatible link types (input=%d, output=%d)\n", linktype[0], linktype[1]);
-			exit(1);
-		}
-	}
-
-	linkHdrLen = 0;
-	switch (linktype[0])
-	{
-	case DLT_NULL:
-		linkHdrLen = 4;
-		break;
-
-	case DLT_EN10MB:
-		linkHdrLen = 14;
-		break;
-
-	case DLT_SLIP:
-	case DLT_PPP:
-		linkHdrLen = 24;
-		break;
+	int res;
 
-	default:
-		fprintf(stderr, "[Sniffer] Unsupported data link type: %d\n", linktype[0]);
-		exit(1);
-	}
+	capture_open(&capture, in_if, out_if, in_file, out_file, 0);
 
 	// Prepare processor
-	processor = init_processor(machine, hpcap[0], hpcap[1], linkHdrLen, num_workers, no_report, batch);
+	processor = init_processor(machine, &capture, num_workers, no_report, mark_clean, batch, rid_size, defrag_policy, defrag_mem, defrag_timeout, streams, stream_mem, scan_depth, port_depth);
 	_global_processor = processor;
 
 	// Set signal handler
@@ -988,7 +994,7 @@ void sniff(char *in_if, char *out_if, char *in_file, char *out_file, TableStateM
 	// Run sniffer
 	gettimeofday(&(processor->start), NULL);
 	printf("[Sniffer] Sniffer is running (input: %s, outout: %s)...\n", in_if, out_if);
-	res = pcap_loop(hpcap[0], -1, process_packet, (unsigned char *)(processor));
+	res = capture_loop(&capture, CAPTURE_BATCH_SIZE, process_packets, processor);
 
 	stop(res);
 }
@@ -1002,8 +1008,12 @@ int main(int argc, char *argv[]) {
 	char *patterns = NULL;
 	int i;
 	char *param, *arg;
-	int auto_mode, no_report, batch, max_rules;
-	int num_workers;
+	int auto_mode, no_report, mark_clean, batch, max_rules;
+	int num_workers, rid_size, dfa_threads, full_depth;
+	int defrag_policy, streams;
+	long defrag_mem, defrag_timeout, stream_mem, scan_depth, depth;
+	unsigned int *port_depth;
+	char *port;
 
 
 	// ************* BEGIN DEBUG
@@ -1015,9 +1025,20 @@ int main(int argc, char *argv[]) {
 
 	auto_mode = 0;
 	no_report = 0;
+	mark_clean = 0;
 	num_workers = 1;
 	batch = 0;
 	max_rules = 0;
+	rid_size = 0;
+	dfa_threads = 1;
+	full_depth = 0;
+	defrag_policy = DEFRAG_POLICY_FIRST;
+	defrag_mem = DEFAULT_DEFRAG_MEM;
+	defrag_timeout = DEFAULT_DEFRAG_TIMEOUT;
+	streams = 0;
+	stream_mem = DEFAULT_STREAM_MEM;
+	scan_depth = 0;
+	port_depth = NULL;
 
 	if (argc > 1) {
 		for (i = 1; i < argc; i++) {
@@ -1037,6 +1058,51 @@ int main(int argc, char *argv[]) {
 				max_rules = atoi(arg);
 			} else if (strcmp(param, "workers") == 0) {
 				num_workers = atoi(arg);
+			} else if (strcmp(param, "dfathreads") == 0) {
+				dfa_threads = atoi(arg);
+			} else if (strcmp(param, "fulldepth") == 0) {
+				full_depth = atoi(arg);
+			} else if (strcmp(param, "ridsize") == 0) {
+				rid_size = atoi(arg);
+			} else if (strcmp(param, "defrag") == 0 && arg) {
+				if (strcmp(arg, "first") == 0) {
+					defrag_policy = DEFRAG_POLICY_FIRST;
+				} else if (strcmp(arg, "last") == 0) {
+					defrag_policy = DEFRAG_POLICY_LAST;
+				} else if (strcmp(arg, "off") == 0) {
+					defrag_policy = NO_DEFRAG;
+				} else {
+					fprintf(stderr, "[Sniffer] ERROR: Unknown fragment overlap policy: %s\n", arg);
+					exit(1);
+				}
+			} else if (strcmp(param, "defragmem") == 0 && arg) {
+				defrag_mem = atol(arg);
+			} else if (strcmp(param, "defragtimeout") == 0 && arg) {
+				defrag_timeout = atol(arg);
+			} else if (strcmp(param, "streams") == 0) {
+				streams = 1;
+			} else if (strcmp(param, "streammem") == 0 && arg) {
+				stream_mem = atol(arg);
+			} else if (strcmp(param, "depth") == 0 && arg) {
+				scan_depth = atol(arg);
+			} else if (strcmp(param, "portdepth") == 0 && arg) {
+				port = strsep(&arg, ":");
+				depth = arg ? atol(arg) : -1;
+				if (depth < 0 || atoi(port) < 1 || atoi(port) >= NUM_PORTS) {
+					fprintf(stderr, "[Sniffer] ERROR: Invalid port scan depth: %s\n", port);
+					exit(1);
+				}
+				if (!port_depth) {
+					port_depth = (unsigned int*)malloc(sizeof(unsigned int) * NUM_PORTS);
+					if (!port_depth) {
+						fprintf(stderr, "FATAL: Out of memory\n");
+						exit(1);
+					}
+					memset(port_depth, 0xFF, sizeof(unsigned int) * NUM_PORTS); // PORT_DEPTH_UNSET
+				}
+				port_depth[atoi(port)] = depth;
+			} else if (strcmp(param, "markclean") == 0) {
+				mark_clean = 1;
 			} else if (strcmp(param, "noreport") == 0) {
 				no_report = 1;
 			} else if (strcmp(param, "batch") == 0) {
@@ -1048,7 +1114,8 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	if (auto_mode == 0 && ((in_if == NULL && in_file == NULL) || (out_if == NULL && out_file == NULL) || patterns == NULL || max_rules < 0 || num_workers < 1)) {
+	if (auto_mode == 0 && ((in_if == NULL && in_file == NULL) || (out_if == NULL && out_file == NULL) || patterns == NULL || max_rules < 0 || num_workers < 1 || dfa_threads < 1 || full_depth < 0 || defrag_mem < 1 || defrag_timeout < 1 || stream_mem < 1 || scan_depth < 0 ||
+			(rid_size != 0 && rid_size != RULE_ID_SIZE_16 && rid_size != RULE_ID_SIZE_32))) {
 		// Show usage
 		fprintf(stderr, USAGE, argv[0]);
 		exit(1);
@@ -1061,7 +1128,21 @@ int main(int argc, char *argv[]) {
 		num_workers = 1;
 	}
 
-	machine = generateTableStateMachine(patterns, max_rules, 0);
+	if (scan_depth || port_depth) {
+		// The scan depth is kept per TCP flow
+		streams = 1;
+	}
+
+	machine = generateTableStateMachine(patterns, max_rules, dfa_threads, full_depth, 0);
+
+	// Negotiate the rule ID width: wide IDs are only used if the rule set needs them
+	if (rid_size == 0) {
+		rid_size = (machine->max_rid > RULE_ID_MAX_16) ? RULE_ID_SIZE_32 : RULE_ID_SIZE_16;
+	} else if (rid_size == RULE_ID_SIZE_16 && machine->max_rid > RULE_ID_MAX_16) {
+		fprintf(stderr, "[Sniffer] ERROR: Rule ID %u does not fit in %d bits (use ridsize=%d)\n", machine->max_rid, RULE_ID_SIZE_16, RULE_ID_SIZE_32);
+		exit(1);
+	}
+	printf("[Sniffer] Using %d bit rule IDs in match reports\n", rid_size);
 
 	// ************* BEGIN DEBUG
 	//void process_packet(unsigned char *arg, const struct pcap_pkthdr *pkthdr, const unsigned char *packetptr)
@@ -1071,7 +1152,7 @@ int main(int argc, char *argv[]) {
 	// ************* END
 
 
-	sniff(in_if, out_if, in_file, out_file, machine, num_workers, no_report, batch);
+	sniff(in_if, out_if, in_file, out_file, machine, num_workers, no_report, mark_clean, batch, rid_size, defrag_policy, defrag_mem, defrag_timeout, streams, stream_mem, scan_depth, port_depth);
 
 	return 0;
 }
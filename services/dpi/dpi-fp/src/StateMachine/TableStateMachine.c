@@ -16,7 +16,7 @@
 #define MAX_PATTERN_LENGTH 1024
 
 
-TableStateMachine *createTableStateMachine(unsigned int numStates, int totalRules) {
+TableStateMachine *createTableStateMachine(unsigned int numStates, unsigned int numFullStates, int totalRules) {
 	TableStateMachine *machine;
 	STATE_PTR_TYPE_WIDE *table;
 	unsigned char *matches;
@@ -28,8 +28,8 @@ TableStateMachine *createTableStateMachine(unsigned int numStates, int totalRule
 #endif
 
 	machine = (TableStateMachine*)malloc(sizeof(TableStateMachine));
-	table = (STATE_PTR_TYPE_WIDE*)malloc(sizeof(STATE_PTR_TYPE_WIDE) * numStates * 256);
-	matches = (unsigned char*)malloc(sizeof(unsigned char) * (int)(ceil(numStates / 8.0)));
+	table = (STATE_PTR_TYPE_WIDE*)malloc(sizeof(STATE_PTR_TYPE_WIDE) * numFullStates * 256);
+	matches = (unsigned char*)malloc(sizeof(unsigned char) * (size_t)(ceil(numStates / 8.0)));
 	//patterns = (char**)malloc(sizeof(char*) * numStates);
 	rules = (MatchRule**)malloc(sizeof(MatchRule*) * numStates);
 	numRules = (int*)malloc(sizeof(int) * numStates);
@@ -37,19 +37,25 @@ TableStateMachine *createTableStateMachine(unsigned int numStates, int totalRule
 	depthMap = (int*)malloc(sizeof(int) * numStates);
 #endif
 
-	memset(table, 0, sizeof(STATE_PTR_TYPE_WIDE) * numStates * 256);
-	memset(matches, 0, sizeof(unsigned char) * (int)(ceil(numStates / 8.0)));
+	memset(table, 0, sizeof(STATE_PTR_TYPE_WIDE) * numFullStates * 256);
+	memset(matches, 0, sizeof(unsigned char) * (size_t)(ceil(numStates / 8.0)));
 	//memset(patterns, 0, sizeof(char*) * numStates);
 	memset(rules, 0, sizeof(MatchRule*) * numStates);
 	memset(numRules, 0, sizeof(int) * numStates);
 
 	machine->table = table;
 	machine->numStates = numStates;
+	machine->numFullStates = numFullStates;
+	machine->sparseIdx = NULL;
+	machine->sparseChars = NULL;
+	machine->sparseNext = NULL;
+	machine->sparseDefault = NULL;
 	machine->matches = matches;
 	//machine->patterns = patterns;
 	machine->matchRules = rules;
 	machine->numRules = numRules;
 	machine->total_rules = totalRules;
+	machine->max_rid = 0;
 #ifdef DEPTHMAP
 	machine->depthMap = depthMap;
 #endif
@@ -74,6 +80,10 @@ void destroyTableStateMachine(TableStateMachine *machine) {
 	free(machine->numRules);
 	free(machine->matches);
 	free(machine->table);
+	free(machine->sparseIdx);
+	free(machine->sparseChars);
+	free(machine->sparseNext);
+	free(machine->sparseDefault);
 #ifdef DEPTHMAP
 	free(machine->depthMap);
 #endif
@@ -121,13 +131,18 @@ void setMatch(TableStateMachine *machine, STATE_PTR_TYPE_WIDE state, MatchRule *
 		rulesCpy[i].len = rules[i].len;
 		rulesCpy[i].is_regex = rules[i].is_regex;
 		rulesCpy[i].rid = rules[i].rid;
+		rulesCpy[i].offset = rules[i].offset;
+		rulesCpy[i].depth = rules[i].depth;
+		if (rules[i].rid > machine->max_rid) {
+			machine->max_rid = rules[i].rid;
+		}
 	}
 	machine->matchRules[state] = rulesCpy;
 	machine->numRules[state] = numRules;
 }
 
 STATE_PTR_TYPE_WIDE getNextStateFromTable(TableStateMachine *machine, STATE_PTR_TYPE_WIDE currentState, char c) {
-	return GET_NEXT_STATE(machine->table, currentState, c);
+	return GET_NEXT_STATE_HYBRID(machine, currentState, c);
 }
 
 int matchTableMachine(TableStateMachine *machine, char *input, int length, int verbose) {
@@ -144,7 +159,7 @@ int matchTableMachine(TableStateMachine *machine, char *input, int length, int v
 	current = 0;
 
 	while (idx < length) {
-		next = GET_NEXT_STATE(table, current, input[idx]);
+		next = (current < machine->numFullStates) ? GET_NEXT_STATE(table, current, input[idx]) : getSparseNextState(machine, current, input[idx]);
 		if (GET_1BIT_ELEMENT(matches, next)) {
 			// It's a match!
 			res = 1;
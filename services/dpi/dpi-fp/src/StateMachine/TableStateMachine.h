@@ -14,6 +14,12 @@
 
 #define MAX_REPORTS 1024
 
+/*
+ * States [0, numFullStates) have a full row of 256 transitions in table. When the machine is built
+ * with a limited full depth, the (BFS numbered) deeper states have sparse rows instead: the few
+ * transitions that differ from the full row of their default state, which is the first state with a
+ * full row on their failure chain. All other characters go through the default state's row.
+ */
 typedef struct {
 	STATE_PTR_TYPE_WIDE *table;
 	unsigned char *matches;
@@ -21,13 +27,19 @@ typedef struct {
 	MatchRule **matchRules; // A pointer to an array of per-state array of match rules
 	int *numRules; // An array of per state number of rules
 	unsigned int numStates;
+	unsigned int numFullStates;
+	unsigned int *sparseIdx; // Per sparse state: first entry in sparseChars/sparseNext (one extra entry at the end)
+	unsigned char *sparseChars;
+	STATE_PTR_TYPE_WIDE *sparseNext;
+	STATE_PTR_TYPE_WIDE *sparseDefault; // Per sparse state: the full row state for all other characters
 	int total_rules;
+	unsigned int max_rid;
 #ifdef DEPTHMAP
 	int *depthMap;
 #endif
 } TableStateMachine;
 
-TableStateMachine *createTableStateMachine(unsigned int numStates, int totalRules);
+TableStateMachine *createTableStateMachine(unsigned int numStates, unsigned int numFullStates, int totalRules);
 void destroyTableStateMachine(TableStateMachine *machine);
 
 void setGoto(TableStateMachine *machine, STATE_PTR_TYPE_WIDE currentState, char c, STATE_PTR_TYPE_WIDE nextState);
@@ -36,11 +48,26 @@ void setMatch(TableStateMachine *machine, STATE_PTR_TYPE_WIDE state, MatchRule *
 int matchTableMachine(TableStateMachine *tableMachine, char *input, int length, int verbose);
 
 #define GET_TABLE_IDX(state, c) \
-	(((state) * 256) + (unsigned char)(c))
+	((((size_t)(state)) * 256) + (unsigned char)(c))
 
 #define GET_NEXT_STATE(table, state, c) \
 	((table)[GET_TABLE_IDX(state, c)])
 
+static inline STATE_PTR_TYPE_WIDE getSparseNextState(TableStateMachine *machine, STATE_PTR_TYPE_WIDE state, char c) {
+	unsigned int k, j, end;
+
+	k = state - machine->numFullStates;
+	end = machine->sparseIdx[k + 1];
+	for (j = machine->sparseIdx[k]; j < end; j++) {
+		if (machine->sparseChars[j] == (unsigned char)c)
+			return machine->sparseNext[j];
+	}
+	return GET_NEXT_STATE(machine->table, machine->sparseDefault[k], c);
+}
+
+#define GET_NEXT_STATE_HYBRID(machine, state, c) \
+	(((state) < (machine)->numFullStates) ? GET_NEXT_STATE((machine)->table, state, c) : getSparseNextState(machine, state, c))
+
 // Params:
 //   TableStateMachine *machine, STATE_PTR_TYPE_WIDE current, char *input, int length, MatchReport *reports, int res
 #define MATCH_TABLE_MACHINE(machine, current, input, length, reports, res) \
@@ -55,17 +82,38 @@ int matchTableMachine(TableStateMachine *tableMachine, char *input, int length,
 	matches = (machine)->matches;												\
 	idx = 0;																	\
 																				\
-	while (idx < (length)) {													\
-		next = GET_NEXT_STATE(table, (current), input[idx]);					\
-		if (GET_1BIT_ELEMENT(matches, next)) {									\
-			/* It's a match! */													\
-			(reports)[res].position = idx;										\
-			(reports)[res++].state = next;										\
-			if (res == MAX_REPORTS)												\
-				break;															\
+	if ((machine)->numFullStates == (machine)->numStates) {						\
+		/* Full table */														\
+		while (idx < (length)) {												\
+			next = GET_NEXT_STATE(table, (current), input[idx]);				\
+			if (GET_1BIT_ELEMENT(matches, next)) {								\
+				/* It's a match! */												\
+				(reports)[res].position = idx;									\
+				(reports)[res++].state = next;									\
+				if (res == MAX_REPORTS)											\
+					break;														\
+			}																	\
+			(current) = next;													\
+			idx++;																\
+		}																		\
+	} else {																	\
+		/* Full rows for shallow states, sparse rows for deep states */		\
+		while (idx < (length)) {												\
+			if ((current) < (machine)->numFullStates) {							\
+				next = GET_NEXT_STATE(table, (current), input[idx]);			\
+			} else {															\
+				next = getSparseNextState((machine), (current), input[idx]);	\
+			}																	\
+			if (GET_1BIT_ELEMENT(matches, next)) {								\
+				/* It's a match! */												\
+				(reports)[res].position = idx;									\
+				(reports)[res++].state = next;									\
+				if (res == MAX_REPORTS)											\
+					break;														\
+			}																	\
+			(current) = next;													\
+			idx++;																\
 		}																		\
-		(current) = next;														\
-		idx++;																	\
 	}																			\
 }
 
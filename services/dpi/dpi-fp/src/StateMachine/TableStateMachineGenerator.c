@@ -6,93 +6,279 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 #include "../AhoCorasick/ACTypes.h"
 #include "../AhoCorasick/ACBuilder.h"
-#include "../AhoCorasick/NodeQueue.h"
 #include "../Common/HashMap/HashMap.h"
 #include "TableStateMachineGenerator.h"
 
-void putStates(TableStateMachine *machine, ACTree *tree, int verbose) {
-	Node *node, *fail;
-	NodeQueue queue;
+// Levels with fewer rows than this are filled by a single thread
+#define MIN_ROWS_PER_THREAD 256
+
+typedef struct {
+	TableStateMachine *machine;
+	Node **order; // Nodes in BFS order (i.e., sorted by depth)
+	int *levels; // levels[d] is the index in order of the first node of depth d
+	int numLevels; // Number of levels with full rows
+	int numThreads;
+	int threadId;
+	pthread_barrier_t *barrier;
+} FillerData;
+
+// Fills the row of a node from the row of its failure node (which is shallower, so it is already filled)
+// and then puts the node's own gotos: delta(s, c) = goto(s, c) if defined, otherwise delta(failure(s), c).
+static inline void fillRow(TableStateMachine *machine, Node *node) {
+	STATE_PTR_TYPE_WIDE *row;
 	Pair *pair;
-	STATE_PTR_TYPE_WIDE row[256];
-	STATE_PTR_TYPE_WIDE value;
-	int hasValue[256];
-	int i, done;
+	int i;
+
+	row = &(machine->table[GET_TABLE_IDX(node->id, 0)]);
+	if (node->depth == 0) {
+		memset(row, 0, sizeof(STATE_PTR_TYPE_WIDE) * 256);
+	} else {
+		memcpy(row, &(machine->table[GET_TABLE_IDX(node->failure->id, 0)]), sizeof(STATE_PTR_TYPE_WIDE) * 256);
+	}
+	for (i = 0; i < node->numGotos; i++) {
+		pair = &(node->gotos[i]);
+		row[(int)((unsigned char)(pair->c))] = pair->ptr->id;
+	}
+}
+
+// Fills the rows level by level. Each thread takes an equal share of every level, and all threads
+// wait for the level to complete before moving to the next one.
+static void *fillRows(void *param) {
+	FillerData *data = (FillerData*)param;
+	int d, first, count, from, to;
+
+	for (d = 0; d < data->numLevels; d++) {
+		first = data->levels[d];
+		count = data->levels[d + 1] - first;
+		if (count < MIN_ROWS_PER_THREAD * data->numThreads) {
+			from = (data->threadId == 0) ? first : first + count;
+			to = first + count;
+		} else {
+			from = first + (int)(((long)count * data->threadId) / data->numThreads);
+			to = first + (int)(((long)count * (data->threadId + 1)) / data->numThreads);
+		}
+		for (; from < to; from++) {
+			fillRow(data->machine, data->order[from]);
+		}
+		if (data->numThreads > 1) {
+			pthread_barrier_wait(data->barrier);
+		}
+	}
+	return NULL;
+}
+
+// Returns the next state of a node with a sparse row, by following its failure chain down to its default state
+static inline STATE_PTR_TYPE_WIDE getDeepNextState(TableStateMachine *machine, Node *node, unsigned char c) {
+	Node *next;
+
+	while (node->id >= machine->numFullStates) {
+		if ((next = acGetNextNode(node, (char)c)) != NULL)
+			return next->id;
+		node = node->failure;
+	}
+	return GET_NEXT_STATE(machine->table, node->id, c);
+}
+
+// Builds the sparse rows of the states in order[first, last). Only characters with a goto on the failure
+// chain (above the default state) can lead elsewhere than the default state's row.
+static void putSparseStates(TableStateMachine *machine, Node **order, int first, int last) {
+	Node *node, *fail, *def;
+	STATE_PTR_TYPE_WIDE next;
+	unsigned int numEntries, maxEntries, k;
+	unsigned char candidate[256];
+	int i, j, c;
+
+	maxEntries = 1024;
+	machine->sparseIdx = (unsigned int*)malloc(sizeof(unsigned int) * (last - first + 1));
+	machine->sparseDefault = (STATE_PTR_TYPE_WIDE*)malloc(sizeof(STATE_PTR_TYPE_WIDE) * (last - first));
+	machine->sparseChars = (unsigned char*)malloc(sizeof(unsigned char) * maxEntries);
+	machine->sparseNext = (STATE_PTR_TYPE_WIDE*)malloc(sizeof(STATE_PTR_TYPE_WIDE) * maxEntries);
+	if (!machine->sparseIdx || !machine->sparseDefault || !machine->sparseChars || !machine->sparseNext) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
+	memset(candidate, 0, sizeof(candidate));
+	numEntries = 0;
+
+	for (i = first; i < last; i++) {
+		node = order[i];
+		k = node->id - machine->numFullStates;
+
+		// Collect the candidate characters
+		for (fail = node; fail->id >= machine->numFullStates; fail = fail->failure) {
+			for (j = 0; j < fail->numGotos; j++) {
+				c = (unsigned char)(fail->gotos[j].c);
+				candidate[c] = 1;
+			}
+		}
+		def = fail;
+
+		machine->sparseIdx[k] = numEntries;
+		machine->sparseDefault[k] = def->id;
+		for (c = 0; c < 256; c++) {
+			if (!candidate[c])
+				continue;
+			candidate[c] = 0;
+			next = getDeepNextState(machine, node, (unsigned char)c);
+			if (next == GET_NEXT_STATE(machine->table, def->id, c))
+				continue;
+			if (numEntries == maxEntries) {
+				maxEntries *= 2;
+				machine->sparseChars = (unsigned char*)realloc(machine->sparseChars, sizeof(unsigned char) * maxEntries);
+				machine->sparseNext = (STATE_PTR_TYPE_WIDE*)realloc(machine->sparseNext, sizeof(STATE_PTR_TYPE_WIDE) * maxEntries);
+				if (!machine->sparseChars || !machine->sparseNext) {
+					fprintf(stderr, "FATAL: Out of memory\n");
+					exit(1);
+				}
+			}
+			machine->sparseChars[numEntries] = (unsigned char)c;
+			machine->sparseNext[numEntries] = next;
+			numEntries++;
+		}
+	}
+	machine->sparseIdx[last - first] = numEntries;
+}
 
-	nodequeue_init(&queue);
-	nodequeue_enqueue(&queue, tree->root);
+void putStates(TableStateMachine *machine, ACTree *tree, int numThreads, int fullDepth, int verbose) {
+	Node **order;
+	Node *node;
+	int *levels;
+	int i, head, tail, depth;
+	FillerData *data;
+	pthread_t *threads;
+	pthread_barrier_t barrier;
 
-	while (!nodequeue_isempty(&queue)) {
-		node = nodequeue_dequeue(&queue);
+	// BFS order of the nodes (and the matches, which are set serially)
+	order = (Node**)malloc(sizeof(Node*) * tree->size);
+	levels = (int*)malloc(sizeof(int) * (tree->size + 1));
+	if (!order || !levels) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
+	head = tail = 0;
+	depth = -1;
+	order[tail++] = tree->root;
+	while (head < tail) {
+		node = order[head];
 		node->marked = 1;
+		if (fullDepth > 0) {
+			// States are numbered in BFS order, so the ones with full rows come first
+			node->id = head;
+		}
+		if (node->depth != depth) {
+			depth = node->depth;
+			levels[depth] = head;
+		}
+		head++;
 
 #ifdef DEPTHMAP
 		machine->depthMap[node->id] = node->depth;
 #endif
 
-		memset(row, 0, sizeof(STATE_PTR_TYPE_WIDE) * 256);
-		memset(hasValue, 0, sizeof(int) * 256);
-
 		if (node->match) {
 			setMatch(machine, node->id, node->rules, node->numRules);
 		}
 
-		if (node->numGotos > 0) {
-			hashmap_iterator_reset(node->gotos);
-			while ((pair = hashmap_iterator_next(node->gotos)) != NULL) {
-				row[(int)((unsigned char)(pair->c))] = pair->ptr->id;
-				hasValue[(int)((unsigned char)(pair->c))] = 1;
-
-				if (!(pair->ptr->marked)) {
-					nodequeue_enqueue(&queue, pair->ptr);
-				} else {
-					printf("Found marked node!\n");
-				}
+		for (i = 0; i < node->numGotos; i++) {
+			if (!(node->gotos[i].ptr->marked)) {
+				order[tail++] = node->gotos[i].ptr;
+			} else {
+				printf("Found marked node!\n");
 			}
 		}
+	}
+	levels[depth + 1] = tail;
 
-		done = 0;
-		fail = node->failure;
-		do {
-			if (fail == NULL)
-				fail = tree->root;
-
-			if (fail->id == 0)
-				done = 1;
-
-			if (fail->numGotos > 0) {
-				hashmap_iterator_reset(fail->gotos);
-				while ((pair = hashmap_iterator_next(fail->gotos)) != NULL) {
-					if (!hasValue[(int)((unsigned char)(pair->c))]) {
-						row[(int)((unsigned char)(pair->c))] = pair->ptr->id;
-						hasValue[(int)((unsigned char)(pair->c))] = 1;
-					}
-				}
-			}
-			fail = fail->failure;
-		} while (!done);
+	if (numThreads < 1) {
+		numThreads = 1;
+	}
+	data = (FillerData*)malloc(sizeof(FillerData) * numThreads);
+	threads = (pthread_t*)malloc(sizeof(pthread_t) * numThreads);
+	if (!data || !threads) {
+		fprintf(stderr, "FATAL: Out of memory\n");
+		exit(1);
+	}
+	if (numThreads > 1) {
+		pthread_barrier_init(&barrier, NULL, numThreads);
+	}
 
-		for (i = 0; i < 256; i++) {
-			value = (hasValue[i] ? row[i] : 0);
-			setGoto(machine, node->id, (char)i, value);
+	for (i = 0; i < numThreads; i++) {
+		data[i].machine = machine;
+		data[i].order = order;
+		data[i].levels = levels;
+		data[i].numLevels = (machine->numFullStates < machine->numStates) ? fullDepth : depth + 1;
+		data[i].numThreads = numThreads;
+		data[i].threadId = i;
+		data[i].barrier = &barrier;
+	}
+	for (i = 1; i < numThreads; i++) {
+		if (pthread_create(&(threads[i]), NULL, fillRows, &(data[i])) != 0) {
+			fprintf(stderr, "[TableStateMachineGenerator] ERROR: Cannot create thread\n");
+			exit(1);
 		}
 	}
-	nodequeue_destroy_elements(&queue, 1);
+	fillRows(&(data[0]));
+	for (i = 1; i < numThreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	if (numThreads > 1) {
+		pthread_barrier_destroy(&barrier);
+	}
+
+	if (machine->numFullStates < machine->numStates) {
+		putSparseStates(machine, order, machine->numFullStates, tail);
+	}
+	free(threads);
+	free(data);
+	free(levels);
+	free(order);
 }
 
-TableStateMachine *generateTableStateMachine(const char *path, int max_rules, int verbose) {
+// Returns the number of states with depth less than fullDepth
+static unsigned int countFullStates(ACTree *tree, int fullDepth) {
+	unsigned int count;
+	int i;
+
+	if (fullDepth <= 0)
+		return tree->size;
+
+	count = 0;
+	for (i = 0; i < tree->size; i++) {
+		if (AC_GET_NODE(tree, i)->depth < fullDepth)
+			count++;
+	}
+	return count;
+}
+
+TableStateMachine *generateTableStateMachine(const char *path, int max_rules, int num_threads, int full_depth, int verbose) {
 	ACTree tree;
 	TableStateMachine *machine;
+	unsigned int numFullStates;
 	int count;
 
 	count = acBuildTree(&tree, path, max_rules);
 
-	machine = createTableStateMachine(tree.size, count);
+	numFullStates = countFullStates(&tree, full_depth);
+	machine = createTableStateMachine(tree.size, numFullStates, count);
 
 	// Put states data
-	putStates(machine, &tree, verbose);
+	putStates(machine, &tree, num_threads, full_depth, verbose);
+
+	if (numFullStates < tree.size) {
+		printf("+-------- Hybrid DFA Info --------+\n");
+		printf("| Full row depth: %15d |\n", full_depth);
+		printf("| Full row states: %14u |\n", numFullStates);
+		printf("| Sparse row states: %12u |\n", tree.size - numFullStates);
+		printf("| Sparse entries: %15u |\n", machine->sparseIdx[tree.size - numFullStates]);
+		printf("| Total bytes: %18lu |\n", (unsigned long)numFullStates * 4 * 256 +
+				(unsigned long)(tree.size - numFullStates) * 8 + (unsigned long)machine->sparseIdx[tree.size - numFullStates] * 5);
+		printf("+---------------------------------+\n");
+	}
 
 	// Destroy AC tree
 	acDestroyTreeNodes(&tree);
@@ -10,6 +10,9 @@
 
 #include "TableStateMachine.h"
 
-TableStateMachine *generateTableStateMachine(const char *path, int max_rules, int verbose);
+// Builds the DFA of the rules in path. The table rows are filled by num_threads threads,
+// with the same result as a single threaded build. If full_depth > 0, only states of depth
+// less than full_depth get full rows, and deeper states get sparse rows.
+TableStateMachine *generateTableStateMachine(const char *path, int max_rules, int num_threads, int full_depth, int verbose);
 
 #endif /* TABLESTATEMACHINEGENERATOR_H_ */
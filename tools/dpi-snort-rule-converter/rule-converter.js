@@ -53,7 +53,8 @@ function writeDpiServiceRules(dpiServiceRules, outputFolderPath) {
         // Write the rules in the format the DPI Service accepts (i.e. fileds without qutation marks and string with a Single quotation mark).
         dpiServiceRules.forEach(function(rule) {
 			var pattern = rule.pattern.replace(/'/g , "|27|"); // Conver ' to hexadecimal representaiton, due to limitations in the DPI Service JSON parser.
-            file.write("{" + "className:\'MatchRule\'" + "," + "rid:" + rule.rid + "," + "pattern:" + "\'" + pattern + "\'" + "," + "is_regex:" + rule.is_regex + "}" + "\n");
+            var position = (rule.offset !== undefined) ? "," + "offset:" + rule.offset + "," + "depth:" + rule.depth : ""; // Where Snort looks for the pattern, if it limits it.
+            file.write("{" + "className:\'MatchRule\'" + "," + "rid:" + rule.rid + "," + "pattern:" + "\'" + pattern + "\'" + "," + "is_regex:" + rule.is_regex + position + "}" + "\n");
         });
 
         file.end();